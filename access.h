@@ -0,0 +1,118 @@
+#ifndef ACCESS_H
+#define ACCESS_H
+
+#include <cstdint>
+#include "instruction.h"
+#include "memory.h"
+
+/*
+  How CPUCore reaches memory for instruction fetches and operands. Each
+  policy's Read and Write are inlined into the handlers. Block, vector
+  and FP operations use Memory's range checked calls whatever the
+  policy, as do the commands.
+*/
+
+/*
+  When faults trap (Memory::Trapping), the checked policies throw
+  GuestTrap from the slow path, so the faulting instruction goes no
+  further and the fast path is the same.
+*/
+static inline void TrapFault(Memory& m, uint32_t addr)
+{
+    if (m.Trapping() && m.TakeFault())
+    {
+	throw GuestTrap{ MemoryTrap, addr };
+    }
+}
+
+/* No checks at all, for trusted programs */
+struct FlatAccess
+{
+    static const bool Faults = false;
+    static const bool Watching = false;
+    static const bool Covering = false;
+    static const char* Name() { return "flat"; }
+    static uint32_t Read(Memory& m, uint32_t addr, uint32_t size)
+    {
+	return m.ReadFast(addr, size);
+    }
+    static void Write(Memory& m, uint32_t addr, uint32_t value, uint32_t size)
+    {
+	m.WriteFast(addr, value, size);
+    }
+};
+
+/*
+  The default. Accesses outside memory, and unaligned ones if the trap
+  is on, stop the CPU after the instruction.
+*/
+struct CheckedAccess
+{
+    static const bool Faults = true;
+    static const bool Watching = false;
+    static const bool Covering = false;
+    static const char* Name() { return "checked"; }
+    static uint32_t Read(Memory& m, uint32_t addr, uint32_t size)
+    {
+	if (m.Fits(addr, size))
+	{
+	    return m.ReadFast(addr, size);
+	}
+	uint32_t v = m.Read(addr, size);
+	TrapFault(m, addr);
+	return v;
+    }
+    static void Write(Memory& m, uint32_t addr, uint32_t value, uint32_t size)
+    {
+	if (m.Fits(addr, size))
+	{
+	    m.WriteFast(addr, value, size);
+	}
+	else
+	{
+	    m.Write(addr, value, size);
+	    TrapFault(m, addr);
+	}
+    }
+};
+
+/* Checked, and a write to a watched range stops the CPU after the
+   instruction */
+struct WatchAccess
+{
+    static const bool Faults = true;
+    static const bool Watching = true;
+    static const bool Covering = false;
+    static const char* Name() { return "watch"; }
+    static uint32_t Read(Memory& m, uint32_t addr, uint32_t size)
+    {
+	return CheckedAccess::Read(m, addr, size);
+    }
+    static void Write(Memory& m, uint32_t addr, uint32_t value, uint32_t size)
+    {
+	CheckedAccess::Write(m, addr, value, size);
+	m.CheckWatches(addr, size);
+    }
+};
+
+/*
+  Checked, and every control transfer counts an edge in the coverage
+  map, for fuzzing. The other policies have no coverage code at all.
+*/
+struct CoverAccess
+{
+    static const bool Faults = true;
+    static const bool Watching = false;
+    static const bool Covering = true;
+    static const char* Name() { return "cover"; }
+    static uint32_t Read(Memory& m, uint32_t addr, uint32_t size)
+    {
+	return CheckedAccess::Read(m, addr, size);
+    }
+    static void Write(Memory& m, uint32_t addr, uint32_t value, uint32_t size)
+    {
+	CheckedAccess::Write(m, addr, value, size);
+    }
+};
+
+#endif
@@ -159,6 +159,564 @@ next16:
 	cmp	#0xffffff80,r2
 	bne	fail
 
+;;; Displacement addressing
+	mov	#23,r0
+	mov	dtab,r1
+	mov	4(r1),r2
+	cmp	#0x1234,r2
+	bne	fail
+
+	mov	#24,r0
+	mov	#0x5678,r2
+	mov	r2,8(r1)
+	mov	dtab2,r3
+	cmp	(r3),r2
+	bne	fail
+
+	mov	#25,r0
+	add	#1,8(r1)
+	cmp	#0x5679,(r3)
+	bne	fail
+
+	mov	#26,r0
+	mov	-4(r3),r2
+	cmp	#0x1234,r2
+	bne	fail
+
+	mov	#27,r0
+	mov	dtab1(pc),r2
+	cmp	#0x1234,r2
+	bne	fail
+
+	mov	#28,r0
+	mov	#0x1234,r2
+	cmp	dtab1(pc),r2
+	bne	fail
+
+;;; Read-modify-write with auto-increment updates the register once
+	mov	#29,r0
+	mov	dtab2,r1
+	add	#1,(r1)+
+	cmp	#0x567a,(r3)
+	bne	fail
+	sub	#4,r1
+	cmp	r1,r3
+	bne	fail
+
+;;; Logic instructions
+	mov	#30,r0
+	mov	#0xf0f0,r1
+	and	#0xff00,r1
+	cmp	#0xf000,r1
+	bne	fail
+
+	mov	#31,r0
+	or	#0x0f,r1
+	cmp	#0xf00f,r1
+	bne	fail
+
+	mov	#32,r0
+	xor	#0xffff,r1
+	cmp	#0x0ff0,r1
+	bne	fail
+
+	mov	#33,r0
+	xor	r1,r1
+	bne	fail
+
+	mov	#34,r0
+	mov	#5,r1
+	neg	r1,r2
+	bcc	fail
+	cmp	#-5,r2
+	bne	fail
+
+	mov	#35,r0
+	com	#0,r2
+	bcc	fail
+	bpl	fail
+	cmp	#-1,r2
+	bne	fail
+
+;;; Shifts and rotates
+	mov	#36,r0
+	mov	#1,r1
+	lsl	#4,r1
+	cmp	#16,r1
+	bne	fail
+
+	mov	#37,r0
+	mov	#0x80000000,r1
+	lsl	#1,r1
+	bcc	fail
+	bne	fail
+
+	mov	#38,r0
+	mov	#0x100,r1
+	lsr	#4,r1
+	cmp	#0x10,r1
+	bne	fail
+
+	mov	#39,r0
+	mov	#3,r1
+	lsr	#1,r1
+	bcc	fail
+	cmp	#1,r1
+	bne	fail
+
+	mov	#40,r0
+	mov	#-16,r1
+	asr	#2,r1
+	cmp	#-4,r1
+	bne	fail
+
+	mov	#41,r0
+	mov	#3,r1
+	asl	#2,r1
+	cmp	#12,r1
+	bne	fail
+
+	mov	#42,r0
+	mov	#1,r1
+	ror	#1,r1
+	bcc	fail
+	cmp	#0x80000000,r1
+	bne	fail
+
+	mov	#43,r0
+	mov	#0x80000001,r1
+	rol	#4,r1
+	cmp	#0x18,r1
+	bne	fail
+
+	mov	#44,r0
+	mov	#0x81,r1
+	lsr.b	#1,r1
+	bcc	fail
+	cmp	#0x40,r1
+	bne	fail
+
+	mov	#45,r0
+	mov	#0x80,r1
+	asr.b	#1,r1
+	cmp	#-64,r1
+	bne	fail
+
+;;; Multi-word arithmetic
+	mov	#46,r0
+	mov	#-1,r1
+	mov	#0,r2
+	add	#1,r1
+	adc	#0,r2
+	cmp	#1,r2
+	bne	fail
+
+	mov	#47,r0
+	mov	#0,r1
+	mov	#1,r2
+	sub	#1,r1
+	bcc	fail
+	sbc	#0,r2
+	bne	fail
+
+;;; Block instructions
+	mov	#48,r0
+	mov	bsrc,r1
+	mov	bdst,r2
+	mov	#8,r3
+	bcpy	r1,r2,r3
+	cmp	#0,r3
+	bne	fail
+	sub	#8,r2
+	cmp	bdst,r2
+	bne	fail
+	cmp	#0x55667788,4(r2)
+	bne	fail
+
+	mov	#49,r0
+	mov	bsrc,r1
+	mov	#8,r3
+	bcmp	r1,r2,r3
+	bne	fail
+
+	mov	#50,r0
+	mov	#0x5a,r1
+	mov	#2,r3
+	mov	bdst,r2
+	add	#5,r2
+	bfil	r1,r2,r3
+	mov	bsrc,r1
+	mov	bdst,r2
+	mov	#8,r3
+	bcmp	r1,r2,r3
+	beq	fail
+	cmp	#3,r3
+	bne	fail
+	cmp.b	#0x5a,(r2)
+	bne	fail
+
+	mov	#51,r0
+	mov	success,r2
+	mov	r2,r4
+	mov	#0,r1
+	mov	#-1,r3
+	bscn	r1,r2,r3
+	bne	fail
+	sub	r4,r2
+	cmp	#17,r2
+	bne	fail
+
+	;; Overlapping copy up, from the end a chunk at a time
+	mov	#73,r0
+	mov	bover,r1
+	mov	bover,r2
+	add	#4,r2
+	mov	#16,r3
+	bcpy	r1,r2,r3
+	cmp	#0,r3
+	bne	fail
+	mov	bover,r4
+	cmp	#1,4(r4)
+	bne	fail
+	cmp	#2,8(r4)
+	bne	fail
+	cmp	#4,16(r4)
+	bne	fail
+
+;;; Vector instructions
+	mov	#52,r0
+	mov	vdata,r1
+	vld	(r1)+,v0
+	vld	(r1)+,v1
+	vadd.l	v1,v0
+	mov	vres,r2
+	vst	v0,(r2)
+	cmp	#0x11,(r2)
+	bne	fail
+	cmp	#0x80000000,12(r2)
+	bne	fail
+
+	mov	#53,r0
+	vld.w	#-3,v2
+	vmul.w	v1,v2
+	vst	v2,(r2)
+	cmp	#0xffd0,(r2)
+	bne	fail
+
+	mov	#54,r0
+	vld	vdata(pc),v3
+	vsub.b	v3,v0
+	vcmpeq.b v1,v0
+	vst.l	v0,r3
+	cmp	#-1,r3
+	bne	fail
+	vst	v0,(r2)
+	cmp	#0xff,12(r2)
+	bne	fail
+
+	mov	#55,r0
+	vld.b	#5,v4
+	vld.b	#-2,v5
+	vcmpgt.b v5,v4
+	vst.b	v4,r3
+	cmp	#0xff,r3
+	bne	fail
+	vmul.b	v4,v5
+	vst.w	v5,r3
+	cmp	#0x0202,r3
+	bne	fail
+
+;;; Floating point
+	mov	#56,r0
+	fmov.d	dtwo(pc),f0
+	fmov.d	dthree(pc),f1
+	fadd.d	f0,f1
+	ftoi.d	f1,r1
+	cmp	#5,r1
+	bne	fail
+
+	mov	#57,r0
+	fmul.d	f0,f1
+	itof.d	#16,f2
+	fsqrt.d	f2,f3
+	fdiv.d	f3,f1
+	ftoi.d	f1,r1
+	bvs	fail
+	cmp	#2,r1
+	bne	fail
+
+	mov	#58,r0
+	fcmp.d	f0,f1
+	beq	fail
+	bpl	fail
+	fcmp.d	f2,f2
+	bne	fail
+
+	mov	#59,r0
+	ldfps	#0
+	itof.d	#0,f4
+	fdiv.d	f4,f2
+	stfps	r1
+	and	#0x8,r1
+	beq	fail
+	ftoi.d	f2,r1
+	bvc	fail
+	cmp	#0x80000000,r1
+	bne	fail
+
+	mov	#60,r0
+	ldfps	#0
+	itof.s	#16777217,f5
+	ftoi.s	f5,r1
+	cmp	#16777216,r1
+	bne	fail
+	stfps	r1
+	and	#0x40,r1
+	beq	fail
+
+	mov	#61,r0
+	itof.d	#7,f0
+	itof.d	#2,f1
+	fdiv.d	f1,f0
+	ldfps	#1
+	ftoi.d	f0,r1
+	cmp	#3,r1
+	bne	fail
+	ldfps	#0
+	ftoi.d	f0,r1
+	cmp	#4,r1
+	bne	fail
+
+	mov	#62,r0
+	mov	vres,r2
+	fmov.d	f0,(r2)
+	fmov.d	(r2),f6
+	fcmp.d	f6,f0
+	bne	fail
+	fmov.s	f0,(r2)
+	cmp	#0x40600000,(r2)
+	bne	fail
+
+	mov	#63,r0
+	mov	dtab,r2
+	mov	#0x44332211,(r2)
+	mov	#0x88776655,4(r2)
+	mov	1(r2),r1
+	cmp	#0x55443322,r1
+	bne	fail
+	mov.w	3(r2),r1
+	cmp	#0x5544,r1
+	bne	fail
+	mov	#0xaabbccdd,2(r2)
+	cmp	#0xccdd2211,(r2)
+	bne	fail
+	cmp	#0x8877aabb,4(r2)
+	bne	fail
+
+	;; No input given, so nothing to read
+	mov	vres,r0
+	mov	#16,r1
+	emt	2
+	mov	r0,r1
+	mov	#64,r0
+	cmp	#0,r1
+	bne	fail
+
+	;; Built in host functions
+	mov	bdst,r0
+	mov	#0x41,r1
+	mov	#7,r2
+	emt	4
+	mov	bdst,r3
+	mov.b	#0,7(r3)
+	mov	bdst,r0
+	emt	5
+	mov	r0,r1
+	mov	#65,r0
+	cmp	#7,r1
+	bne	fail
+	mov	vres,r0
+	mov	bsrc,r1
+	mov	#8,r2
+	emt	3
+	mov	vres,r3
+	mov	r0,r1
+	mov	#65,r0
+	cmp	r3,r1
+	bne	fail
+	cmp	#0x55667788,4(r3)
+	bne	fail
+
+	mov	#1000000,r0
+	emt	6
+	mov	r0,r1
+	mov	#66,r0
+	cmp	#1000,r1
+	bne	fail
+	mov	#0xffffffff,r0
+	emt	6
+	mov	r0,r1
+	mov	#66,r0
+	cmp	#0xffff,r1
+	bne	fail
+	mov	bsrc,r0
+	mov	#4,r1
+	emt	7
+	mov	r0,r1
+	mov	#66,r0
+	cmp	#0xce4211d5,r1
+	bne	fail
+
+	;; Host heap
+	mov	#0x80000,r0
+	mov	#0x10000,r1
+	mov	#1,r2
+	emt	8
+	mov	r0,r1
+	mov	#67,r0
+	cmp	#1,r1
+	bne	fail
+	mov	#20,r0
+	emt	9
+	mov	r0,r5
+	mov	#67,r0
+	cmp	#0x80000,r5
+	bne	fail
+	mov	#100,r0
+	emt	9
+	mov	r0,r6
+	mov	#67,r0
+	cmp	#0x80020,r6
+	bne	fail
+	mov	#0x12345678,0(r5)
+	mov	r5,r0
+	mov	#1000,r1
+	emt	11
+	mov	r0,r7
+	mov	#67,r0
+	cmp	r5,r7
+	beq	fail
+	cmp	#0x12345678,0(r7)
+	bne	fail
+	mov	r7,r0
+	mov	#10,r1
+	emt	11
+	mov	r0,r1
+	mov	#67,r0
+	cmp	r7,r1
+	bne	fail
+
+	;; Freed blocks are reused by their size class
+	mov	#30,r0
+	emt	9
+	mov	r0,r1
+	mov	#68,r0
+	cmp	r5,r1
+	bne	fail
+	mov	r6,r0
+	emt	10
+	mov	#112,r0
+	emt	9
+	mov	r0,r1
+	mov	#68,r0
+	cmp	r6,r1
+	bne	fail
+	mov	r5,r0
+	emt	10
+	mov	r6,r0
+	emt	10
+	mov	r7,r0
+	emt	10
+	mov	#0x20000,r0
+	emt	9
+	mov	r0,r1
+	mov	#68,r0
+	cmp	#0,r1
+	bne	fail
+
+	;; No disk, so nothing starts
+	mov	vres,r0
+	mov	#16,r1
+	mov	#0,r2
+	emt	12
+	mov	r0,r1
+	mov	#69,r0
+	cmp	#0,r1
+	bne	fail
+	emt	14
+	mov	r0,r1
+	mov	#69,r0
+	cmp	#0,r1
+	bne	fail
+
+	;; Console reads that can't take anything
+	mov	vres,r0
+	mov	#0,r1
+	emt	18
+	mov	r0,r1
+	mov	#70,r0
+	cmp	#0,r1
+	bne	fail
+	mov	#0xfffffff0,r0
+	mov	#0x100,r1
+	emt	17
+	mov	r0,r1
+	mov	#70,r0
+	cmp	#0,r1
+	bne	fail
+
+	;; Traps, the handler sees the PC of the instruction, undone
+	mov	ttab,r2
+	mov	trapskip,(r2)
+	mov	trapskip,4(r2)
+	mov	trapskip,12(r2)
+	mov	ttab,r0
+	emt	20
+	mov	#71,r0
+	mov	#100,r2
+	mov	#7,r3
+	mov	#0,r6
+	sec
+tdiv:
+	div	r6,r2
+	bcc	fail
+	mov	tdiv,r1
+	cmp	r1,r11
+	bne	fail
+	cmp	#100,r2
+	bne	fail
+	cmp	#7,r3
+	bne	fail
+	;; No register pair starts at an odd one
+	mov	#5,r6
+tdivodd:
+	div	r6,r3
+	mov	tdivodd,r1
+	cmp	r1,r11
+	bne	fail
+	cmp	#7,r3
+	bne	fail
+
+	;; Illegal instructions and breakpoints, then no more traps
+	mov	#72,r0
+till:
+	.long	0xfe000000
+	mov	till,r3
+	cmp	r3,r11
+	bne	fail
+tbpt:
+	bpt
+	mov	tbpt,r3
+	cmp	r3,r11
+	bne	fail
+	mov	#0,r0
+	emt	20
+	mov	r0,r1
+	mov	#72,r0
+	mov	ttab,r3
+	cmp	r1,r3
+	bne	fail
+
 finished:
 	mov	success,r0
 	jsr	print
@@ -203,6 +761,12 @@ ploop2:
 pdone:
 	ret
 
+trapskip:
+	mov	(sp),r10
+	mov	4(sp),r11
+	add	#4,4(sp)
+	rti
+
 failmsg:
 	.db	"Failed at testpoint number ",0
 success:
@@ -210,5 +774,42 @@ success:
 
 	.align	4
 
+dtab:
+	.long	0
+dtab1:
+	.long	0x1234
+dtab2:
+	.long	0
+bsrc:
+	.long	0x11223344
+	.long	0x55667788
+bdst:
+	.zero	8
+bover:
+	.long	1
+	.long	2
+	.long	3
+	.long	4
+	.long	5
+vdata:
+	.long	1
+	.long	2
+	.long	3
+	.long	0x7fffffff
+	.long	0x10
+	.long	0x20
+	.long	0x30
+	.long	1
+vres:
+	.zero	16
+ttab:
+	.zero	32
+dtwo:
+	.long	0
+	.long	0x40000000
+dthree:
+	.long	0
+	.long	0x40080000
+
 	.zero	400
 stack:
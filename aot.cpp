@@ -0,0 +1,1107 @@
+#include <cstdint>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include "instruction.h"
+#include "aot.h"
+
+/*
+  stew-aot: translate an assembled image to C++, with one function per
+  basic block, for building as a shared object and loading into stew
+  with the "aot" command.
+
+    stew-aot image.hex image.map [out.cpp]
+    c++ -O2 -shared -fPIC -o image.so out.cpp   (with stew's headers)
+
+  Blocks are found from address 0 and the labels in the map, following
+  branches and direct calls. Anything the translator doesn't handle
+  (DIV, EMT, block, vector and FP instructions, HLT, BPT and odd uses
+  of PC) ends the block, and the interpreter runs it. Indirect jumps
+  and returns hand the target back to stew, which runs a translated
+  block if there is one there, or interprets otherwise.
+*/
+
+static const uint32_t MaxBlockInstrs = 256;
+
+std::vector<uint8_t> image;
+
+static const uint8_t FlagN = 1;
+static const uint8_t FlagZ = 2;
+static const uint8_t FlagV = 4;
+static const uint8_t FlagC = 8;
+static const uint8_t AllFlags = 15;
+
+struct Insn
+{
+    uint32_t addr;
+    Instruction instr;
+    uint32_t len;
+    /* Extra instruction stream words of the operands */
+    uint32_t srcWord;
+    uint32_t destWord;
+    /* Flags read before being set again after this instruction */
+    uint8_t liveAfter;
+};
+
+static bool InImage(uint32_t addr, uint32_t len)
+{
+    return addr <= image.size() && len <= image.size() - addr;
+}
+
+static uint32_t Word(uint32_t addr)
+{
+    return image[addr] | image[addr + 1] << 8 | image[addr + 2] << 16 |
+	static_cast<uint32_t>(image[addr + 3]) << 24;
+}
+
+static std::string Hex(uint64_t v)
+{
+    std::stringstream ss;
+    ss << "0x" << std::hex << v;
+    return ss.str();
+}
+
+static uint32_t SizeBytes(OperandSize size)
+{
+    return 1 << size;
+}
+
+static uint32_t SizeMask(uint32_t bytes)
+{
+    return static_cast<uint32_t>((uint64_t(1) << (bytes * 8)) - 1);
+}
+
+static bool IsBranch(InstrKind op)
+{
+    return op >= BEQ && op <= BR;
+}
+
+static bool UsesSource(InstrKind op)
+{
+    return (op >= MOV && op <= ROL) || op == JSR || op == JMP;
+}
+
+static bool UsesDest(InstrKind op)
+{
+    return op >= MOV && op <= ROL;
+}
+
+static uint32_t OperandWords(AddrMode mode, RegName reg)
+{
+    return mode == Displacement || (mode == IndirAutoInc && reg == PC);
+}
+
+/* PC can only be used for inline constants and PC relative addresses */
+static bool OperandOk(AddrMode mode, RegName reg, bool dest)
+{
+    if (reg >= MaxReg || mode > Displacement)
+    {
+	return false;
+    }
+    if (reg == PC)
+    {
+	return mode == Displacement || (mode == IndirAutoInc && !dest);
+    }
+    return true;
+}
+
+static bool Translatable(const Instruction& instr)
+{
+    InstrKind op = instr.value.op;
+    if (IsBranch(op) || op == NOP || op == RET || (op >= CLC && op <= SEZ))
+    {
+	return true;
+    }
+    if (!UsesSource(op) || op == DIV || instr.value.size == Op64)
+    {
+	return false;
+    }
+    if (!OperandOk(instr.value.srcMode, instr.value.source, false))
+    {
+	return false;
+    }
+    return !UsesDest(op) ||
+	OperandOk(instr.value.destMode, instr.value.dest, true);
+}
+
+static bool Decode(uint32_t addr, Insn& in)
+{
+    if (addr & 3 || !InImage(addr, 4))
+    {
+	return false;
+    }
+    in.addr = addr;
+    in.instr.value.word = Word(addr);
+    in.len = 4;
+    in.srcWord = 0;
+    in.destWord = 0;
+    if (!Translatable(in.instr))
+    {
+	return false;
+    }
+    InstrKind op = in.instr.value.op;
+    if (UsesSource(op) &&
+	OperandWords(in.instr.value.srcMode, in.instr.value.source))
+    {
+	if (!InImage(addr + in.len, 4))
+	{
+	    return false;
+	}
+	in.srcWord = Word(addr + in.len);
+	in.len += 4;
+    }
+    if (UsesDest(op) &&
+	OperandWords(in.instr.value.destMode, in.instr.value.dest))
+    {
+	if (!InImage(addr + in.len, 4))
+	{
+	    return false;
+	}
+	in.destWord = Word(addr + in.len);
+	in.len += 4;
+    }
+    return true;
+}
+
+struct Block
+{
+    uint32_t start;
+    uint32_t end;
+    std::vector<Insn> insns;
+    /* Flags read before being set from the start of the block */
+    uint8_t liveIn;
+};
+
+/* Decode a block, adding the places it can go to next to todo */
+static Block FindBlock(uint32_t start, std::set<uint32_t>& todo)
+{
+    Block b;
+    b.start = start;
+    b.liveIn = 0;
+    uint32_t addr = start;
+    for(;;)
+    {
+	Insn in;
+	in.liveAfter = AllFlags;
+	if (!Decode(addr, in))
+	{
+	    /* The interpreter runs this, and EMT etc. come back after it */
+	    if (InImage(addr, 4))
+	    {
+		Instruction instr;
+		instr.value.word = Word(addr);
+		InstrKind op = instr.value.op;
+		if (op == EMT || (op >= BCPY && op <= BSCN))
+		{
+		    todo.insert(addr + 4);
+		}
+	    }
+	    break;
+	}
+	b.insns.push_back(in);
+	InstrKind op = in.instr.value.op;
+	uint32_t next = addr + in.len;
+	if (IsBranch(op))
+	{
+	    todo.insert(next + in.instr.value.branch);
+	    if (op != BR)
+	    {
+		todo.insert(next);
+	    }
+	    addr = next;
+	    break;
+	}
+	if (op == JSR || op == JMP || op == RET)
+	{
+	    bool constant = in.instr.value.srcMode == IndirAutoInc &&
+		in.instr.value.source == PC;
+	    if (op != RET && constant)
+	    {
+		todo.insert(in.srcWord);
+	    }
+	    if (op == JSR)
+	    {
+		todo.insert(next);
+	    }
+	    addr = next;
+	    break;
+	}
+	addr = next;
+	if (b.insns.size() == MaxBlockInstrs)
+	{
+	    todo.insert(addr);
+	    break;
+	}
+    }
+    b.end = addr;
+    return b;
+}
+
+static uint8_t BranchUses(InstrKind op)
+{
+    switch(op)
+    {
+    case BNE:
+    case BEQ:
+	return FlagZ;
+    case BLT:
+    case BGT:
+    case BGE:
+    case BLE:
+	return FlagN | FlagV;
+    case BHI:
+    case BLOS:
+	return FlagC | FlagZ;
+    case BVS:
+    case BVC:
+	return FlagV;
+    case BCC:
+    case BCS:
+	return FlagC;
+    case BPL:
+    case BMI:
+	return FlagN;
+    default:
+	break;
+    }
+    return 0;
+}
+
+static uint8_t FlagUses(InstrKind op)
+{
+    if (IsBranch(op))
+    {
+	return BranchUses(op);
+    }
+    return op == ADC || op == SBC ? FlagC : 0;
+}
+
+static uint8_t FlagDefs(InstrKind op)
+{
+    switch(op)
+    {
+    case AND:
+    case OR:
+    case XOR:
+	return FlagN | FlagZ | FlagV;
+    case CLC:
+    case SEC:
+	return FlagC;
+    case CLV:
+    case SEV:
+	return FlagV;
+    case CLN:
+    case SEN:
+	return FlagN;
+    case CLZ:
+    case SEZ:
+	return FlagZ;
+    default:
+	break;
+    }
+    return op >= MOV && op <= ROL ? AllFlags : 0;
+}
+
+/* A write to memory may hit code, which leaves the block after it */
+static bool Stores(const Instruction& instr)
+{
+    return UsesDest(instr.value.op) && instr.value.op != CMP &&
+	instr.value.destMode != Direct && instr.value.destMode != Immediate;
+}
+
+static bool ConstantTarget(const Insn& in)
+{
+    return in.instr.value.srcMode == IndirAutoInc && in.instr.value.source == PC;
+}
+
+/* A load or store may fault and trap, which leaves before the instruction */
+static bool Accesses(const Insn& in)
+{
+    Instruction instr = in.instr;
+    InstrKind op = instr.value.op;
+    if (op == JSR || op == RET)
+    {
+	return true;
+    }
+    if (UsesSource(op) && instr.value.srcMode != Direct &&
+	instr.value.srcMode != Immediate && !ConstantTarget(in))
+    {
+	return true;
+    }
+    return UsesDest(op) && instr.value.destMode != Direct &&
+	instr.value.destMode != Immediate;
+}
+
+typedef std::map<uint32_t, Block> BlockMap;
+
+/*
+  Flag liveness. Flags are live at the start of a block if some path
+  from there reads them before setting them. Wherever control can go
+  somewhere other than a translated block (the interpreter, an indirect
+  jump or return, or a write to code) all flags are taken to be live.
+*/
+static uint8_t LiveAt(const BlockMap& blocks, uint32_t addr)
+{
+    auto it = blocks.find(addr);
+    return it == blocks.end() ? AllFlags : it->second.liveIn;
+}
+
+static uint8_t LiveOut(const BlockMap& blocks, const Block& b)
+{
+    const Insn& last = b.insns.back();
+    InstrKind op = last.instr.value.op;
+    uint32_t next = last.addr + last.len;
+    if (IsBranch(op))
+    {
+	uint8_t live = LiveAt(blocks, next + last.instr.value.branch);
+	return op == BR ? live : live | LiveAt(blocks, next);
+    }
+    if (op == JMP || op == JSR)
+    {
+	return ConstantTarget(last) ? LiveAt(blocks, last.srcWord) : AllFlags;
+    }
+    if (op == RET)
+    {
+	return AllFlags;
+    }
+    return LiveAt(blocks, b.end);
+}
+
+/* Work back through the block, noting what is live after each one */
+static uint8_t BlockLiveness(const BlockMap& blocks, Block& b)
+{
+    uint8_t live = LiveOut(blocks, b);
+    for(size_t i = b.insns.size(); i-- > 0;)
+    {
+	Insn& in = b.insns[i];
+	if (Stores(in.instr))
+	{
+	    live = AllFlags;
+	}
+	in.liveAfter = live;
+	InstrKind op = in.instr.value.op;
+	live = (live & ~FlagDefs(op)) | FlagUses(op);
+	if (Accesses(in))
+	{
+	    live = AllFlags;
+	}
+    }
+    return live;
+}
+
+static void Liveness(BlockMap& blocks)
+{
+    bool changed = true;
+    while(changed)
+    {
+	changed = false;
+	for(auto& b : blocks)
+	{
+	    uint8_t live = BlockLiveness(blocks, b.second);
+	    if (live != b.second.liveIn)
+	    {
+		b.second.liveIn = live;
+		changed = true;
+	    }
+	}
+    }
+}
+
+/*
+  With optimise set, guest registers and flags used by a block are
+  kept in locals, loaded on entry and written back at each exit, and
+  flags nobody reads are not worked out. Otherwise every instruction
+  works on the state directly.
+*/
+class Emitter
+{
+public:
+    Emitter(std::ostream& out, bool optimise) : out(out), optimise(optimise) {}
+    void EmitBlock(const Block& b);
+
+private:
+    std::string Reg(RegName r);
+    void Def(RegName r);
+    std::string Flag(uint8_t flag);
+    void SetFlag(uint8_t flag, const std::string& v);
+    void SetFlags(const std::string& v, uint64_t mask,
+		  const std::string& overflow, uint8_t defs = AllFlags);
+    std::string Condition(InstrKind op);
+    void Exit(const std::string& pc);
+    void TrapExit();
+    void Load(const char* name, const std::string& addr, uint32_t bytes);
+    void Address(AddrMode mode, RegName reg, uint32_t word, uint32_t pcBase,
+		 const char* name);
+    void Source(const char* name);
+    void DestAddr();
+    void DestValue(const char* name);
+    void Store(const std::string& v);
+    void EmitInsn(const Insn& in);
+
+    std::ostream& out;
+    /* The body of the current block */
+    std::stringstream os;
+    bool optimise;
+    const Insn* cur;
+    uint32_t size;
+    uint32_t instrs;
+    uint32_t fetches;
+    /* How far the current instruction has stepped each register */
+    int32_t steps[MaxReg];
+    /* Registers used, and registers and flags changed so far */
+    uint32_t usedRegs;
+    uint32_t defRegs;
+    uint8_t defFlags;
+};
+
+std::string Emitter::Reg(RegName r)
+{
+    std::stringstream ss;
+    usedRegs |= 1 << r;
+    if (optimise)
+    {
+	ss << "r" << r;
+    }
+    else
+    {
+	ss << "r[" << r << "]";
+    }
+    return ss.str();
+}
+
+void Emitter::Def(RegName r)
+{
+    usedRegs |= 1 << r;
+    defRegs |= 1 << r;
+}
+
+std::string Emitter::Flag(uint8_t flag)
+{
+    static const char names[] = "nzvc";
+    int i = flag == FlagN ? 0 : flag == FlagZ ? 1 : flag == FlagV ? 2 : 3;
+    return (optimise ? "f" : "s->") + std::string(1, names[i]);
+}
+
+void Emitter::SetFlag(uint8_t flag, const std::string& v)
+{
+    if (cur->liveAfter & flag)
+    {
+	defFlags |= flag;
+	os << "\t" << Flag(flag) << " = " << v << ";\n";
+    }
+}
+
+/* N, Z and C from the result v, V from overflow */
+void Emitter::SetFlags(const std::string& v, uint64_t mask,
+		       const std::string& overflow, uint8_t defs)
+{
+    if (defs & FlagN)
+    {
+	SetFlag(FlagN, v + " & " + Hex((mask + 1) >> 1));
+    }
+    if (defs & FlagZ)
+    {
+	SetFlag(FlagZ, "!(" + v + " & " + Hex(mask) + ")");
+    }
+    if (defs & FlagC)
+    {
+	SetFlag(FlagC, v + " & " + Hex(mask + 1));
+    }
+    if (defs & FlagV)
+    {
+	SetFlag(FlagV, overflow);
+    }
+}
+
+std::string Emitter::Condition(InstrKind op)
+{
+    std::string n = Flag(FlagN);
+    std::string z = Flag(FlagZ);
+    std::string v = Flag(FlagV);
+    std::string c = Flag(FlagC);
+    switch(op)
+    {
+    case BNE:
+	return "!" + z;
+    case BEQ:
+	return z;
+    case BLT:
+	return n + " | " + v;
+    case BGT:
+	return n + " ^ " + v;
+    case BGE:
+	return "!(" + n + " | " + v + ")";
+    case BLE:
+	return "!(" + n + " ^ " + v + ")";
+    case BHI:
+	return "!(" + c + " | " + z + ")";
+    case BLOS:
+	return c + " | " + z;
+    case BVS:
+	return v;
+    case BVC:
+	return "!" + v;
+    case BCC:
+	return "!" + c;
+    case BCS:
+	return c;
+    case BPL:
+	return "!" + n;
+    case BMI:
+	return n;
+    default:
+	break;
+    }
+    return "true";
+}
+
+/* Leave the block, writing back state and counting what was done */
+void Emitter::Exit(const std::string& pc)
+{
+    if (optimise)
+    {
+	for(int r = R0; r < MaxReg; r++)
+	{
+	    if (defRegs & (1 << r))
+	    {
+		os << "\tr[" << r << "] = r" << r << ";\n";
+	    }
+	}
+	for(uint8_t f = FlagN; f <= FlagC; f <<= 1)
+	{
+	    if (defFlags & f)
+	    {
+		os << "\ts->" << Flag(f).substr(1) << " = " << Flag(f)
+		   << ";\n";
+	    }
+	}
+    }
+    os << "\ts->instrCount += " << instrs << ";\n"
+       << "\ts->fetchCount += " << fetches << ";\n"
+       << "\tr[PC] = " << pc << ";\n"
+       << "\treturn;\n";
+}
+
+/* Leave with the state from before the current instruction, for a trap */
+void Emitter::TrapExit()
+{
+    os << "\t{\n";
+    for(int r = R0; r < MaxReg; r++)
+    {
+	if ((optimise && (defRegs & (1 << r))) || steps[r])
+	{
+	    os << "\t    r[" << r << "] = " << Reg(static_cast<RegName>(r));
+	    if (steps[r] > 0)
+	    {
+		os << " - " << steps[r];
+	    }
+	    else if (steps[r] < 0)
+	    {
+		os << " + " << -steps[r];
+	    }
+	    os << ";\n";
+	}
+    }
+    for(uint8_t f = FlagN; f <= FlagC; f <<= 1)
+    {
+	if (optimise && (defFlags & f))
+	{
+	    os << "\t    s->" << Flag(f).substr(1) << " = " << Flag(f) << ";\n";
+	}
+    }
+    os << "\t    s->instrCount += " << instrs - 1 << ";\n"
+       << "\t    s->fetchCount += " << fetches - cur->len / 4 << ";\n"
+       << "\t    r[PC] = " << Hex(cur->addr) << ";\n"
+       << "\t    return;\n"
+       << "\t}\n";
+}
+
+void Emitter::Load(const char* name, const std::string& addr,
+		   uint32_t bytes)
+{
+    os << "\tuint32_t " << name << ";\n"
+       << "\tif (!AotLoad(s, " << addr << ", " << bytes << ", " << name
+       << "))\n";
+    TrapExit();
+}
+
+void Emitter::Address(AddrMode mode, RegName reg, uint32_t word,
+		      uint32_t pcBase, const char* name)
+{
+    /* SP and PC always step by 4 */
+    uint32_t step = reg == SP || reg == PC ? 4 : size;
+    os << "\tuint32_t " << name << " = ";
+    switch(mode)
+    {
+    case Indir:
+	os << Reg(reg) << ";\n";
+	break;
+    case IndirAutoInc:
+	Def(reg);
+	steps[reg] += step;
+	os << Reg(reg) << ";\n"
+	   << "\t" << Reg(reg) << " += " << step << ";\n";
+	break;
+    case AutoDecIndir:
+	Def(reg);
+	steps[reg] -= step;
+	os << "(" << Reg(reg) << " -= " << step << ");\n";
+	break;
+    case Displacement:
+	if (reg == PC)
+	{
+	    os << Hex(pcBase + word) << ";\n";
+	}
+	else
+	{
+	    os << Reg(reg) << " + " << Hex(word) << ";\n";
+	}
+	break;
+    default:
+	break;
+    }
+}
+
+void Emitter::Source(const char* name)
+{
+    Instruction instr = cur->instr;
+    AddrMode mode = instr.value.srcMode;
+    RegName reg = instr.value.source;
+    switch(mode)
+    {
+    case Direct:
+	os << "\tuint32_t " << name << " = " << Reg(reg) << ";\n";
+	return;
+    case Immediate:
+	os << "\tuint32_t " << name << " = "
+	   << Hex(static_cast<uint32_t>(instr.value.srcImm)) << ";\n";
+	return;
+    case IndirAutoInc:
+	if (reg == PC)
+	{
+	    /* Only the operand's size of the word is read, as for memory */
+	    os << "\tuint32_t " << name << " = "
+	       << Hex(cur->srcWord & SizeMask(size)) << ";\n";
+	    return;
+	}
+	break;
+    default:
+	break;
+    }
+    /* PC relative addresses are from after the displacement word */
+    Address(mode, reg, cur->srcWord, cur->addr + 8, "sa");
+    Load(name, "sa", size);
+}
+
+void Emitter::DestAddr()
+{
+    Instruction instr = cur->instr;
+    AddrMode mode = instr.value.destMode;
+    if (mode != Direct && mode != Immediate)
+    {
+	uint32_t srcWords = cur->len - 4 -
+	    OperandWords(mode, instr.value.dest) * 4;
+	Address(mode, instr.value.dest, cur->destWord,
+		cur->addr + 8 + srcWords, "da");
+    }
+}
+
+void Emitter::DestValue(const char* name)
+{
+    Instruction instr = cur->instr;
+    switch(instr.value.destMode)
+    {
+    case Direct:
+	os << "\tuint32_t " << name << " = " << Reg(instr.value.dest) << ";\n";
+	break;
+    case Immediate:
+	os << "\tuint32_t " << name << " = "
+	   << Hex(static_cast<uint32_t>(instr.value.destImm)) << ";\n";
+	break;
+    default:
+	Load(name, "da", size);
+	break;
+    }
+}
+
+void Emitter::Store(const std::string& v)
+{
+    Instruction instr = cur->instr;
+    switch(instr.value.destMode)
+    {
+    case Direct:
+	Def(instr.value.dest);
+	os << "\t" << Reg(instr.value.dest) << " = AotSignExtend(" << v
+	   << ", " << size << ");\n";
+	break;
+    case Immediate:
+	/* Storing to a constant has no effect */
+	break;
+    default:
+	os << "\tif (!AotStore(s, da, " << v << ", " << size << ", hit))\n";
+	TrapExit();
+	break;
+    }
+}
+
+void Emitter::EmitInsn(const Insn& in)
+{
+    cur = &in;
+    Instruction instr = in.instr;
+    InstrKind op = instr.value.op;
+    size = SizeBytes(instr.value.size);
+    uint64_t mask = (uint64_t(1) << (size * 8)) - 1;
+    std::string m = Hex(mask);
+    std::string sign = Hex((mask + 1) >> 1);
+    uint32_t next = in.addr + in.len;
+    instrs++;
+    fetches += in.len / 4;
+    for(auto& step : steps)
+    {
+	step = 0;
+    }
+
+    os << "    /* " << std::hex << std::setw(8) << std::setfill('0')
+       << in.addr << std::dec << " */\n"
+       << "    {\n";
+    switch(op)
+    {
+    case NOP:
+	break;
+
+    case MOV:
+	Source("v");
+	DestAddr();
+	Store("v");
+	SetFlags("v", mask, "false");
+	break;
+
+    case ADD:
+    case ADC:
+	Source("v1");
+	DestAddr();
+	DestValue("v2");
+	os << "\tuint64_t v = static_cast<uint64_t>(v1) + v2"
+	   << (op == ADC ? " + " + Flag(FlagC) : "") << ";\n";
+	Store("v");
+	SetFlags("v", mask, "AotAddOverflow(v, v1, v2, " + sign + ")");
+	break;
+
+    case SUB:
+    case SBC:
+	Source("src");
+	DestAddr();
+	DestValue("dest");
+	os << "\tuint64_t v = static_cast<uint64_t>(dest) - src"
+	   << (op == SBC ? " - " + Flag(FlagC) : "") << ";\n";
+	Store("v");
+	SetFlags("v", mask, "AotSubOverflow(v, src, dest, " + sign + ")");
+	break;
+
+    case CMP:
+	Source("src");
+	DestAddr();
+	DestValue("dest");
+	os << "\tuint64_t v = static_cast<uint64_t>(src) - dest;\n";
+	SetFlags("v", mask, "AotCmpOverflow(v, src, dest, " + sign + ")");
+	break;
+
+    case MUL:
+	Source("v1");
+	DestAddr();
+	DestValue("v2");
+	os << "\tuint64_t v = static_cast<uint64_t>(v2) * v1;\n";
+	Store("v");
+	SetFlags("v", mask, "false");
+	break;
+
+    case AND:
+    case OR:
+    case XOR:
+    {
+	const char* expr = op == AND ? "&" : op == OR ? "|" : "^";
+	Source("src");
+	DestAddr();
+	DestValue("dest");
+	os << "\tuint32_t v = dest " << expr << " src;\n";
+	Store("v");
+	/* C is not affected */
+	SetFlags("(v & " + m + ")", mask, "false", FlagN | FlagZ | FlagV);
+	break;
+    }
+
+    case NEG:
+	Source("v1");
+	os << "\tuint32_t src = v1 & " << m << ";\n";
+	DestAddr();
+	os << "\tuint64_t v = static_cast<uint64_t>(0) - src;\n";
+	Store("v");
+	SetFlags("v", mask, "AotSubOverflow(v, src, 0, " + sign + ")");
+	break;
+
+    case COM:
+	Source("v1");
+	os << "\tuint32_t v = ~v1 & " << m << ";\n";
+	DestAddr();
+	Store("v");
+	SetFlags("v", mask, "false", FlagN | FlagZ | FlagV);
+	SetFlag(FlagC, "true");
+	break;
+
+    case ASR:
+    case ASL:
+    case LSR:
+    case LSL:
+    case ROR:
+    case ROL:
+	Source("count");
+	DestAddr();
+	DestValue("x");
+	os << "\tuint64_t v = AotShift(static_cast<InstrKind>(" << op
+	   << "), x & " << m << ", count, " << size << ");\n";
+	Store("v");
+	SetFlags("v", mask, "AotShiftOverflow(v, 0, 0, " + sign + ")");
+	break;
+
+    case CLC:
+	SetFlag(FlagC, "false");
+	break;
+    case CLV:
+	SetFlag(FlagV, "false");
+	break;
+    case CLN:
+	SetFlag(FlagN, "false");
+	break;
+    case CLZ:
+	SetFlag(FlagZ, "false");
+	break;
+    case SEC:
+	SetFlag(FlagC, "true");
+	break;
+    case SEV:
+	SetFlag(FlagV, "true");
+	break;
+    case SEN:
+	SetFlag(FlagN, "true");
+	break;
+    case SEZ:
+	SetFlag(FlagZ, "true");
+	break;
+
+    case JMP:
+	Source("v");
+	Exit("v");
+	break;
+
+    case JSR:
+	Source("v");
+	Def(SP);
+	os << "\tif (!AotStore(s, " << Reg(SP) << " - 4, " << Hex(next)
+	   << ", 4, hit))\n";
+	TrapExit();
+	os << "\t" << Reg(SP) << " -= 4;\n";
+	Exit("v");
+	break;
+
+    case RET:
+	Def(SP);
+	Load("v", Reg(SP), 4);
+	os << "\t" << Reg(SP) << " += 4;\n";
+	Exit("v");
+	break;
+
+    default:
+	if (IsBranch(op))
+	{
+	    uint32_t target = next + instr.value.branch;
+	    Exit(op == BR ? Hex(target) :
+		 "(" + Condition(op) + ") ? " + Hex(target) + " : " +
+		 Hex(next));
+	}
+	break;
+    }
+    os << "    }\n";
+    if (Stores(instr))
+    {
+	/* A write to code stops the block after this instruction */
+	os << "    if (hit)\n"
+	   << "    {\n";
+	Exit(Hex(next));
+	os << "    }\n";
+    }
+}
+
+void Emitter::EmitBlock(const Block& b)
+{
+    out << "static const uint32_t words_" << std::hex << b.start << "[] =\n{";
+    for(uint32_t a = b.start; a < b.end; a += 4)
+    {
+	out << ((a - b.start) % 32 ? " " : "\n    ") << Hex(Word(a)) << ",";
+    }
+    out << "\n};\n\n";
+
+    os.str("");
+    instrs = 0;
+    fetches = 0;
+    usedRegs = 0;
+    defRegs = 0;
+    defFlags = 0;
+    for(auto& in : b.insns)
+    {
+	EmitInsn(in);
+    }
+    InstrKind last = b.insns.back().instr.value.op;
+    if (!IsBranch(last) && last != JMP && last != JSR && last != RET)
+    {
+	os << "    {\n";
+	Exit(Hex(b.end));
+	os << "    }\n";
+    }
+
+    out << "static void block_" << b.start << std::dec << "(AotState* s)\n"
+	<< "{\n"
+	<< "    uint32_t* r = s->regs;\n"
+	<< "    bool hit = false;\n"
+	<< "    (void)hit;\n";
+    if (optimise)
+    {
+	for(int r = R0; r < MaxReg; r++)
+	{
+	    if (usedRegs & (1 << r))
+	    {
+		out << "    uint32_t r" << r << " = r[" << r << "];\n";
+	    }
+	}
+	out << "    bool fn = s->n, fz = s->z, fv = s->v, fc = s->c;\n"
+	    << "    (void)fn, (void)fz, (void)fv, (void)fc;\n";
+    }
+    out << os.str() << "}\n\n";
+}
+
+static bool ReadImage(const char* file)
+{
+    std::ifstream f(file);
+    if (!f)
+    {
+	return false;
+    }
+    uint32_t v;
+    while(f >> std::hex >> v)
+    {
+	image.push_back(v);
+    }
+    return true;
+}
+
+/* Lines from asm are "name: address" */
+static bool ReadMap(const char* file, std::set<uint32_t>& entries)
+{
+    std::ifstream f(file);
+    if (!f)
+    {
+	return false;
+    }
+    std::string name;
+    uint32_t addr;
+    while(f >> name >> std::hex >> addr)
+    {
+	entries.insert(addr);
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    bool optimise = true;
+    if (argc > 1 && std::string(argv[1]) == "-O0")
+    {
+	optimise = false;
+	argc--;
+	argv++;
+    }
+    if (argc < 3)
+    {
+	std::cerr << "Usage: stew-aot [-O0] image.hex image.map [out.cpp]"
+		  << std::endl;
+	return 1;
+    }
+    if (!ReadImage(argv[1]))
+    {
+	std::cerr << "Could not open file: " << argv[1] << std::endl;
+	return 1;
+    }
+    std::set<uint32_t> todo = { 0 };
+    if (!ReadMap(argv[2], todo))
+    {
+	std::cerr << "Could not open file: " << argv[2] << std::endl;
+	return 1;
+    }
+    std::ostream *out = &std::cout;
+    std::ofstream outf;
+    if (argc > 3)
+    {
+	outf.open(argv[3]);
+	if (!outf)
+	{
+	    std::cerr << "Could not open file: " << argv[3] << std::endl;
+	    return 1;
+	}
+	out = &outf;
+    }
+
+    std::map<uint32_t, Block> blocks;
+    while(!todo.empty())
+    {
+	uint32_t addr = *todo.begin();
+	todo.erase(todo.begin());
+	if (!blocks.count(addr))
+	{
+	    Block b = FindBlock(addr, todo);
+	    if (!b.insns.empty())
+	    {
+		blocks[addr] = b;
+	    }
+	}
+    }
+
+    if (optimise)
+    {
+	Liveness(blocks);
+    }
+
+    *out << "/* Generated by stew-aot from " << argv[1] << " */\n"
+	 << "#include \"aot.h\"\n\n";
+    Emitter emit(*out, optimise);
+    for(auto& b : blocks)
+    {
+	emit.EmitBlock(b.second);
+    }
+    *out << "static const AotEntry entries[] =\n{\n";
+    for(auto& b : blocks)
+    {
+	InstrKind exit = b.second.insns.back().instr.value.op;
+	if (!IsBranch(exit) && exit != JMP && exit != JSR && exit != RET)
+	{
+	    exit = NOP;
+	}
+	*out << std::hex << "    { " << Hex(b.second.start) << ", "
+	     << Hex(b.second.end) << ", words_" << b.second.start
+	     << ", block_" << b.second.start << ", " << std::dec << exit
+	     << " },\n";
+    }
+    *out << std::dec << "};\n\n"
+	 << "extern \"C\" const AotEntry* " AOT_BLOCKS_SYMBOL
+	    "(uint32_t* count, uint32_t* version)\n"
+	 << "{\n"
+	 << "    *count = sizeof(entries) / sizeof(entries[0]);\n"
+	 << "    *version = AotVersion;\n"
+	 << "    return entries;\n"
+	 << "}\n";
+    std::cerr << "Translated " << blocks.size() << " blocks" << std::endl;
+    return 0;
+}
@@ -0,0 +1,206 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include <cstdint>
+#include <cstring>
+#include "instruction.h"
+
+/*
+  Interface between stew and the code written by stew-aot. Each
+  translated block is a function working on the CPU's registers and
+  on guest memory through the state. It sets the PC to where to carry
+  on, and adds the instructions and instruction words it ran to the
+  counts. Loads outside memory or unaligned, and all stores, go back to
+  stew, so they behave exactly as in the interpreter. If one of those
+  faults and traps, the block leaves at once with the state as it was
+  before the instruction and the PC at it, and stew takes the trap.
+*/
+const uint32_t AotVersion = 3;
+
+struct AotState
+{
+    uint32_t* regs;
+    bool n, z, v, c;
+    uint8_t* mem;
+    uint32_t memSize;
+    uint64_t instrCount;
+    uint64_t fetchCount;
+    void* ctx;
+    /* Set by load or store for a fault that traps, at trapAddr */
+    bool trapped;
+    uint32_t trapAddr;
+    uint32_t (*load)(AotState* s, uint32_t addr, uint32_t size);
+    /* Returns true if the write hit code, the block must then stop */
+    bool (*store)(AotState* s, uint32_t addr, uint32_t value, uint32_t size);
+};
+
+typedef void (*AotFunc)(AotState* s);
+
+/* A translated block, and the memory it was translated from */
+struct AotEntry
+{
+    uint32_t start;
+    uint32_t end;
+    const uint32_t* words;
+    AotFunc fn;
+    /* The InstrKind of a JMP, JSR, RET or branch ending it, else NOP */
+    uint32_t exit;
+};
+
+/* The one symbol a translated image exports */
+typedef const AotEntry* (*AotBlocksFunc)(uint32_t* count, uint32_t* version);
+#define AOT_BLOCKS_SYMBOL "StewAotBlocks"
+
+/*
+  Helpers for translated code, the same rules as the CPU class. Loads
+  and stores return false if they trapped, and the block must leave.
+*/
+static inline bool AotLoad(AotState* s, uint32_t addr, uint32_t size,
+			   uint32_t& v)
+{
+    if (!(addr & (size - 1)) && addr < s->memSize &&
+	size <= s->memSize - addr)
+    {
+	/* Little endian host, as for Memory */
+	v = 0;
+	memcpy(&v, s->mem + addr, size);
+	return true;
+    }
+    v = s->load(s, addr, size);
+    return !s->trapped;
+}
+
+static inline bool AotStore(AotState* s, uint32_t addr, uint32_t value,
+			    uint32_t size, bool& hit)
+{
+    hit |= s->store(s, addr, value, size);
+    return !s->trapped;
+}
+
+static inline uint32_t AotSignExtend(uint32_t v, uint32_t size)
+{
+    switch(size)
+    {
+    case 1:
+	return static_cast<int8_t>(v);
+    case 2:
+	return static_cast<int16_t>(v);
+    }
+    return v;
+}
+
+/* The V flag, for the CPU class's UpdateFlags as well */
+static inline bool AotCmpOverflow(uint64_t v, uint32_t v1, uint32_t v2,
+				  uint64_t sign)
+{
+    /*
+      cmp:
+      V: set if there was arithmetic overflow; that is, operands were
+      of opposite signs and the sign of the destination was the
+      same as the sign of the result; cleared otherwise
+    */
+    return ((v & sign) == (v2 & sign)) & ((v1 ^ v2) & sign);
+}
+
+static inline bool AotSubOverflow(uint64_t v, uint32_t v1, uint32_t v2,
+				  uint64_t sign)
+{
+    /* sub:
+      V: set if there was arithmetic overflow as a result of the oper-
+      ation, that is if operands were of opposite signs and the sign
+      of the source was the same as the sign of the result; cleared
+      otherwise. */
+    return ((v & sign) == (v1 & sign)) & ((v1 ^ v2) & sign);
+}
+
+static inline bool AotAddOverflow(uint64_t v, uint32_t v1, uint32_t v2,
+				  uint64_t sign)
+{
+    /*  add:
+      V: set if there was arithmetic overflow as a result of the oper-
+      ation; that is both operands were of the same sign and the
+      result was of the opposite sign; cleared otherwise
+    */
+    return ((v & sign) != (v1 & sign)) & ((v1 & sign) == (v2 & sign));
+}
+
+static inline bool AotShiftOverflow(uint64_t v, uint32_t v1, uint32_t v2,
+				    uint64_t sign)
+{
+    /* shifts and rotates:
+       V: loaded from the Exclusive OR of the N-bit and C-bit (as set
+       by the completion of the shift operation) */
+    return !(v & sign) != !(v & (sign << 1));
+}
+
+/* Shift or rotate x, with the last bit out just above the result */
+static inline uint64_t AotShift(InstrKind op, uint64_t x, uint32_t count,
+				uint32_t size)
+{
+    uint64_t mask = (uint64_t(1) << (size * 8)) - 1;
+    uint32_t width = size * 8;
+    uint64_t carry = mask + 1;
+    uint64_t v = x;
+    switch(op)
+    {
+    case ASL:
+    case LSL:
+	v = x << (count < width + 1 ? count : width + 1);
+	break;
+
+    case LSR:
+	if (count)
+	{
+	    count = count < width + 1 ? count : width + 1;
+	    v = x >> count;
+	    if ((x >> (count - 1)) & 1)
+	    {
+		v |= carry;
+	    }
+	}
+	break;
+
+    case ASR:
+	if (count)
+	{
+	    int64_t sx = static_cast<int32_t>(AotSignExtend(x, size));
+	    count = count < width ? count : width;
+	    v = (sx >> count) & mask;
+	    if ((sx >> (count - 1)) & 1)
+	    {
+		v |= carry;
+	    }
+	}
+	break;
+
+    case ROR:
+	count %= width;
+	if (count)
+	{
+	    v = ((x >> count) | (x << (width - count))) & mask;
+	    if (v & (carry >> 1))
+	    {
+		v |= carry;
+	    }
+	}
+	break;
+
+    case ROL:
+	count %= width;
+	if (count)
+	{
+	    v = ((x << count) | (x >> (width - count))) & mask;
+	    if (v & 1)
+	    {
+		v |= carry;
+	    }
+	}
+	break;
+
+    default:
+	break;
+    }
+    return v;
+}
+
+#endif
@@ -17,6 +17,15 @@ enum InstrType
     TwoArgType,
     BranchType,
     EmtType,
+    BlockType,
+    VectorType,			/* vop vs,vd */
+    VLoadType,			/* vld src,vd */
+    VStoreType,			/* vst vs,dest */
+    FPArithType,		/* fop fs|mem,fd */
+    FPMovType,			/* fmov fs|mem,fd|mem */
+    IntToFPType,		/* itof src,fd */
+    FPToIntType,		/* ftoi fs|mem,dest */
+    DestArgType,		/* Single destination operand */
 };
 
 
@@ -66,12 +75,15 @@ InstrEntry instructions[] =
     INSTR(SEV,  NoArgsType),
     INSTR(SEN,  NoArgsType),
     INSTR(SEZ,  NoArgsType),
+    INSTR(CLI,  NoArgsType),
+    INSTR(SEI,  NoArgsType),
 
     INSTR(JSR,  OneArgType),
     INSTR(RET,  NoArgsType),
     INSTR(JMP,  OneArgType),
     INSTR(HLT,  NoArgsType),
     INSTR(BPT,  NoArgsType),
+    INSTR(RTI,  NoArgsType),
     
     INSTR(BEQ,  BranchType),
     INSTR(BNE,  BranchType),
@@ -91,7 +103,32 @@ InstrEntry instructions[] =
     INSTR(BVS,  BranchType),
     INSTR(BR,   BranchType),
 
-    INSTR(EMT,  EmtType)
+    INSTR(EMT,  EmtType),
+
+    INSTR(BCPY, BlockType),
+    INSTR(BFIL, BlockType),
+    INSTR(BCMP, BlockType),
+    INSTR(BSCN, BlockType),
+
+    INSTR(VLD,    VLoadType),
+    INSTR(VST,    VStoreType),
+    INSTR(VADD,   VectorType),
+    INSTR(VSUB,   VectorType),
+    INSTR(VMUL,   VectorType),
+    INSTR(VCMPEQ, VectorType),
+    INSTR(VCMPGT, VectorType),
+
+    INSTR(FMOV,  FPMovType),
+    INSTR(FADD,  FPArithType),
+    INSTR(FSUB,  FPArithType),
+    INSTR(FMUL,  FPArithType),
+    INSTR(FDIV,  FPArithType),
+    INSTR(FSQRT, FPArithType),
+    INSTR(FCMP,  FPArithType),
+    INSTR(ITOF,  IntToFPType),
+    INSTR(FTOI,  FPToIntType),
+    INSTR(LDFPS, OneArgType),
+    INSTR(STFPS, DestArgType),
 };
 
 struct LabelInfo
@@ -108,6 +145,7 @@ struct ArgInfo
 	    mode = static_cast<AddrMode>(0);
 	    reg = static_cast<RegName>(0);
 	    useData = false;
+	    pcRelative = false;
 	    data = 0;
 	    label = 0;
 	};
@@ -118,6 +156,7 @@ struct ArgInfo
     AddrMode mode;
     RegName  reg;
     bool     useData;
+    bool     pcRelative;
     uint32_t data;
     std::string* label;
 };
@@ -135,6 +174,7 @@ struct BackPatch
     std::string label;
     size_t location;
     size_t branchAddr;
+    int size;
 };
 
 std::vector<uint8_t> code;
@@ -210,12 +250,7 @@ void AddLabel(const std::string& name, size_t addr)
 	    std::vector<uint8_t> code_bytes(sizeof(Instruction));
 	    size_t adjusted_addr = addr - bp->branchAddr;
 	    memcpy(code_bytes.data(), &adjusted_addr, sizeof(Instruction));
-	    int size = 4;
-	    if (bp->branchAddr)
-	    {
-		size = 3;
-	    }
-	    for(int i = 0; i < size; i++)
+	    for(int i = 0; i < bp->size; i++)
 	    {
 		code[bp->location + i] = code_bytes[i];
 	    }
@@ -303,14 +338,67 @@ bool ParseRegister(LineParser& lp, RegName& reg)
     return false;
 }
 
+/* Vector and FP registers: prefix followed by a single digit */
+bool ParseExtRegister(LineParser& lp, char prefix, int count, ArgInfo& info)
+{
+    lp.SkipSpaces();
+    lp.Save();
+    if (lp.Accept(prefix))
+    {
+	char ch = lp.Get();
+	if (ch >= '0' && ch < '0' + count && lp.IsSeparator(lp.Peek()))
+	{
+	    info.mode = Direct;
+	    info.reg = static_cast<RegName>(ch - '0');
+	    return true;
+	}
+    }
+    lp.Restore();
+    return false;
+}
+
+bool ParseVRegister(LineParser& lp, ArgInfo& info)
+{
+    if (ParseExtRegister(lp, 'v', MaxVReg, info))
+    {
+	return true;
+    }
+    lp.Error("Expected vector register name");
+    return false;
+}
+
+bool ParseDisplacement(LineParser& lp, ArgInfo& info)
+{
+    RegName rn;
+    if (!ParseRegister(lp, rn))
+    {
+	lp.Error("Expected register name");
+	return false;
+    }
+    lp.Expect(')');
+    info.reg = rn;
+    info.mode = Displacement;
+    info.useData = true;
+    return true;
+}
+
 bool ParseArg(LineParser& lp, ArgInfo& info)
 {
     bool maybeAutoDecr = false;
     RegName rn;
     lp.SkipSpaces();
+    lp.Save();
     if (lp.Accept('-'))
     {
-	maybeAutoDecr = true;
+	if (lp.Peek() == '(')
+	{
+	    maybeAutoDecr = true;
+	}
+	else
+	{
+	    /* Negative displacement */
+	    lp.Restore();
+	}
     }
     if (lp.Accept('('))
     {
@@ -346,6 +434,13 @@ bool ParseArg(LineParser& lp, ArgInfo& info)
 	if(lp.GetNum(value, 0))
 	{
 	    info.data = value;
+	    /* Small values fit in the register field of the instruction */
+	    if (static_cast<int32_t>(value) >= -128 &&
+		static_cast<int32_t>(value) <= 127)
+	    {
+		info.mode = Immediate;
+		return true;
+	    }
 	    info.useData = true;
 	    info.mode = IndirAutoInc;
 	    info.reg = PC;
@@ -354,9 +449,32 @@ bool ParseArg(LineParser& lp, ArgInfo& info)
 	lp.Error("Invalid number");
     }
 
+    uint32_t disp;
+    lp.Save();
+    if (lp.GetNum(disp, 0) && lp.Accept('('))
+    {
+	info.data = disp;
+	return ParseDisplacement(lp, info);
+    }
+    lp.Restore();
+
     LabelInfo label;
     if (ParseLabel(lp, label))
     {
+	if (lp.Accept('('))
+	{
+	    if (!ParseDisplacement(lp, info))
+	    {
+		return false;
+	    }
+	    info.data = label.addr;
+	    info.pcRelative = info.reg == PC;
+	    if (label.needBP)
+	    {
+		info.label = new std::string(label.name);
+	    }
+	    return true;
+	}
 	info.useData = true;
 	info.data = label.addr;
 	info.mode = IndirAutoInc;
@@ -386,8 +504,12 @@ bool ParseOpSize(LineParser& lp, OperandSize &opSize)
 	    opSize = Op16;
 	    break;
 	case 'l':
+	case 's':
 	    opSize = Op32;
 	    break;
+	case 'd':
+	    opSize = Op64;
+	    break;
 	default:
 	    lp.Error("Bad operand size");
 	    return false;
@@ -408,10 +530,12 @@ void SaveArg(const ArgInfo& arg)
     if (arg.useData)
     {
 	Instruction data;
-	data.value.word = arg.data;
+	/* PC relative displacement is from the end of the displacement */
+	size_t base = arg.pcRelative ? curAddr + 4 : 0;
+	data.value.word = arg.data - base;
 	if (arg.label)
 	{
-	    BackPatch bp = { *arg.label, code.size(), 0 };
+	    BackPatch bp = { *arg.label, code.size(), base, 4 };
 	    backPatchList.push_back(bp);
 	}
 	CodeStore(data);
@@ -429,6 +553,14 @@ void StoreInstr(InstrKind op, OperandSize opsize,
     instr.value.srcMode = arg1.mode;
     instr.value.dest = arg2.reg;
     instr.value.source = arg1.reg;
+    if (arg1.mode == Immediate)
+    {
+	instr.value.srcImm = arg1.data;
+    }
+    if (arg2.mode == Immediate)
+    {
+	instr.value.destImm = arg2.data;
+    }
     CodeStore(instr);
     curAddr += 4;
     SaveArg(arg1);
@@ -486,6 +618,112 @@ bool ParseOneArg(LineParser& lp, InstrKind op, OperandSize opsize)
     return false;
 }
 
+bool ParseVector(LineParser& lp, InstrType type, InstrKind op,
+		 OperandSize opsize)
+{
+    ArgInfo arg1;
+    ArgInfo arg2;
+    bool ok;
+    if (type == VLoadType)
+    {
+	ok = ParseArg(lp, arg1);
+    }
+    else
+    {
+	ok = ParseVRegister(lp, arg1);
+    }
+    if (!ok)
+    {
+	return false;
+    }
+    lp.Expect(',');
+    if (type == VStoreType)
+    {
+	ok = ParseArg(lp, arg2);
+    }
+    else
+    {
+	ok = ParseVRegister(lp, arg2);
+    }
+    if (ok)
+    {
+	StoreInstr(op, opsize, arg1, arg2);
+    }
+    return ok;
+}
+
+/* FP register, or memory operand for the FP value */
+bool ParseFPArg(LineParser& lp, ArgInfo& info, bool allowMemory)
+{
+    if (ParseExtRegister(lp, 'f', MaxFReg, info))
+    {
+	return true;
+    }
+    if (!allowMemory)
+    {
+	lp.Error("Expected FP register name");
+	return false;
+    }
+    if (!ParseArg(lp, info))
+    {
+	return false;
+    }
+    if (info.mode == Direct || info.mode == Immediate ||
+	(info.mode == IndirAutoInc && info.reg == PC))
+    {
+	lp.Error("Expected FP register or memory operand, "
+		 "use label(pc) for constants");
+	return false;
+    }
+    return true;
+}
+
+bool ParseFP(LineParser& lp, InstrType type, InstrKind op,
+	     OperandSize opsize)
+{
+    ArgInfo arg1;
+    ArgInfo arg2;
+    bool ok;
+    if (type == IntToFPType)
+    {
+	ok = ParseArg(lp, arg1);
+    }
+    else
+    {
+	ok = ParseFPArg(lp, arg1, true);
+    }
+    if (!ok)
+    {
+	return false;
+    }
+    lp.Expect(',');
+    if (type == FPToIntType)
+    {
+	ok = ParseArg(lp, arg2);
+    }
+    else
+    {
+	ok = ParseFPArg(lp, arg2, type == FPMovType);
+    }
+    if (ok)
+    {
+	StoreInstr(op, opsize, arg1, arg2);
+    }
+    return ok;
+}
+
+bool ParseDestArg(LineParser& lp, InstrKind op, OperandSize opsize)
+{
+    ArgInfo arg1;
+    ArgInfo arg2;
+    if (ParseArg(lp, arg2))
+    {
+	StoreInstr(op, opsize, arg1, arg2);
+	return true;
+    }
+    return false;
+}
+
 bool ParseBranch(LineParser& lp, InstrKind op)
 {
     LabelInfo label;
@@ -494,7 +732,7 @@ bool ParseBranch(LineParser& lp, InstrKind op)
 	int distance = 0;
 	if (label.needBP)
 	{
-	    BackPatch bp = { label.name, code.size(), curAddr + 4 };
+	    BackPatch bp = { label.name, code.size(), curAddr + 4, 3 };
 	    backPatchList.push_back(bp);
 	}
 	else
@@ -520,6 +758,32 @@ bool ParseEmt(LineParser& lp, InstrKind op)
     return false;
 }
 
+bool ParseBlock(LineParser& lp, InstrKind op)
+{
+    RegName regs[3];
+    for(int i = 0; i < 3; i++)
+    {
+	lp.SkipSpaces();
+	if (!ParseRegister(lp, regs[i]))
+	{
+	    lp.Error("Expected register name");
+	    return false;
+	}
+	if (i != 2)
+	{
+	    lp.Expect(',');
+	}
+    }
+    Instruction instr;
+    instr.value.op = op;
+    instr.value.source = regs[0];
+    instr.value.dest = regs[1];
+    instr.value.count = regs[2];
+    CodeStore(instr);
+    curAddr += 4;
+    return true;
+}
+
 void StoreBytesToSection(const std::vector<uint8_t> bytes)
 {
     if (section == Data)
@@ -697,6 +961,13 @@ bool ParseInstruction(LineParser& lp, std::string w)
 	{
 	    return false;
 	}
+	bool isFP = (e.type == FPArithType || e.type == FPMovType ||
+		     e.type == IntToFPType || e.type == FPToIntType);
+	if (isFP ? opsize < Op32 : opsize == Op64)
+	{
+	    lp.Error("Bad operand size");
+	    return false;
+	}
 	switch(e.type)
 	{
 	case TwoArgType:
@@ -714,6 +985,23 @@ bool ParseInstruction(LineParser& lp, std::string w)
 
 	case EmtType:
 	    return ParseEmt(lp, e.op);
+
+	case BlockType:
+	    return ParseBlock(lp, e.op);
+
+	case VectorType:
+	case VLoadType:
+	case VStoreType:
+	    return ParseVector(lp, e.type, e.op, opsize);
+
+	case FPArithType:
+	case FPMovType:
+	case IntToFPType:
+	case FPToIntType:
+	    return ParseFP(lp, e.type, e.op, opsize);
+
+	case DestArgType:
+	    return ParseDestArg(lp, e.op, opsize);
 	}
     }
     return false;
@@ -765,7 +1053,14 @@ void Output(std::ostream& out, const std::vector<uint8_t>& binary)
     }
 }
 
-void Assemble(std::istream& in, std::ostream& out, std::ostream& map)
+/* The raw image, for stew's image command to map */
+void OutputBinary(std::ostream& out, const std::vector<uint8_t>& binary)
+{
+    out.write(reinterpret_cast<const char*>(binary.data()), binary.size());
+}
+
+void Assemble(std::istream& in, std::ostream& out, std::ostream& map,
+	      bool binary)
 {
     std::string line;
     while(std::getline(in, line))
@@ -773,8 +1068,16 @@ void Assemble(std::istream& in, std::ostream& out, std::ostream& map)
 	lineNo++;
 	Parse(line);
     }
-    Output(out, code);
-    Output(out, data);
+    if (binary)
+    {
+	OutputBinary(out, code);
+	OutputBinary(out, data);
+    }
+    else
+    {
+	Output(out, code);
+	Output(out, data);
+    }
     if (map)
     {
 	for(auto i : labels)
@@ -790,6 +1093,14 @@ void Assemble(std::istream& in, std::ostream& out, std::ostream& map)
 
 int main(int argc, char **argv)
 {
+    /* -b writes a binary image instead of hex */
+    bool binary = false;
+    if (argc > 1 && std::string(argv[1]) == "-b")
+    {
+	binary = true;
+	argc--;
+	argv++;
+    }
     std::istream *in = &std::cin;
     std::ostream *out = &std::cout;
     std::ifstream inf;
@@ -806,7 +1117,7 @@ int main(int argc, char **argv)
     std::ofstream outf;
     if (argc > 2)
     {
-	outf.open(argv[2]);
+	outf.open(argv[2], binary ? std::ios::binary : std::ios::out);
 	if (!outf)
 	{
 	    std::cerr << "Could not open file: " << argv[2] << std::endl;
@@ -824,6 +1135,6 @@ int main(int argc, char **argv)
 	    return 1;
 	}
     }
-    Assemble(*in, *out, mapf);
+    Assemble(*in, *out, mapf, binary);
     return 0;
 }
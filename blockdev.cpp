@@ -0,0 +1,201 @@
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "blockdev.h"
+#include "instruction.h"
+#include "memory.h"
+
+BlockDevice::BlockDevice(Memory& memory)
+    : memory(memory), fd(-1), readOnly(false), write(false), addr(0), len(0),
+      offset(0), pending(false), stop(false), status(DiskIdle), moved(0),
+      noted(true)
+{
+}
+
+BlockDevice::~BlockDevice()
+{
+    if (thread.joinable())
+    {
+	{
+	    std::lock_guard<std::mutex> guard(lock);
+	    stop = true;
+	}
+	wake.notify_one();
+	thread.join();
+    }
+    if (fd >= 0)
+    {
+	close(fd);
+    }
+}
+
+bool BlockDevice::Open(const std::string& file)
+{
+    int f = open(file.c_str(), O_RDWR);
+    bool ro = false;
+    if (f < 0 && (errno == EACCES || errno == EROFS))
+    {
+	f = open(file.c_str(), O_RDONLY);
+	ro = true;
+    }
+    if (f < 0)
+    {
+	return false;
+    }
+    uint32_t count;
+    Wait(count);
+    if (fd >= 0)
+    {
+	close(fd);
+    }
+    fd = f;
+    name = file;
+    readOnly = ro;
+    status = DiskIdle;
+    moved = 0;
+    if (!thread.joinable())
+    {
+	thread = std::thread(&BlockDevice::Worker, this);
+    }
+    return true;
+}
+
+uint64_t BlockDevice::Size()
+{
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st))
+    {
+	return 0;
+    }
+    return st.st_size;
+}
+
+bool BlockDevice::Start(bool write, uint32_t addr, uint32_t len,
+			uint32_t block)
+{
+    /* Note the last read, if nothing polled for it, before it's replaced */
+    uint32_t count;
+    if (fd < 0 || Finish(count) == DiskBusy || (write && readOnly) ||
+	addr > memory.Size() || len > memory.Size() - addr)
+    {
+	return false;
+    }
+    {
+	std::lock_guard<std::mutex> guard(lock);
+	this->write = write;
+	this->addr = addr;
+	this->len = len;
+	offset = uint64_t(block) << BlockShift;
+	pending = true;
+	noted = false;
+	moved.store(0, std::memory_order_relaxed);
+	status.store(DiskBusy, std::memory_order_release);
+    }
+    wake.notify_one();
+    return true;
+}
+
+BlockDevice::Status BlockDevice::Poll(uint32_t& count)
+{
+    return Finish(count);
+}
+
+BlockDevice::Status BlockDevice::Wait(uint32_t& count)
+{
+    if (status.load(std::memory_order_acquire) == DiskBusy)
+    {
+	std::unique_lock<std::mutex> guard(lock);
+	done.wait(guard, [this]
+		  { return status.load(std::memory_order_acquire) != DiskBusy; });
+    }
+    return Finish(count);
+}
+
+BlockDevice::Status BlockDevice::Finish(uint32_t& count)
+{
+    Status s = static_cast<Status>(status.load(std::memory_order_acquire));
+    count = moved.load(std::memory_order_relaxed);
+    if (s != DiskBusy && !noted)
+    {
+	if (!write)
+	{
+	    memory.Written(addr, count);
+	}
+	noted = true;
+    }
+    return s;
+}
+
+void BlockDevice::Worker()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    for(;;)
+    {
+	wake.wait(guard, [this] { return stop || pending; });
+	if (stop)
+	{
+	    break;
+	}
+	pending = false;
+
+	guard.unlock();
+	Transfer();
+	guard.lock();
+
+	done.notify_all();
+    }
+}
+
+/* Short reads at the end of the file finish the transfer early */
+void BlockDevice::Transfer()
+{
+    uint8_t* p = memory.Data() + addr;
+    uint32_t total = 0;
+    Status s = DiskDone;
+    while(total < len)
+    {
+	ssize_t n = write ? pwrite(fd, p + total, len - total, offset + total)
+	    : pread(fd, p + total, len - total, offset + total);
+	if (n < 0 && errno == EINTR)
+	{
+	    continue;
+	}
+	if (n < 0)
+	{
+	    s = DiskError;
+	    break;
+	}
+	if (n == 0)
+	{
+	    break;
+	}
+	total += n;
+	moved.store(total, std::memory_order_relaxed);
+    }
+    status.store(s, std::memory_order_release);
+}
+
+uint32_t EmtDiskRead(void* ctx, uint32_t* regs, Memory& memory)
+{
+    BlockDevice* disk = static_cast<BlockDevice*>(ctx);
+    return disk->Start(false, regs[R0], regs[R1], regs[R2]);
+}
+
+uint32_t EmtDiskWrite(void* ctx, uint32_t* regs, Memory& memory)
+{
+    BlockDevice* disk = static_cast<BlockDevice*>(ctx);
+    return disk->Start(true, regs[R0], regs[R1], regs[R2]);
+}
+
+uint32_t EmtDiskStatus(void* ctx, uint32_t* regs, Memory& memory)
+{
+    BlockDevice* disk = static_cast<BlockDevice*>(ctx);
+    return disk->Poll(regs[R1]);
+}
+
+uint32_t EmtDiskWait(void* ctx, uint32_t* regs, Memory& memory)
+{
+    BlockDevice* disk = static_cast<BlockDevice*>(ctx);
+    return disk->Wait(regs[R1]);
+}
@@ -0,0 +1,89 @@
+#ifndef BLOCKDEV_H
+#define BLOCKDEV_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+class Memory;
+
+/*
+  A disk backed by a host file, for the disk EMTs. A transfer moves a
+  range of the file straight to or from guest memory with pread or
+  pwrite on a worker thread, so the guest carries on while it happens
+  and polls the status, or waits. There is one transfer at a time.
+  Memory read into is noted as written (for compiled code and the
+  snapshot) when the CPU sees the transfer finish. The file is not
+  part of the snapshot.
+*/
+class BlockDevice
+{
+public:
+    /* Offsets in the file are in blocks */
+    static const uint32_t BlockShift = 9;
+    static const uint32_t BlockSize = 1 << BlockShift;
+
+    /* What DiskStatus gives */
+    enum Status
+    {
+	DiskIdle,
+	DiskBusy,
+	DiskDone,
+	DiskError,
+    };
+
+    BlockDevice(Memory& memory);
+    ~BlockDevice();
+    /* Read and write the file, or only read it if that's all it allows */
+    bool Open(const std::string& file);
+    bool IsOpen() { return fd >= 0; }
+    const std::string& File() { return name; }
+    bool ReadOnly() { return readOnly; }
+    /* Size of the file in bytes */
+    uint64_t Size();
+    /*
+      Start moving len bytes between memory at addr and the file at
+      block. Returns false if no file is open, a transfer is still
+      going, or the range isn't in memory.
+    */
+    bool Start(bool write, uint32_t addr, uint32_t len, uint32_t block);
+    /* Status of the last transfer, and the bytes it moved so far */
+    Status Poll(uint32_t& count);
+    Status Wait(uint32_t& count);
+
+private:
+    void Worker();
+    void Transfer();
+    Status Finish(uint32_t& count);
+
+    Memory& memory;
+    int fd;
+    std::string name;
+    bool readOnly;
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+    /* The transfer, set by Start and read by the worker */
+    bool write;
+    uint32_t addr;
+    uint32_t len;
+    uint64_t offset;
+    bool pending;
+    bool stop;
+    std::atomic<uint32_t> status;
+    std::atomic<uint32_t> moved;
+    /* The memory read into has been noted as written */
+    bool noted;
+};
+
+/* The EMTs, ctx is the BlockDevice */
+uint32_t EmtDiskRead(void* ctx, uint32_t* regs, Memory& memory);
+uint32_t EmtDiskWrite(void* ctx, uint32_t* regs, Memory& memory);
+uint32_t EmtDiskStatus(void* ctx, uint32_t* regs, Memory& memory);
+uint32_t EmtDiskWait(void* ctx, uint32_t* regs, Memory& memory);
+
+#endif
@@ -4,10 +4,16 @@
 #include <iostream>
 #include <iomanip>
 #include <algorithm>
+#include <chrono>
+#include <iterator>
 #include <map>
+#include <dlfcn.h>
 #include "command.h"
 #include "cpu.h"
+#include "fuzz.h"
+#include "simd.h"
 #include "stew.h"
+#include "tier.h"
 
 struct BpEntry
 {
@@ -21,6 +27,11 @@ struct SymInfo
 
 std::map<uint32_t, BpEntry> bpList;
 std::map<std::string, SymInfo> symbols;
+/* Where to keep compiled blocks between runs, empty for nowhere */
+std::string cacheDir;
+std::string cacheFile;
+Fuzzer* fuzzer;
+uint64_t imageKey;
 
 class CmdClass
 {
@@ -56,6 +67,17 @@ static void SetBreakpoint(uint32_t addr)
     instr.value.word = 0;
     instr.value.op = BPT;
     cpu->WriteMem(addr, instr.value.word, 4);
+    cpu->DebugBreak(addr, true);
+}
+
+/* The CPU doesn't say why it stopped, except for errors */
+static void ShowHalt(ExecResult res)
+{
+    if (res == Halt)
+    {
+	std::cout << "Hit halt at " << std::hex << cpu->RegValue(PC)
+		  << std::endl;
+    }
 }
 
 static ExecResult StepPastBreak()
@@ -69,11 +91,47 @@ static ExecResult StepPastBreak()
 	cpu->RegValue(PC, addr);
 	res = cpu->RunOneInstr();
 	SetBreakpoint(addr);
+	ShowHalt(res);
     }
     return res;
 }
 
 
+static const uint64_t FnvStart = 0xcbf29ce484222325;
+
+static uint64_t Fnv(uint64_t key, uint32_t byte)
+{
+    return (key ^ (byte & 0xff)) * 0x100000001b3;
+}
+
+static void LoadCache()
+{
+    cacheFile.clear();
+    if (cacheDir.empty())
+    {
+	return;
+    }
+    std::stringstream ss;
+    ss << cacheDir << "/" << std::hex << std::setw(16) << std::setfill('0')
+       << imageKey << ".blk";
+    cacheFile = ss.str();
+    std::vector<CodeBlock*> blocks;
+    if (LoadBlockCache(cacheFile, imageKey, blocks))
+    {
+	std::cout << "Preloaded " << std::dec << cpu->Preload(blocks)
+		  << " of " << blocks.size() << " cached blocks." << std::endl;
+    }
+}
+
+static void SaveCache()
+{
+    if (!cacheFile.empty() &&
+	!SaveBlockCache(cacheFile, imageKey, cpu->CompiledBlocks()))
+    {
+	std::cerr << "Could not write block cache " << cacheFile << std::endl;
+    }
+}
+
 class LoadCmd : public CmdClass
 {
 public:
@@ -96,13 +154,58 @@ bool LoadCmd::DoIt(LineParser& lp)
     std::ifstream f(file);
     uint32_t v;
     uint32_t addr = 0;
+    /* FNV-1a hash of the image, to find its saved blocks */
+    imageKey = FnvStart;
     while(f >> std::hex >> v)
     {
 	cpu->WriteMem(addr, v, 1);
+	imageKey = Fnv(imageKey, v);
 	addr++;
     }
 
     std::cout << "Loaded " << addr << " bytes." << std::endl;
+    LoadCache();
+    return false;
+}
+
+class ImageCmd : public CmdClass
+{
+public:
+    bool DoIt(LineParser& lp) override;
+    std::string Description() override
+	{
+	    return  "IMAGE file - Map a binary image, sharing unwritten pages";
+	}
+};
+
+/*
+  For running many copies of one program: the image is mapped copy on
+  write, so only the pages a run writes are its own.
+*/
+bool ImageCmd::DoIt(LineParser& lp)
+{
+    std::string file = lp.GetWord();
+    if (file == "")
+    {
+	lp.Error("Expected filename to be given");
+	return false;
+    }
+
+    uint32_t len;
+    if (!cpu->MapImage(file, len))
+    {
+	std::cerr << "Could not map image " << file << std::endl;
+	return false;
+    }
+    /* Same key as the hex file would give */
+    imageKey = FnvStart;
+    for(uint32_t i = 0; i < len; i++)
+    {
+	imageKey = Fnv(imageKey, cpu->ReadMem(i, 1));
+    }
+
+    std::cout << "Mapped " << len << " bytes." << std::endl;
+    LoadCache();
     return false;
 }
 
@@ -215,6 +318,7 @@ bool StepCmd::DoIt(LineParser& lp)
     for(uint32_t i = 0; i < count; i++)
     {
 	res = cpu->RunOneInstr();
+	ShowHalt(res);
 	ShowRegs();
 	if (res != Continue)
 	{
@@ -240,6 +344,91 @@ bool RegsCmd::DoIt(LineParser& lp)
     return false;
 }
 
+class VRegsCmd : public CmdClass
+{
+public:
+    bool DoIt(LineParser& lp) override;
+    std::string Description() override
+	{
+	    return  "VREGS - Show vector register values";
+	}
+};
+
+bool VRegsCmd::DoIt(LineParser& lp)
+{
+    for(int i = V0; i < MaxVReg; i++)
+    {
+	const VectorRegister& vr = cpu->VRegValue((VRegName)i);
+	std::cout << " v" << i << ": ";
+	for(int j = sizeof(vr.bytes) - 1; j >= 0; j--)
+	{
+	    std::cout << std::hex << std::setw(2) << std::setfill('0')
+		      << static_cast<uint32_t>(vr.bytes[j]);
+	    if (j && !(j & 3))
+	    {
+		std::cout << "_";
+	    }
+	}
+	std::cout << std::endl;
+    }
+    return false;
+}
+
+class FRegsCmd : public CmdClass
+{
+public:
+    bool DoIt(LineParser& lp) override;
+    std::string Description() override
+	{
+	    return  "FREGS - Show floating point register values";
+	}
+};
+
+bool FRegsCmd::DoIt(LineParser& lp)
+{
+    for(int i = F0; i < MaxFReg; i++)
+    {
+	std::cout << " f" << i << ": " << std::setw(14) << std::setfill(' ')
+		  << std::setprecision(8) << std::defaultfloat
+		  << cpu->FRegValue((FRegName)i);
+	if (i & 1)
+	{
+	    std::cout << std::endl;
+	}
+    }
+    std::cout << "FP status: " << std::hex << cpu->FPStatus() << std::endl;
+    return false;
+}
+
+class SimdCmd : public CmdClass
+{
+public:
+    bool DoIt(LineParser& lp) override;
+    std::string Description() override
+	{
+	    return  "SIMD {host|scalar} - Show or select vector implementation";
+	}
+};
+
+bool SimdCmd::DoIt(LineParser& lp)
+{
+    if (!lp.Done())
+    {
+	std::string impl = lp.GetWord();
+	if (impl != "host" && impl != "scalar")
+	{
+	    lp.Error("Expected host or scalar");
+	    return false;
+	}
+	if (!UseHostSimd(impl == "host"))
+	{
+	    std::cout << "Host SIMD not supported" << std::endl;
+	}
+    }
+    std::cout << "Vector implementation: " << VectorImplName() << std::endl;
+    return false;
+}
+
 class RunCmd : public CmdClass
 {
 public:
@@ -262,26 +451,39 @@ bool RunCmd::DoIt(LineParser& lp)
 	    return false;
 	}
     }
-    while((res = cpu->RunOneInstr()) == Continue);
+    res = cpu->Run();
+    SaveCache();
+    ShowHalt(res);
     if (res == Breakpoint)
     {
 	std::cout << "Breakpoint hit" << std::endl;
 	ShowRegs();
     }
+    else if (res == Watchpoint)
+    {
+	std::cout << "Watchpoint hit, write to " << std::hex
+		  << cpu->WatchAddr() << std::endl;
+	ShowRegs();
+    }
+    else if (res == Limit)
+    {
+	std::cout << "Instruction budget used up at " << std::hex
+		  << cpu->RegValue(PC) << std::endl;
+    }
     return false;
 }
 
-class BPSetCmd : public CmdClass
+class CallCmd : public CmdClass
 {
 public:
     bool DoIt(LineParser& lp) override;
     std::string Description() override
 	{
-	    return  "BR address - Set breakpoint";
+	    return  "CALL address - Call the function, stopping when it returns";
 	}
 };
 
-bool BPSetCmd::DoIt(LineParser& lp)
+bool CallCmd::DoIt(LineParser& lp)
 {
     uint32_t addr;
     if (!GetAddr(lp, addr))
@@ -289,40 +491,857 @@ bool BPSetCmd::DoIt(LineParser& lp)
 	lp.Error("Invalid address");
 	return false;
     }
-    BpEntry bp;
-    bp.oldInstr.value.word = cpu->ReadMem(addr, 4);
-    SetBreakpoint(addr);
-    bpList[addr] = bp;
+    ExecResult res = cpu->Call(addr);
+    ShowHalt(res);
+    if (res == Returned)
+    {
+	std::cout << "Returned, r0: " << std::hex << cpu->RegValue(R0)
+		  << std::endl;
+    }
+    else if (res != Halt)
+    {
+	std::cout << "Stopped at " << std::hex << cpu->RegValue(PC)
+		  << std::endl;
+    }
     return false;
 }
 
-class BPClearCmd : public CmdClass
+class StatsCmd : public CmdClass
 {
 public:
     bool DoIt(LineParser& lp) override;
     std::string Description() override
 	{
-	    return  "BR address - Set breakpoint";
+	    return  "STATS - Show execution statistics";
 	}
 };
 
-bool BPClearCmd::DoIt(LineParser& lp)
+bool StatsCmd::DoIt(LineParser& lp)
 {
-    uint32_t addr;
-    if (!lp.GetNum(addr, 16))
+    std::cout << std::dec
+	      << "Instructions: " << cpu->InstrCount() << std::endl
+	      << "Fetches:      " << cpu->FetchCount() << std::endl
+	      << "Fused pairs:  " << cpu->FusedCount() << std::endl
+	      << "Memory:       " << cpu->AccessName() << std::endl
+	      << "Events run:   " << cpu->Events().Runs() << std::endl
+	      << "Traps taken:  " << cpu->TrapsTaken() << std::endl;
+    const TierStats& t = cpu->Tiers();
+    std::cout << "Block entries interpreted: " << t.interpreted << std::endl
+	      << "Block entries compiled:    " << t.compiled << std::endl
+	      << "Block entries native:      " << t.native << std::endl
+	      << "Blocks submitted:          " << t.submitted << std::endl
+	      << "Blocks installed:          " << t.installed << std::endl
+	      << "Blocks rejected:           " << t.rejected << std::endl
+	      << "Blocks invalidated:        " << t.invalidated << std::endl
+	      << "Compile time (us):         " << t.compileTime / 1000
+	      << std::endl
+	      << "Blocks preloaded:          " << t.preloaded << std::endl
+	      << "Block links followed:      " << t.linked << std::endl
+	      << "Returns predicted:         " << t.predicted << std::endl
+	      << "Block lookups:             " << t.lookups << std::endl;
+    return false;
+}
+
+static bool GetOnOff(LineParser& lp, bool& value)
+{
+    std::string w = lp.GetWord();
+    if (w == "on")
     {
-	lp.Error("Invalid address");
+	value = true;
+	return true;
+    }
+    if (w == "off")
+    {
+	value = false;
+	return true;
+    }
+    lp.Error("Expected on or off");
+    return false;
+}
+
+class FuseCmd : public CmdClass
+{
+public:
+    bool DoIt(LineParser& lp) override;
+    std::string Description() override
+	{
+	    return  "FUSE {on|off} - Show or set instruction pair fusion";
+	}
+};
+
+bool FuseCmd::DoIt(LineParser& lp)
+{
+    bool enable;
+    if (!lp.Done())
+    {
+	if (!GetOnOff(lp, enable))
+	{
+	    return false;
+	}
+	cpu->Fuse(enable);
+    }
+    std::cout << "Fusion is " << (cpu->Fuse() ? "on" : "off") << std::endl;
+    return false;
+}
+
+#define OPNAME(x) { x, #x }
+
+static const std::map<int, std::string> opNames =
+{
+    OPNAME(NOP), OPNAME(MOV), OPNAME(CMP), OPNAME(ADD), OPNAME(ADC),
+    OPNAME(SUB), OPNAME(SBC), OPNAME(MUL), OPNAME(DIV), OPNAME(AND),
+    OPNAME(OR), OPNAME(XOR), OPNAME(NEG), OPNAME(COM), OPNAME(ASR),
+    OPNAME(ASL), OPNAME(LSR), OPNAME(LSL), OPNAME(ROR), OPNAME(ROL),
+    OPNAME(CLC), OPNAME(CLV), OPNAME(CLN), OPNAME(CLZ), OPNAME(SEC),
+    OPNAME(SEV), OPNAME(SEN), OPNAME(SEZ), OPNAME(CLI), OPNAME(SEI),
+    OPNAME(JSR), OPNAME(RET), OPNAME(JMP), OPNAME(HLT), OPNAME(BPT),
+    OPNAME(RTI),
+    OPNAME(BEQ), OPNAME(BNE), OPNAME(BLT), OPNAME(BGT), OPNAME(BGE),
+    OPNAME(BLE), OPNAME(BHI), OPNAME(BLOS), OPNAME(BCC), OPNAME(BCS),
+    OPNAME(BMI), OPNAME(BPL), OPNAME(BVC), OPNAME(BVS), OPNAME(BR),
+    OPNAME(EMT),
+    OPNAME(BCPY), OPNAME(BFIL), OPNAME(BCMP), OPNAME(BSCN),
+    OPNAME(VLD), OPNAME(VST), OPNAME(VADD), OPNAME(VSUB), OPNAME(VMUL),
+    OPNAME(VCMPEQ), OPNAME(VCMPGT),
+    OPNAME(FMOV), OPNAME(FADD), OPNAME(FSUB), OPNAME(FMUL), OPNAME(FDIV),
+    OPNAME(FSQRT), OPNAME(FCMP), OPNAME(ITOF), OPNAME(FTOI), OPNAME(LDFPS),
+    OPNAME(STFPS),
+};
+
+static std::string OpName(int op)
+{
+    auto it = opNames.find(op);
+    if (it != opNames.end())
+    {
+	return it->second;
+    }
+    std::stringstream ss;
+    ss << "op" << op;
+    return ss.str();
+}
+
+class ProfileCmd : public CmdClass
+{
+public:
+    bool DoIt(LineParser& lp) override;
+    std::string Description() override
+	{
+	    return  "PROFILE on|off - Start (clearing counts) or stop counting "
+		"instruction pairs";
+	}
+};
+
+bool ProfileCmd::DoIt(LineParser& lp)
+{
+    bool enable;
+    if (GetOnOff(lp, enable))
+    {
+	cpu->Profile(enable);
+    }
+    return false;
+}
+
+class PairsCmd : public CmdClass
+{
+public:
+    bool DoIt(LineParser& lp) override;
+    std::string Description() override
+	{
+	    return  "PAIRS {count} - Show most frequent instruction pairs";
+	}
+};
+
+bool PairsCmd::DoIt(LineParser& lp)
+{
+    uint32_t count = 20;
+    if (!lp.Done() && !lp.GetNum(count))
+    {
+	lp.Error("Expected number as argument");
 	return false;
     }
-    auto it = bpList.find(addr);
-    if (it == bpList.end())
+    const std::vector<uint64_t>& pairs = cpu->PairCounts();
+    if (pairs.empty())
     {
-	lp.Error("Breakpoint not found");
+	std::cout << "Profiling is off" << std::endl;
 	return false;
     }
+    std::vector<std::pair<uint64_t, uint32_t>> sorted;
+    for(uint32_t i = 0; i < pairs.size(); i++)
+    {
+	if (pairs[i])
+	{
+	    sorted.push_back(std::make_pair(pairs[i], i));
+	}
+    }
+    std::sort(sorted.rbegin(), sorted.rend());
+    for(uint32_t i = 0; i < sorted.size() && i < count; i++)
+    {
+	std::cout << std::dec << std::setw(12) << std::setfill(' ')
+		  << sorted[i].first << "  "
+		  << OpName(sorted[i].second >> 8) << " + "
+		  << OpName(sorted[i].second & 0xff) << std::endl;
+    }
+    return false;
+}
+
+class TierCmd : public CmdClass
+{
+public:
+    bool DoIt(LineParser& lp) override;
+    std::string Description() override
+	{
+	    return  "TIER {on|off|threshold} - Show or set compiling of hot "
+		"blocks";
+	}
+};
+
+bool TierCmd::DoIt(LineParser& lp)
+{
+    if (!lp.Done())
+    {
+	uint32_t n;
+	lp.Save();
+	if (lp.GetNum(n))
+	{
+	    if (!n)
+	    {
+		lp.Error("Threshold must be at least 1");
+		return false;
+	    }
+	    cpu->TierThreshold(n);
+	}
+	else
+	{
+	    bool enable;
+	    lp.Restore();
+	    if (!GetOnOff(lp, enable))
+	    {
+		return false;
+	    }
+	    cpu->Tiering(enable);
+	}
+    }
+    std::cout << "Tiering is " << (cpu->Tiering() ? "on" : "off")
+	      << ", threshold " << std::dec << cpu->TierThreshold()
+	      << std::endl;
+    return false;
+}
+
+class CacheCmd : public CmdClass
+{
+public:
+    bool DoIt(LineParser& lp) override;
+    std::string Description() override
+	{
+	    return  "CACHE {dir|off} - Keep compiled blocks in dir between runs"
+		", used from the next load";
+	}
+};
+
+bool CacheCmd::DoIt(LineParser& lp)
+{
+    if (!lp.Done())
+    {
+	std::string dir = lp.GetWord();
+	cacheDir = dir == "off" ? "" : dir;
+    }
+    if (cacheDir.empty())
+    {
+	std::cout << "Block cache is off" << std::endl;
+    }
     else
     {
-	cpu->WriteMem(addr, it->second.oldInstr.value.word, 4);
+	std::cout << "Block cache in " << cacheDir << std::endl;
+    }
+    return false;
+}
+
+class AotCmd : public CmdClass
+{
+public:
+    bool DoIt(LineParser& lp) override;
+    std::string Description() override
+	{
+	    return  "AOT file - Use blocks translated by stew-aot, after load";
+	}
+};
+
+bool AotCmd::DoIt(LineParser& lp)
+{
+    std::string file = lp.GetWord();
+    if (file == "")
+    {
+	lp.Error("Expected filename to be given");
+	return false;
+    }
+    /* dlopen only looks in the current directory if told to */
+    if (file.find('/') == std::string::npos)
+    {
+	file = "./" + file;
+    }
+    /* Never closed, the blocks stay in use until they are replaced */
+    void* lib = dlopen(file.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!lib)
+    {
+	std::cerr << dlerror() << std::endl;
+	return false;
+    }
+    AotBlocksFunc fn =
+	reinterpret_cast<AotBlocksFunc>(dlsym(lib, AOT_BLOCKS_SYMBOL));
+    uint32_t count;
+    uint32_t version;
+    const AotEntry* entries = fn ? fn(&count, &version) : 0;
+    if (!entries || version != AotVersion)
+    {
+	std::cerr << "Not a stew-aot image: " << file << std::endl;
+	dlclose(lib);
+	return false;
+    }
+    std::cout << "Installed " << std::dec << cpu->LoadNative(entries, count)
+	      << " of " << count << " translated blocks." << std::endl;
+    return false;
+}
+
+class AlignCmd : public CmdClass
+{
+public:
+    bool DoIt(LineParser& lp) override;
+    std::string Description() override
+	{
+	    return  "ALIGN {on|off} - Stop at unaligned memory accesses";
+	}
+};
+
+bool AlignCmd::DoIt(LineParser& lp)
+{
+    if (!lp.Done())
+    {
+	bool enable;
+	if (!GetOnOff(lp, enable))
+	{
+	    return false;
+	}
+	cpu->AlignTrap(enable);
+    }
+    std::cout << "Alignment trap is " << (cpu->AlignTrap() ? "on" : "off")
+	      << std::endl;
+    return false;
+}
+
+class SnapshotCmd : public CmdClass
+{
+public:
+    bool DoIt(LineParser& lp) override;
+    std::string Description() override
+	{
+	    return  "SNAPSHOT - Keep registers and memory to RESET to";
+	}
+};
+
+bool SnapshotCmd::DoIt(LineParser& lp)
+{
+    cpu->Snapshot();
+    /* What was found so far was from another starting point */
+    delete fuzzer;
+    fuzzer = 0;
+    std::cout << "Snapshot taken" << std::endl;
+    return false;
+}
+
+class ResetCmd : public CmdClass
+{
+public:
+    bool DoIt(LineParser& lp) override;
+    std::string Description() override
+	{
+	    return  "RESET - Go back to the snapshot";
+	}
+};
+
+bool ResetCmd::DoIt(LineParser& lp)
+{
+    uint32_t pages;
+    if (!cpu->Reset(pages))
+    {
+	std::cerr << "No snapshot taken" << std::endl;
+	return false;
+    }
+    std::cout << "Restored " << std::dec << pages << " pages" << std::endl;
+    return false;
+}
+
+class BudgetCmd : public CmdClass
+{
+public:
+    bool DoIt(LineParser& lp) override;
+    std::string Description() override
+	{
+	    return  "BUDGET {n|off} - Show or set instructions per run";
+	}
+};
+
+bool BudgetCmd::DoIt(LineParser& lp)
+{
+    if (!lp.Done())
+    {
+	uint32_t n;
+	lp.Save();
+	if (lp.GetNum(n) && n)
+	{
+	    cpu->Budget(n);
+	}
+	else
+	{
+	    lp.Restore();
+	    if (lp.GetWord() != "off")
+	    {
+		lp.Error("Expected non-zero number or off");
+		return false;
+	    }
+	    cpu->Budget(0);
+	}
+    }
+    if (cpu->Budget())
+    {
+	std::cout << "Instruction budget: " << std::dec << cpu->Budget()
+		  << std::endl;
+    }
+    else
+    {
+	std::cout << "Instruction budget is off" << std::endl;
+    }
+    return false;
+}
+
+class InputCmd : public CmdClass
+{
+public:
+    bool DoIt(LineParser& lp) override;
+    std::string Description() override
+	{
+	    return  "INPUT file - Give the file to the program's ReadInput EMT";
+	}
+};
+
+bool InputCmd::DoIt(LineParser& lp)
+{
+    std::string file = lp.GetWord();
+    if (file == "")
+    {
+	lp.Error("Expected filename to be given");
+	return false;
+    }
+
+    std::ifstream f(file, std::ios::binary);
+    if (!f)
+    {
+	std::cerr << "Could not open file: " << file << std::endl;
+	return false;
+    }
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(f)),
+			      std::istreambuf_iterator<char>());
+    cpu->Input(data);
+    std::cout << "Input is " << std::dec << data.size() << " bytes"
+	      << std::endl;
+    return false;
+}
+
+class HeapCmd : public CmdClass
+{
+public:
+    bool DoIt(LineParser& lp) override;
+    std::string Description() override
+	{
+	    return  "HEAP - Show the heap, and live blocks if it checks";
+	}
+};
+
+bool HeapCmd::DoIt(LineParser& lp)
+{
+    Heap& heap = cpu->GuestHeap();
+    if (!heap.Active())
+    {
+	std::cout << "No heap" << std::endl;
+	return false;
+    }
+    std::cout << std::hex << "Heap " << heap.Base() << "-" << heap.End()
+	      << std::dec << ", " << heap.LiveBlocks() << " blocks live in "
+	      << heap.LiveBytes() << " bytes, peak " << heap.PeakBytes()
+	      << ", never used " << heap.Untouched() << std::endl;
+    if (!heap.Checking())
+    {
+	return false;
+    }
+    std::vector<std::pair<uint32_t, Heap::Block> > live(heap.Blocks().begin(),
+							 heap.Blocks().end());
+    std::sort(live.begin(), live.end(),
+	      [](const std::pair<uint32_t, Heap::Block>& a,
+		 const std::pair<uint32_t, Heap::Block>& b)
+	      { return a.first < b.first; });
+    for(auto& b : live)
+    {
+	std::cout << std::hex << "  " << b.first << std::dec << " "
+		  << b.second.size << " bytes from " << std::hex
+		  << b.second.pc << std::endl;
+    }
+    return false;
+}
+
+class DiskCmd : public CmdClass
+{
+public:
+    bool DoIt(LineParser& lp) override;
+    std::string Description() override
+	{
+	    return  "DISK {file} - Show or set the file for the disk EMTs";
+	}
+};
+
+bool DiskCmd::DoIt(LineParser& lp)
+{
+    BlockDevice& disk = cpu->Disk();
+    if (!lp.Done())
+    {
+	std::string file = lp.GetWord();
+	if (!disk.Open(file))
+	{
+	    std::cerr << "Could not open file: " << file << std::endl;
+	    return false;
+	}
+    }
+    if (!disk.IsOpen())
+    {
+	std::cout << "No disk" << std::endl;
+	return false;
+    }
+    std::cout << "Disk is " << disk.File() << ", " << std::dec
+	      << disk.Size() << " bytes" << (disk.ReadOnly() ? ", read only" : "")
+	      << std::endl;
+    return false;
+}
+
+class DeviceCmd : public CmdClass
+{
+public:
+    bool DoIt(LineParser& lp) override;
+    std::string Description() override
+	{
+	    return  "DEVICE {console|timer|disk address} - Show or map devices";
+	}
+};
+
+bool DeviceCmd::DoIt(LineParser& lp)
+{
+    if (!lp.Done())
+    {
+	std::string name = lp.GetWord();
+	uint32_t addr;
+	if (!GetAddr(lp, addr))
+	{
+	    lp.Error("Expected address");
+	    return false;
+	}
+	if (!cpu->MapDevice(name, addr))
+	{
+	    std::cerr << "Could not map " << name << " at " << std::hex
+		      << addr << std::endl;
+	    return false;
+	}
+    }
+    if (std::string(cpu->AccessName()) == "flat")
+    {
+	std::cout << "Devices need a checking memory access policy"
+		  << std::endl;
+    }
+    for(auto& d : cpu->Devices())
+    {
+	std::cout << std::hex << std::setw(8) << std::setfill('0') << d.addr
+		  << " " << d.name << std::endl;
+    }
+    return false;
+}
+
+class TrapCmd : public CmdClass
+{
+public:
+    bool DoIt(LineParser& lp) override;
+    std::string Description() override
+	{
+	    return  "TRAP [address|off|irq line] - Show or set the trap table, "
+		"or raise an interrupt";
+	}
+};
+
+bool TrapCmd::DoIt(LineParser& lp)
+{
+    static const char* names[InterruptVector] =
+	{ "divide", "illegal", "memory", "breakpoint" };
+    if (!lp.Done())
+    {
+	lp.Save();
+	std::string word = lp.GetWord();
+	uint32_t n;
+	if (word == "off")
+	{
+	    cpu->TrapTable(0);
+	}
+	else if (word == "irq")
+	{
+	    if (!lp.GetNum(n) || n >= NumInterrupts)
+	    {
+		lp.Error("Expected interrupt line");
+		return false;
+	    }
+	    cpu->Interrupt(n);
+	}
+	else
+	{
+	    lp.Restore();
+	    if (!GetAddr(lp, n))
+	    {
+		lp.Error("Expected address");
+		return false;
+	    }
+	    cpu->TrapTable(n);
+	}
+    }
+    if (!cpu->TrapTable())
+    {
+	std::cout << "No trap table" << std::endl;
+	return false;
+    }
+    std::cout << "Trap table at " << std::hex << cpu->TrapTable() << std::endl;
+    for(uint32_t v = 0; v < NumVectors; v++)
+    {
+	std::cout << std::hex << std::setw(8) << std::setfill('0')
+		  << cpu->TrapHandler(v) << " ";
+	if (v < InterruptVector)
+	{
+	    std::cout << names[v] << std::endl;
+	}
+	else
+	{
+	    std::cout << "interrupt " << std::dec << v - InterruptVector
+		      << std::endl;
+	}
+    }
+    std::cout << "Interrupts " << (cpu->InterruptsOn() ? "on" : "off")
+	      << ", pending " << std::hex << cpu->PendingInterrupts()
+	      << std::endl;
+    return false;
+}
+
+class FuzzCmd : public CmdClass
+{
+public:
+    bool DoIt(LineParser& lp) override;
+    std::string Description() override
+	{
+	    return  "FUZZ count [dir] - Run mutated inputs from the snapshot, "
+		"saving what is found in dir";
+	}
+};
+
+static void SaveInputs(const std::string& dir, const std::string& prefix,
+		       const std::vector<Fuzzer::Input>& inputs)
+{
+    for(size_t i = 0; i < inputs.size(); i++)
+    {
+	std::stringstream ss;
+	ss << dir << "/" << prefix << std::dec << std::setw(6)
+	   << std::setfill('0') << i;
+	std::ofstream f(ss.str(), std::ios::binary);
+	f.write(reinterpret_cast<const char*>(inputs[i].data()),
+		inputs[i].size());
+	if (!f)
+	{
+	    std::cerr << "Could not write " << ss.str() << std::endl;
+	    return;
+	}
+    }
+}
+
+/*
+  The corpus is kept between fuzz commands, starting from the input
+  given when the first one is run, until the next snapshot.
+*/
+bool FuzzCmd::DoIt(LineParser& lp)
+{
+    uint32_t count;
+    if (!lp.GetNum(count))
+    {
+	lp.Error("Expected number of runs");
+	return false;
+    }
+    std::string dir = lp.GetWord();
+    if (!cpu->Coverage())
+    {
+	std::cerr << "Fuzzing needs stew to be started with -m cover"
+		  << std::endl;
+	return false;
+    }
+    if (!cpu->HasSnapshot())
+    {
+	std::cerr << "No snapshot taken" << std::endl;
+	return false;
+    }
+    if (!cpu->Budget())
+    {
+	std::cerr << "Set a budget, so a run can't go on for ever"
+		  << std::endl;
+	return false;
+    }
+
+    std::vector<uint8_t> input = cpu->Input();
+    if (!fuzzer)
+    {
+	fuzzer = new Fuzzer(*cpu, 1);
+	fuzzer->Add(input);
+    }
+    auto t0 = std::chrono::steady_clock::now();
+    fuzzer->Run(count);
+    auto t1 = std::chrono::steady_clock::now();
+    cpu->Input(input);
+
+    double secs = std::chrono::duration<double>(t1 - t0).count();
+    std::cout << std::dec << "Runs: " << fuzzer->Runs()
+	      << ", corpus: " << fuzzer->Corpus().size()
+	      << ", crashes: " << fuzzer->Crashes().size()
+	      << ", edges: " << fuzzer->Edges()
+	      << ", runs/s: " << static_cast<uint64_t>(count / secs)
+	      << std::endl;
+    if (!dir.empty())
+    {
+	SaveInputs(dir, "queue-", fuzzer->Corpus());
+	SaveInputs(dir, "crash-", fuzzer->Crashes());
+    }
+    return false;
+}
+
+class ChunkCmd : public CmdClass
+{
+public:
+    bool DoIt(LineParser& lp) override;
+    std::string Description() override
+	{
+	    return  "CHUNK {bytes} - Show or set block instruction chunk size";
+	}
+};
+
+bool ChunkCmd::DoIt(LineParser& lp)
+{
+    if (!lp.Done())
+    {
+	uint32_t n;
+	if (!lp.GetNum(n) || n == 0)
+	{
+	    lp.Error("Expected non-zero number as argument");
+	    return false;
+	}
+	cpu->BlockChunk(n);
+    }
+    std::cout << "Block chunk size: " << std::dec << cpu->BlockChunk()
+	      << std::endl;
+    return false;
+}
+
+class BPSetCmd : public CmdClass
+{
+public:
+    bool DoIt(LineParser& lp) override;
+    std::string Description() override
+	{
+	    return  "BR address - Set breakpoint";
+	}
+};
+
+bool BPSetCmd::DoIt(LineParser& lp)
+{
+    uint32_t addr;
+    if (!GetAddr(lp, addr))
+    {
+	lp.Error("Invalid address");
+	return false;
+    }
+    BpEntry bp;
+    bp.oldInstr.value.word = cpu->ReadMem(addr, 4);
+    SetBreakpoint(addr);
+    bpList[addr] = bp;
+    return false;
+}
+
+class BPClearCmd : public CmdClass
+{
+public:
+    bool DoIt(LineParser& lp) override;
+    std::string Description() override
+	{
+	    return  "BR address - Set breakpoint";
+	}
+};
+
+bool BPClearCmd::DoIt(LineParser& lp)
+{
+    uint32_t addr;
+    if (!lp.GetNum(addr, 16))
+    {
+	lp.Error("Invalid address");
+	return false;
+    }
+    auto it = bpList.find(addr);
+    if (it == bpList.end())
+    {
+	lp.Error("Breakpoint not found");
+	return false;
+    }
+    else
+    {
+	cpu->WriteMem(addr, it->second.oldInstr.value.word, 4);
+	cpu->DebugBreak(addr, false);
+    }
+    return false;
+}
+
+class WatchCmd : public CmdClass
+{
+public:
+    bool DoIt(LineParser& lp) override;
+    std::string Description() override
+	{
+	    return  "WATCH {address {length} | clear} - Stop on writes to memory";
+	}
+};
+
+bool WatchCmd::DoIt(LineParser& lp)
+{
+    if (!lp.Done())
+    {
+	lp.Save();
+	if (lp.GetWord() == "clear")
+	{
+	    cpu->ClearWatches();
+	    return false;
+	}
+	lp.Restore();
+	uint32_t addr;
+	uint32_t len = 4;
+	if (!GetAddr(lp, addr) ||
+	    (!lp.Done() && (!lp.GetNum(len) || len == 0)))
+	{
+	    lp.Error("Expected address and optional length");
+	    return false;
+	}
+	cpu->Watch(addr, len);
+    }
+    if (std::string(cpu->AccessName()) != "watch")
+    {
+	std::cout << "Watchpoints need stew to be started with -m watch"
+		  << std::endl;
+    }
+    for(auto& w : cpu->Watches())
+    {
+	std::cout << std::hex << std::setw(8) << std::setfill('0') << w.first
+		  << " - " << std::setw(8) << w.second << std::endl;
     }
     return false;
 }
@@ -434,6 +1453,7 @@ bool SymbolCmd::DoIt(LineParser& lp)
 void InitCommands()
 {
     cmdMap["load"]     = new LoadCmd;
+    cmdMap["image"]    = new ImageCmd;
     cmdMap["help"]     = new HelpCmd;
     cmdMap["quit"]     = new QuitCmd("quit");
     cmdMap["exit"]     = new QuitCmd("exit");
@@ -441,14 +1461,37 @@ void InitCommands()
     cmdMap["s"]        = cmdMap["step"];
     cmdMap["regs"]     = new RegsCmd;
     cmdMap["run"]      = new RunCmd;
+    cmdMap["call"]     = new CallCmd;
     cmdMap["db"]       = new DumpCmd("db", 1);
     cmdMap["dw"]       = new DumpCmd("dw", 2);
     cmdMap["dl"]       = new DumpCmd("dl", 4);
     cmdMap["br"]       = new BPSetCmd;
     cmdMap["bc"]       = new BPClearCmd;
+    cmdMap["watch"]    = new WatchCmd;
     cmdMap["continue"] = cmdMap["run"];
     cmdMap["c"]        = cmdMap["run"];
     cmdMap["sym"]      = new SymbolCmd;
+    cmdMap["stats"]    = new StatsCmd;
+    cmdMap["chunk"]    = new ChunkCmd;
+    cmdMap["align"]    = new AlignCmd;
+    cmdMap["snapshot"] = new SnapshotCmd;
+    cmdMap["reset"]    = new ResetCmd;
+    cmdMap["budget"]   = new BudgetCmd;
+    cmdMap["input"]    = new InputCmd;
+    cmdMap["fuzz"]     = new FuzzCmd;
+    cmdMap["heap"]     = new HeapCmd;
+    cmdMap["disk"]     = new DiskCmd;
+    cmdMap["device"]   = new DeviceCmd;
+    cmdMap["trap"]     = new TrapCmd;
+    cmdMap["vregs"]    = new VRegsCmd;
+    cmdMap["simd"]     = new SimdCmd;
+    cmdMap["fregs"]    = new FRegsCmd;
+    cmdMap["fuse"]     = new FuseCmd;
+    cmdMap["profile"]  = new ProfileCmd;
+    cmdMap["pairs"]    = new PairsCmd;
+    cmdMap["tier"]     = new TierCmd;
+    cmdMap["cache"]    = new CacheCmd;
+    cmdMap["aot"]      = new AotCmd;
 }
 
 bool Command(LineParser& lp)
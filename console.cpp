@@ -0,0 +1,208 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <unistd.h>
+#include "console.h"
+#include "instruction.h"
+#include "memory.h"
+
+ConsoleInput::ConsoleInput()
+    : fd(-1), pos(0), end(0), eof(true)
+{
+}
+
+void ConsoleInput::Open(int fd)
+{
+    this->fd = fd;
+    buffer.resize(BufferSize);
+    pos = end = 0;
+    eof = fd < 0;
+}
+
+/* Only called with the buffer empty. Without wait, only reads if
+   there's something to read */
+bool ConsoleInput::Fill(bool wait)
+{
+    if (eof)
+    {
+	return false;
+    }
+    pos = end = 0;
+    if (!wait)
+    {
+	struct pollfd p = { fd, POLLIN, 0 };
+	if (poll(&p, 1, 0) <= 0)
+	{
+	    return false;
+	}
+    }
+    for(;;)
+    {
+	ssize_t n = read(fd, buffer.data(), buffer.size());
+	if (n > 0)
+	{
+	    end = n;
+	    return true;
+	}
+	if (n < 0 && errno == EINTR)
+	{
+	    continue;
+	}
+	if (n < 0 && errno == EAGAIN && !wait)
+	{
+	    return false;
+	}
+	eof = true;
+	return false;
+    }
+}
+
+uint32_t ConsoleInput::Take(uint8_t* dest, uint32_t max)
+{
+    uint32_t n = std::min(max, end - pos);
+    memcpy(dest, buffer.data() + pos, n);
+    pos += n;
+    return n;
+}
+
+int ConsoleInput::GetChar()
+{
+    if (pos == end && !Fill(true))
+    {
+	return -1;
+    }
+    return buffer[pos++];
+}
+
+uint32_t ConsoleInput::ReadLine(uint8_t* dest, uint32_t max)
+{
+    uint32_t n = 0;
+    while(n < max)
+    {
+	if (pos == end && !Fill(true))
+	{
+	    break;
+	}
+	uint32_t len = std::min(max - n, end - pos);
+	const void* nl = memchr(buffer.data() + pos, '\n', len);
+	if (nl)
+	{
+	    len = static_cast<const uint8_t*>(nl) - (buffer.data() + pos) + 1;
+	}
+	n += Take(dest + n, len);
+	if (nl)
+	{
+	    break;
+	}
+    }
+    return n;
+}
+
+bool ConsoleInput::ReadLine(std::string& line)
+{
+    line.clear();
+    for(;;)
+    {
+	int c = GetChar();
+	if (c < 0)
+	{
+	    return !line.empty();
+	}
+	if (c == '\n')
+	{
+	    return true;
+	}
+	line += c;
+    }
+}
+
+uint32_t ConsoleInput::Read(uint8_t* dest, uint32_t max)
+{
+    if (!max || (pos == end && eof))
+    {
+	return 0;
+    }
+    if (pos < end)
+    {
+	return Take(dest, max);
+    }
+    /* Big reads skip the buffer */
+    if (max >= BufferSize)
+    {
+	for(;;)
+	{
+	    ssize_t n = read(fd, dest, max);
+	    if (n > 0)
+	    {
+		return n;
+	    }
+	    if (n < 0 && errno == EINTR)
+	    {
+		continue;
+	    }
+	    eof = true;
+	    return 0;
+	}
+    }
+    return Fill(true) ? Take(dest, max) : 0;
+}
+
+uint32_t ConsoleInput::Available()
+{
+    if (pos == end)
+    {
+	Fill(false);
+    }
+    return end - pos;
+}
+
+uint32_t EmtConsoleGetChar(void* ctx, uint32_t* regs, Memory& memory)
+{
+    ConsoleInput* console = static_cast<ConsoleInput*>(ctx);
+    return console->GetChar();
+}
+
+/* Reads go straight into guest memory */
+static uint8_t* Dest(Memory& memory, uint32_t addr, uint32_t len)
+{
+    if (addr > memory.Size() || len > memory.Size() - addr)
+    {
+	return 0;
+    }
+    return memory.Data() + addr;
+}
+
+uint32_t EmtConsoleReadLine(void* ctx, uint32_t* regs, Memory& memory)
+{
+    ConsoleInput* console = static_cast<ConsoleInput*>(ctx);
+    uint8_t* dest = Dest(memory, regs[R0], regs[R1]);
+    if (!dest)
+    {
+	return 0;
+    }
+    uint32_t n = console->ReadLine(dest, regs[R1]);
+    memory.Written(regs[R0], n);
+    return n;
+}
+
+uint32_t EmtConsoleRead(void* ctx, uint32_t* regs, Memory& memory)
+{
+    ConsoleInput* console = static_cast<ConsoleInput*>(ctx);
+    uint8_t* dest = Dest(memory, regs[R0], regs[R1]);
+    if (!dest)
+    {
+	return 0;
+    }
+    uint32_t n = console->Read(dest, regs[R1]);
+    memory.Written(regs[R0], n);
+    return n;
+}
+
+uint32_t EmtConsolePoll(void* ctx, uint32_t* regs, Memory& memory)
+{
+    ConsoleInput* console = static_cast<ConsoleInput*>(ctx);
+    uint32_t n = console->Available();
+    regs[R1] = console->AtEnd();
+    return n;
+}
@@ -0,0 +1,56 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+  Buffered input from a host file descriptor, for the console EMTs.
+  stew gives it stdin and reads its command lines through it too, so
+  the commands and the program share one buffer: input after a "run"
+  line goes to the program, and nothing is read while it runs but
+  what it asks for. Reads fill the buffer a block at a time, and reads
+  bigger than the buffer go straight to the caller. Not opened, it is
+  always at the end.
+*/
+class ConsoleInput
+{
+public:
+    static const uint32_t BufferSize = 64 * 1024;
+
+    ConsoleInput();
+    void Open(int fd);
+    bool IsOpen() { return fd >= 0; }
+    /* The next byte, or -1 at the end */
+    int GetChar();
+    /* Up to and including a newline, at most max bytes, 0 at the end */
+    uint32_t ReadLine(uint8_t* dest, uint32_t max);
+    /* As std::getline, false at the end */
+    bool ReadLine(std::string& line);
+    /* Whatever is there, at most max bytes, waiting only if nothing is */
+    uint32_t Read(uint8_t* dest, uint32_t max);
+    /* Bytes that can be read without waiting */
+    uint32_t Available();
+    bool AtEnd() { return pos == end && eof; }
+
+private:
+    bool Fill(bool wait);
+    uint32_t Take(uint8_t* dest, uint32_t max);
+
+    int fd;
+    std::vector<uint8_t> buffer;
+    uint32_t pos;
+    uint32_t end;
+    bool eof;
+};
+
+class Memory;
+
+/* The EMTs, ctx is the ConsoleInput */
+uint32_t EmtConsoleGetChar(void* ctx, uint32_t* regs, Memory& memory);
+uint32_t EmtConsoleReadLine(void* ctx, uint32_t* regs, Memory& memory);
+uint32_t EmtConsoleRead(void* ctx, uint32_t* regs, Memory& memory);
+uint32_t EmtConsolePoll(void* ctx, uint32_t* regs, Memory& memory);
+
+#endif
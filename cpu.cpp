@@ -1,285 +1,2128 @@
 #include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <cfenv>
 #include "cpu.h"
+#include "devices.h"
 #include "memory.h"
+#include "access.h"
 #include "emt.h"
+#include "fuzz.h"
+#include "simd.h"
+#include "tier.h"
 
-CPU::CPU(Memory& mem, uint32_t start) : memory(mem)
+/* As TrapFault, but the block leaves before RunNative throws */
+static void AotTrapFault(AotState* s, Memory& memory, uint32_t addr)
+{
+    if (memory.Trapping() && memory.TakeFault())
+    {
+	s->trapped = true;
+	s->trapAddr = addr;
+    }
+}
+
+static uint32_t AotLoadMem(AotState* s, uint32_t addr, uint32_t size)
+{
+    Memory* memory = static_cast<Memory*>(s->ctx);
+    uint32_t value = memory->Read(addr, size);
+    AotTrapFault(s, *memory, addr);
+    return value;
+}
+
+static bool AotStoreMem(AotState* s, uint32_t addr, uint32_t value,
+			uint32_t size)
+{
+    Memory* memory = static_cast<Memory*>(s->ctx);
+    memory->Write(addr, value, size);
+    AotTrapFault(s, *memory, addr);
+    return memory->CodeWritten();
+}
+
+static void StdOutput(void* ctx, char c)
+{
+    std::cout << c << std::flush;
+}
+
+CPU::CPU(Memory& mem, uint32_t start)
+    : memory(mem), instrCount(0), fetchCount(0), fusedCount(0),
+      blockChunk(4096), fuse(true), fusing(false), lastOp(NOP),
+      tiering(true), tierThreshold(50), tierStats(), compiler(0),
+      lastBlock(0), lastExit(NOP), lastReturn(0), shadowTop(0), shadowCount(0),
+      watchAddr(0), budget(0), runEnd(0), stopAt(0), instrPc(0), steps(),
+      stepIndex(0), trapTable(0), trapsTaken(0), pending(0),
+      output(StdOutput), outputCtx(0), disk(mem), coverage(0), coverBits(0),
+      prevLoc(0)
 {
     registers[PC].Value(start);
+    for(int i = F0; i < MaxFReg; i++)
+    {
+	fregisters[i] = 0;
+    }
+    fpsr = FPRoundNearest;
+
+    static_assert(sizeof(Register) == sizeof(uint32_t),
+		  "Translated code uses the registers as an array");
+    aot.regs = &registers[0].Value();
+    aot.mem = memory.Data();
+    aot.memSize = memory.Size();
+    aot.ctx = &memory;
+    aot.trapped = false;
+    aot.trapAddr = 0;
+    aot.load = AotLoadMem;
+    aot.store = AotStoreMem;
+
+    for(auto& e : emts)
+    {
+	e = EmtEntry{ 0, 0 };
+    }
+    BindEmt(PrintChar, EmtPrintChar, this);
+    BindEmt(ReadInput, EmtReadInput, this);
+    BindEmt(MemCopy, EmtMemCopy, 0);
+    BindEmt(MemSet, EmtMemSet, 0);
+    BindEmt(StrLen, EmtStrLen, 0);
+    BindEmt(Sqrt, EmtSqrt, 0);
+    BindEmt(Hash, EmtHash, 0);
+    BindEmt(HeapInit, EmtHeapInit, &heap);
+    BindEmt(HeapAlloc, EmtHeapAlloc, &heap);
+    BindEmt(HeapFree, EmtHeapFree, &heap);
+    BindEmt(HeapRealloc, EmtHeapRealloc, &heap);
+    BindEmt(DiskRead, EmtDiskRead, &disk);
+    BindEmt(DiskWrite, EmtDiskWrite, &disk);
+    BindEmt(DiskStatus, EmtDiskStatus, &disk);
+    BindEmt(DiskWait, EmtDiskWait, &disk);
+    BindEmt(ConsoleGetChar, EmtConsoleGetChar, &console);
+    BindEmt(ConsoleReadLine, EmtConsoleReadLine, &console);
+    BindEmt(ConsoleRead, EmtConsoleRead, &console);
+    BindEmt(ConsolePoll, EmtConsolePoll, &console);
+    BindEmt(SetTraps, EmtTrapTable, this);
+}
+
+CPU::~CPU()
+{
+    delete compiler;
+    delete coverage;
+    for(auto b : blocks)
+    {
+	delete b.second;
+    }
+    for(auto& d : devices)
+    {
+	delete d.device;
+    }
+}
+
+
+static uint64_t MaskFromOpSize(OperandSize opsize)
+{
+    switch(opsize)
+    {
+    case Op8:
+	return 0xff;
+    case Op16:
+	return 0xffff;
+    case Op32:
+    case Op64:
+	return 0xffffffff;
+    }
+    return 0;
+}
+
+void CPU::UpdateFlags(uint64_t v, uint32_t v1, uint32_t v2, OperandSize opsize,
+		      OverflowFunc oflow)
+{
+    uint64_t mask = MaskFromOpSize(opsize);
+    uint64_t sign = (mask + 1) >> 1;
+    flags.z = !(v & mask);
+    flags.n = v & sign;
+    flags.c = v & (mask + 1);
+    if (oflow)
+    {
+	flags.v = oflow(v, v1, v2, sign);
+    }
+    else
+    {
+	flags.v = false;
+    }
+}
+
+static uint32_t SizeFromOpSize(OperandSize opsize)
+{
+    switch(opsize)
+    {
+    case Op8:
+	return 1;
+    case Op16:
+	return 2;
+    case Op32:
+	return 4;
+    case Op64:
+	return 8;
+    }
+}
+
+/* size is the operand size in bytes, used for auto-increment/decrement */
+template<typename Access>
+uint32_t CPUCore<Access>::GetAddr(AddrMode mode, RegName reg, uint32_t size)
+{
+    size_t regsize = size;
+    if (reg == PC || reg == SP)
+    {
+	regsize = 4;
+    }
+    switch(mode)
+    {
+    case Indir:
+	return registers[reg].Value();
+
+    case IndirAutoInc:
+    {
+	uint32_t addr = registers[reg].Value();
+	registers[reg] += regsize;
+	if (reg == PC)
+	{
+	    fetchCount++;
+	}
+	else
+	{
+	    Stepped(reg, regsize);
+	}
+	return addr;
+    }
+    case AutoDecIndir:
+	registers[reg] -= regsize;
+	Stepped(reg, -regsize);
+	return registers[reg].Value();
+
+    case Displacement:
+    {
+	/* The displacement follows, and PC relative is from after it */
+	uint32_t disp = ReadMem(registers[PC].Value(), 4);
+	registers[PC] += 4;
+	fetchCount++;
+	return registers[reg].Value() + disp;
+    }
+
+    case Direct:
+    case Immediate:
+	/* No memory operand */
+	break;
+    }
+    return 0xdeadbeef;
+}
+
+template<typename Access>
+uint32_t CPUCore<Access>::GetValue(AddrMode mode, RegName reg,
+				   OperandSize opsize)
+{
+    if (mode == Direct)
+    {
+	return registers[reg].Value();
+    }
+    uint32_t size = SizeFromOpSize(opsize);
+    return ReadMem(GetAddr(mode, reg, size), size);
+}
+
+template<typename Access>
+uint32_t CPUCore<Access>::GetSourceValue(Instruction instr)
+{
+    if (instr.value.srcMode == Immediate)
+    {
+	return instr.value.srcImm;
+    }
+    return GetValue(instr.value.srcMode, instr.value.source, instr.value.size);
+}
+
+/*
+  The destination address is worked out once per instruction, so that
+  read-modify-write operations only apply auto-increment/decrement and
+  read the displacement word once.
+*/
+template<typename Access>
+uint32_t CPUCore<Access>::GetDestAddr(Instruction instr)
+{
+    return GetAddr(instr.value.destMode, instr.value.dest,
+		   SizeFromOpSize(instr.value.size));
+}
+
+template<typename Access>
+uint32_t CPUCore<Access>::GetDestValue(Instruction instr, uint32_t addr)
+{
+    switch(instr.value.destMode)
+    {
+    case Direct:
+	return registers[instr.value.dest].Value();
+    case Immediate:
+	return instr.value.destImm;
+    default:
+	return ReadMem(addr, SizeFromOpSize(instr.value.size));
+    }
+}
+
+static uint32_t SignExtend(uint32_t value, OperandSize opsize)
+{
+    switch(opsize)
+    {
+    case Op32:
+    case Op64:
+	break;
+    case Op16:
+	value &= 0xFFFF;
+	if (value & 0x8000)
+	{
+	    value |= 0xFFFF0000;
+	}
+	break;
+    case Op8:
+	value &= 0xFF;
+	if (value & 0x80)
+	{
+	    value |= 0xFFFFFF00;
+	}
+	break;
+    }
+    return value;
+}
+
+template<typename Access>
+void CPUCore<Access>::StoreDestValue(Instruction instr, uint32_t addr,
+				     uint32_t value)
+{
+    switch(instr.value.destMode)
+    {
+    case Direct:
+	value = SignExtend(value, instr.value.size);
+	registers[instr.value.dest].Value(value);
+	break;
+
+    case Immediate:
+	/* Storing to a constant has no effect */
+	break;
+
+    default:
+	WriteMem(addr, value, SizeFromOpSize(instr.value.size));
+	break;
+    }
+}
+
+bool CPU::MapDevice(uint32_t addr, uint32_t len, Device* device)
+{
+    if (!memory.MapDevice(addr, len, device))
+    {
+	return false;
+    }
+    /* Translated code takes accesses from here up back to Memory */
+    aot.memSize = memory.PlainSize();
+    return true;
+}
+
+bool CPU::MapDevice(const std::string& name, uint32_t addr)
+{
+    Device* device = NewDevice(name, *this);
+    if (!device || !MapDevice(addr, Memory::PageSize, device))
+    {
+	delete device;
+	return false;
+    }
+    devices.push_back(MappedDevice{ name, addr, device });
+    return true;
+}
+
+bool CPU::BindEmt(uint32_t num, EmtFunc fn, void* ctx)
+{
+    if (num >= EmtTableSize)
+    {
+	return false;
+    }
+    emts[num] = EmtEntry{ fn, ctx };
+    return true;
+}
+
+uint32_t CPU::EmtPrintChar(void* ctx, uint32_t* regs, Memory& memory)
+{
+    CPU* cpu = static_cast<CPU*>(ctx);
+    cpu->output(cpu->outputCtx, regs[R0]);
+    return regs[R0];
+}
+
+uint32_t CPU::EmtReadInput(void* ctx, uint32_t* regs, Memory& memory)
+{
+    CPU* cpu = static_cast<CPU*>(ctx);
+    uint32_t len = std::min<uint64_t>(cpu->input.size(), regs[R1]);
+    if (len && !memory.Store(regs[R0], cpu->input.data(), len))
+    {
+	len = 0;
+    }
+    return len;
+}
+
+/*
+  The return address pushed is the last word of memory, holding a HLT,
+  so halting just after it means the function returned.
+*/
+ExecResult CPU::Call(uint32_t addr)
+{
+    uint32_t stub = memory.Size() - 4;
+    Instruction hlt;
+    hlt.value.word = 0;
+    hlt.value.op = HLT;
+    uint32_t sp = registers[SP].Value() - 4;
+    if (!memory.Store(stub, &hlt.value.word, 4) ||
+	!memory.Store(sp, &stub, 4))
+    {
+	return Fault;
+    }
+    registers[SP].Value(sp);
+    registers[PC].Value(addr);
+    ExecResult res = Run();
+    if (res == Halt && registers[PC].Value() == stub + 4)
+    {
+	return Returned;
+    }
+    return res;
+}
+
+void CPU::Snapshot()
+{
+    /* A disk read must finish, and be noted, before memory is kept */
+    uint32_t moved;
+    disk.Wait(moved);
+    memory.Snapshot();
+    std::copy(registers, registers + MaxReg, saved.registers);
+    std::copy(vregisters, vregisters + MaxVReg, saved.vregisters);
+    std::copy(fregisters, fregisters + MaxFReg, saved.fregisters);
+    saved.fpsr = fpsr;
+    saved.flags = flags;
+    heap.Mark();
+    saved.heap = heap;
+    saved.events = events;
+    saved.instrCount = instrCount;
+    saved.trapTable = trapTable;
+    saved.pending = pending;
 }
 
+bool CPU::Reset(uint32_t& pages)
+{
+    if (!memory.HasSnapshot())
+    {
+	return false;
+    }
+    uint32_t moved;
+    disk.Wait(moved);
+    pages = memory.Restore();
+    std::copy(saved.registers, saved.registers + MaxReg, registers);
+    std::copy(saved.vregisters, saved.vregisters + MaxVReg, vregisters);
+    std::copy(saved.fregisters, saved.fregisters + MaxFReg, fregisters);
+    fpsr = saved.fpsr;
+    flags = saved.flags;
+    if (heap.Generation() != saved.heap.Generation())
+    {
+	heap.Restore(saved.heap);
+    }
+    /* The count carries on, so the events move with it */
+    events = saved.events;
+    events.Shift(instrCount - saved.instrCount);
+    TrapTable(saved.trapTable);
+    pending = saved.pending;
+    /* Calls made in the last run won't be returned from */
+    shadowCount = 0;
+    prevLoc = 0;
+    return true;
+}
+
+/*
+  |0010xx || BNE || Branch if not equal (Z=0)
+  |0014xx || BEQ || Branch if equal (Z=1)
+  |0020xx || BGE || Branch if greater than or equal (N|V = 0)
+  |0024xx || BLT || Branch if less than (N|V = 1)
+  |0030xx || BGT || Branch if greater than (N^V = 1)
+  |0034xx || BLE || Branch if less than or equal (N^V = 0)
+  |1010xx || BHI || Branch if higher than (C|Z = 0)
+  |1014xx || BLOS|| Branch if lower or same (C|Z = 1)
+  |1020xx || BVC || Branch if overflow clear (V=0)
+  |1024xx || BVS || Branch if overflow set (V=1)
+  |1030xx || BCC || Branch if carry clear (C=0)
+  |       || BHIS|| Branch if higher or same (C=0)
+  |1034xx || BCS || Branch if carry set (C=1)
+  |       || BLO || Branch if lower than (C=1)
+*/
+bool CPU::Condition(InstrKind op)
+{
+    switch(op)
+    {
+    case BNE:
+	return !flags.z;
+    case BEQ:
+	return flags.z;
+    case BLT:
+	return flags.n | flags.v;
+    case BGT:
+	return flags.n ^ flags.v;
+    case BGE:
+	return !(flags.n | flags.v);
+    case BLE:
+	return !(flags.n ^ flags.v);
+    case BHI:
+	return !(flags.c | flags.z);
+    case BLOS:
+	return flags.c | flags.z;
+    case BVS:
+	return flags.v;
+    case BVC:
+	return !flags.v;
+    case BCC:
+	return !flags.c;
+    case BCS:
+	return flags.c;
+    case BPL:
+	return !flags.n;
+    case BMI:
+	return flags.n;
+    case BR:
+	return true;
+    default:
+	assert(0 && "Not a branch instruction");
+	break;
+    }
+    return false;
+}
+
+template<typename Access>
+void CPUCore<Access>::BranchIfTrue(Instruction instr, bool cond)
+{
+    if (cond)
+    {
+	registers[PC] += instr.value.branch;
+    }
+    Edge();
+}
+
+template<typename Access>
+void CPUCore<Access>::Branch(Instruction instr)
+{
+    BranchIfTrue(instr, Condition(instr.value.op));
+}
+
+template<typename Access>
+void CPUCore<Access>::Move(Instruction instr)
+{
+    uint32_t v = GetSourceValue(instr);
+    uint32_t addr = GetDestAddr(instr);
+    StoreDestValue(instr, addr, v);
+    UpdateFlags(v, v, v, instr.value.size, 0 );
+}
+
+template<typename Access>
+void CPUCore<Access>::Add(Instruction instr)
+{
+    uint32_t v1 = GetSourceValue(instr);
+    uint32_t addr = GetDestAddr(instr);
+    uint32_t v2 = GetDestValue(instr, addr);
+    uint64_t v = static_cast<uint64_t>(v1) + v2;
+    StoreDestValue(instr, addr, v);
+    UpdateFlags(v, v1, v2, instr.value.size, AotAddOverflow);
+}
 
-static bool CmpOverflow(uint64_t v, uint32_t v1, uint32_t v2, uint64_t sign)
+template<typename Access>
+void CPUCore<Access>::Sub(Instruction instr)
 {
-    /*
-      cmp:
-      V: set if there was arithmetic overflow; that is, operands were
-      of opposite signs and the sign of the destination was the
-      same as the sign of the result; cleared otherwise
-    */
+    uint32_t src = GetSourceValue(instr);
+    uint32_t addr = GetDestAddr(instr);
+    uint32_t dest = GetDestValue(instr, addr);
+    uint64_t v = static_cast<uint64_t>(dest) - src;
+    StoreDestValue(instr, addr, v);
+    UpdateFlags(v, src, dest, instr.value.size, AotSubOverflow);
+}
+
+template<typename Access>
+void CPUCore<Access>::Adc(Instruction instr)
+{
+    uint32_t v1 = GetSourceValue(instr);
+    uint32_t addr = GetDestAddr(instr);
+    uint32_t v2 = GetDestValue(instr, addr);
+    uint64_t v = static_cast<uint64_t>(v1) + v2 + flags.c;
+    StoreDestValue(instr, addr, v);
+    UpdateFlags(v, v1, v2, instr.value.size, AotAddOverflow);
+}
+
+template<typename Access>
+void CPUCore<Access>::Sbc(Instruction instr)
+{
+    uint32_t src = GetSourceValue(instr);
+    uint32_t addr = GetDestAddr(instr);
+    uint32_t dest = GetDestValue(instr, addr);
+    uint64_t v = static_cast<uint64_t>(dest) - src - flags.c;
+    StoreDestValue(instr, addr, v);
+    UpdateFlags(v, src, dest, instr.value.size, AotSubOverflow);
+}
+
+template<typename Access>
+void CPUCore<Access>::Neg(Instruction instr)
+{
+    uint64_t mask = MaskFromOpSize(instr.value.size);
+    uint32_t src = GetSourceValue(instr) & mask;
+    uint32_t addr = GetDestAddr(instr);
+    uint64_t v = static_cast<uint64_t>(0) - src;
+    StoreDestValue(instr, addr, v);
+    /* C is set unless the result is zero, V only for the most negative */
+    UpdateFlags(v, src, 0, instr.value.size, AotSubOverflow);
+}
+
+template<typename Access>
+void CPUCore<Access>::Com(Instruction instr)
+{
+    uint64_t mask = MaskFromOpSize(instr.value.size);
+    uint32_t v = ~GetSourceValue(instr) & mask;
+    uint32_t addr = GetDestAddr(instr);
+    StoreDestValue(instr, addr, v);
+    UpdateFlags(v, 0, 0, instr.value.size, 0);
+    flags.c = true;
+}
+
+/* AND, OR and XOR: N and Z from the result, V cleared, C unaffected */
+template<typename Access>
+void CPUCore<Access>::Logic(Instruction instr)
+{
+    uint64_t mask = MaskFromOpSize(instr.value.size);
+    uint32_t src = GetSourceValue(instr);
+    uint32_t addr = GetDestAddr(instr);
+    uint32_t dest = GetDestValue(instr, addr);
+    uint32_t v = 0;
+    switch(instr.value.op)
+    {
+    case AND:
+	v = dest & src;
+	break;
+    case OR:
+	v = dest | src;
+	break;
+    case XOR:
+	v = dest ^ src;
+	break;
+    default:
+	assert(0 && "Not a logic instruction");
+	break;
+    }
+    StoreDestValue(instr, addr, v);
+    bool c = flags.c;
+    UpdateFlags(v & mask, 0, 0, instr.value.size, 0);
+    flags.c = c;
+}
+
+/*
+  Shift and rotate dest by the number of bits given by src. C is the
+  last bit shifted (or rotated) out, and V is N ^ C. Rotates are
+  within the operand, not through the carry.
+*/
+template<typename Access>
+void CPUCore<Access>::Shift(Instruction instr)
+{
+    uint64_t mask = MaskFromOpSize(instr.value.size);
+    uint32_t count = GetSourceValue(instr);
+    uint32_t addr = GetDestAddr(instr);
+    uint64_t x = GetDestValue(instr, addr) & mask;
+    uint64_t v = AotShift(instr.value.op, x, count,
+			  SizeFromOpSize(instr.value.size));
+    StoreDestValue(instr, addr, v);
+    UpdateFlags(v, 0, 0, instr.value.size, AotShiftOverflow);
+}
+
+template<typename Access>
+void CPUCore<Access>::Cmp(Instruction instr)
+{
+    uint32_t src = GetSourceValue(instr);
+    uint32_t dest = GetDestValue(instr, GetDestAddr(instr));
+    uint64_t v = static_cast<uint64_t>(src) - dest;
+    UpdateFlags(v, src, dest, instr.value.size, AotCmpOverflow);
+}
+
+template<typename Access>
+void CPUCore<Access>::Div(Instruction instr)
+{
+    /* A register quotient has the remainder in the next, an odd one */
+    if (instr.value.destMode == Direct &&
+	(instr.value.dest & 1 || instr.value.dest >= SP))
+    {
+	throw GuestTrap{ IllegalTrap, 0 };
+    }
+    uint32_t v1 = GetSourceValue(instr);
+    if (!v1)
+    {
+	throw GuestTrap{ DivideTrap, 0 };
+    }
+    uint32_t addr = GetDestAddr(instr);
+    uint32_t v2 = GetDestValue(instr, addr);
+    uint32_t v_div = v2 / v1;
+    uint32_t v_mod = v2 % v1;
+    StoreDestValue(instr, addr, v_div);
+    if (instr.value.destMode == Direct)
+    {
+	registers[instr.value.dest+1].Value(v_mod);
+    }
+    UpdateFlags(v_div, 0, 0, instr.value.size, 0); // TODO: Add ovflowe func.
+}
+
+template<typename Access>
+void CPUCore<Access>::Mul(Instruction instr)
+{
+    uint32_t v1 = GetSourceValue(instr);
+    uint32_t addr = GetDestAddr(instr);
+    uint32_t v2 = GetDestValue(instr, addr);
+    uint64_t v = static_cast<uint64_t>(v2) * v1;
+    StoreDestValue(instr, addr, v);
+    UpdateFlags(v, 0, 0, instr.value.size, 0);  // TODO: Add overflow func.
+}
+
+/*
+  Block instructions handle at most blockChunk bytes per execution.
+  If there is more to do, the registers are left pointing at the rest
+  and the PC at the instruction, so it gets executed again. That way
+  breakpoints and single stepping still work for long blocks. A copy
+  to an overlapping destination above the source goes from the end, a
+  chunk at a time, with the registers left describing the start still
+  to do. Once what is left no longer overlaps, the rest goes forwards.
+*/
+template<typename Access>
+bool CPUCore<Access>::Block(Instruction instr)
+{
+    Register& src = registers[instr.value.source];
+    Register& dest = registers[instr.value.dest];
+    Register& count = registers[instr.value.count];
+    uint32_t len = std::min(count.Value(), blockChunk);
+    uint32_t done = len;
+    bool found = false;
+    switch(instr.value.op)
+    {
+    case BCPY:
+	if (dest.Value() != src.Value() &&
+	    dest.Value() - src.Value() < count.Value())
+	{
+	    uint32_t rest = count.Value() - len;
+	    if (!memory.Copy(dest.Value() + rest, src.Value() + rest, len))
+	    {
+		return false;
+	    }
+	    count -= len;
+	    if (count.Value())
+	    {
+		registers[PC] -= 4;
+	    }
+	    return true;
+	}
+	if (!memory.Copy(dest.Value(), src.Value(), len))
+	{
+	    return false;
+	}
+	src += len;
+	break;
+
+    case BFIL:
+	if (!memory.Fill(dest.Value(), src.Value(), len))
+	{
+	    return false;
+	}
+	break;
+
+    case BCMP:
+	if (!memory.Compare(src.Value(), dest.Value(), len, done))
+	{
+	    return false;
+	}
+	src += done;
+	found = done != len;
+	break;
+
+    case BSCN:
+	if (!memory.Scan(dest.Value(), src.Value(), len, done))
+	{
+	    return false;
+	}
+	found = done != len;
+	break;
+
+    default:
+	assert(0 && "Not a block instruction");
+	break;
+    }
+    dest += done;
+    count -= done;
+
+    if (!found && count.Value())
+    {
+	registers[PC] -= 4;
+	return true;
+    }
+
+    switch(instr.value.op)
+    {
+    case BCMP:
+	if (found)
+	{
+	    /* Flags as for cmp.b of the first differing bytes */
+	    uint32_t v1 = ReadMem(src.Value(), 1);
+	    uint32_t v2 = ReadMem(dest.Value(), 1);
+	    UpdateFlags(static_cast<uint64_t>(v1) - v2, v1, v2, Op8,
+			AotCmpOverflow);
+	}
+	else
+	{
+	    UpdateFlags(0, 0, 0, Op8, 0);
+	}
+	break;
+
+    case BSCN:
+	UpdateFlags(!found, 0, 0, Op8, 0);
+	break;
+
+    default:
+	break;
+    }
+    return true;
+}
+
+/*
+  VLD broadcasts a register or immediate source to all lanes, and VST
+  to a register stores lane 0. Otherwise they move 16 bytes to or from
+  memory, and auto-increment/decrement step by 16.
+*/
+static bool IsValueOperand(AddrMode mode, RegName reg)
+{
+    return mode == Direct || mode == Immediate ||
+	(mode == IndirAutoInc && reg == PC);
+}
+
+template<typename Access>
+bool CPUCore<Access>::VectorLoad(Instruction instr)
+{
+    VectorRegister& vd = vregisters[instr.value.dest % MaxVReg];
+    if (IsValueOperand(instr.value.srcMode, instr.value.source))
+    {
+	uint32_t v = GetSourceValue(instr);
+	uint32_t size = SizeFromOpSize(instr.value.size);
+	for(uint32_t i = 0; i < sizeof(vd.bytes); i += size)
+	{
+	    memcpy(&vd.bytes[i], &v, size);
+	}
+	return true;
+    }
+    uint32_t addr = GetAddr(instr.value.srcMode, instr.value.source,
+			    sizeof(vd.bytes));
+    return memory.Load(addr, vd.bytes, sizeof(vd.bytes));
+}
+
+template<typename Access>
+bool CPUCore<Access>::VectorStore(Instruction instr)
+{
+    VectorRegister& vs = vregisters[instr.value.source % MaxVReg];
+    if (instr.value.destMode == Direct)
+    {
+	uint32_t v = 0;
+	memcpy(&v, vs.bytes, SizeFromOpSize(instr.value.size));
+	registers[instr.value.dest].Value(v);
+	return true;
+    }
+    uint32_t addr = GetAddr(instr.value.destMode, instr.value.dest,
+			    sizeof(vs.bytes));
+    return memory.Store(addr, vs.bytes, sizeof(vs.bytes));
+}
+
+template<typename Access>
+void CPUCore<Access>::Vector(Instruction instr)
+{
+    VectorOp op = static_cast<VectorOp>(instr.value.op - VADD);
+    VectorFunc fn = GetVectorFunc(op, instr.value.size);
+    fn(vregisters[instr.value.dest % MaxVReg],
+       vregisters[instr.value.source % MaxVReg]);
+}
+
+/*
+  FP registers hold doubles. Single precision operations are done as
+  float, so the results are rounded as IEEE single, and memory operands
+  are 4 or 8 bytes. Exceptions raised by the host are collected as
+  sticky flags in the FP status.
+*/
+static const int hostRounding[] =
+{
+    FE_TONEAREST,		/* FPRoundNearest */
+    FE_TOWARDZERO,		/* FPRoundZero */
+    FE_UPWARD,			/* FPRoundUp */
+    FE_DOWNWARD,		/* FPRoundDown */
+};
+
+/*
+  The guest's rounding mode and exception flags are only the host's
+  while an FP instruction runs, so they don't leak into the program
+  embedding the CPU, or another CPU on the same thread. Setting them is
+  slow, so only what differs is set.
+*/
+class GuestFPEnv
+{
+public:
+    GuestFPEnv(uint32_t fpsr)
+	: hostRound(fegetround()), guestRound(hostRounding[fpsr & FPRoundMask]),
+	  hostFlags(fetestexcept(FE_ALL_EXCEPT))
+    {
+	if (hostFlags)
+	{
+	    fegetexceptflag(&hostExcept, FE_ALL_EXCEPT);
+	    feclearexcept(FE_ALL_EXCEPT);
+	}
+	if (guestRound != hostRound)
+	{
+	    fesetround(guestRound);
+	}
+    }
+    ~GuestFPEnv()
+    {
+	if (guestRound != hostRound)
+	{
+	    fesetround(hostRound);
+	}
+	if (fetestexcept(FE_ALL_EXCEPT) != hostFlags)
+	{
+	    if (hostFlags)
+	    {
+		fesetexceptflag(&hostExcept, FE_ALL_EXCEPT);
+	    }
+	    else
+	    {
+		feclearexcept(FE_ALL_EXCEPT);
+	    }
+	}
+    }
+
+private:
+    int hostRound;
+    int guestRound;
+    int hostFlags;
+    fexcept_t hostExcept;
+};
+
+void CPU::UpdateFPExcept()
+{
+    int e = fetestexcept(FE_ALL_EXCEPT);
+    if (e & FE_INVALID)
+    {
+	fpsr |= FPInvalid;
+    }
+    if (e & FE_DIVBYZERO)
+    {
+	fpsr |= FPDivZero;
+    }
+    if (e & FE_OVERFLOW)
+    {
+	fpsr |= FPOverflow;
+    }
+    if (e & FE_UNDERFLOW)
+    {
+	fpsr |= FPUnderflow;
+    }
+    if (e & FE_INEXACT)
+    {
+	fpsr |= FPInexact;
+    }
+}
+
+static double RoundToSize(double v, OperandSize opsize)
+{
+    return opsize == Op32 ? static_cast<float>(v) : v;
+}
+
+template<typename Access>
+bool CPUCore<Access>::GetFPValue(AddrMode mode, RegName reg,
+				 OperandSize opsize, double& v)
+{
+    if (mode == Direct)
+    {
+	v = fregisters[reg % MaxFReg];
+	return true;
+    }
+    uint32_t addr = GetAddr(mode, reg, SizeFromOpSize(opsize));
+    if (opsize == Op32)
+    {
+	float f;
+	if (!memory.Load(addr, &f, sizeof(f)))
+	{
+	    return false;
+	}
+	v = f;
+	return true;
+    }
+    return memory.Load(addr, &v, sizeof(v));
+}
+
+template<typename Access>
+bool CPUCore<Access>::StoreFPValue(Instruction instr, double v)
+{
+    v = RoundToSize(v, instr.value.size);
+    if (instr.value.destMode == Direct)
+    {
+	fregisters[instr.value.dest % MaxFReg] = v;
+	return true;
+    }
+    uint32_t addr = GetDestAddr(instr);
+    if (instr.value.size == Op32)
+    {
+	float f = v;
+	return memory.Store(addr, &f, sizeof(f));
+    }
+    return memory.Store(addr, &v, sizeof(v));
+}
+
+template<typename T>
+static T FPOp(InstrKind op, T dest, T src)
+{
+    switch(op)
+    {
+    case FADD:
+	return dest + src;
+    case FSUB:
+	return dest - src;
+    case FMUL:
+	return dest * src;
+    case FDIV:
+	return dest / src;
+    case FSQRT:
+	return std::sqrt(src);
+    default:
+	assert(0 && "Not a FP arithmetic instruction");
+	break;
+    }
+    return 0;
+}
+
+template<typename Access>
+bool CPUCore<Access>::FloatingPoint(Instruction instr)
+{
+    GuestFPEnv env(fpsr);
+    /* The integer side of conversions and status moves is 32 bits */
+    Instruction intInstr = instr;
+    intInstr.value.size = Op32;
+    double src = 0;
+    if (instr.value.op != ITOF && instr.value.op != LDFPS &&
+	instr.value.op != STFPS &&
+	!GetFPValue(instr.value.srcMode, instr.value.source, instr.value.size,
+		    src))
+    {
+	return false;
+    }
+
+    double& dest = fregisters[instr.value.dest % MaxFReg];
+    switch(instr.value.op)
+    {
+    case FMOV:
+	if (!StoreFPValue(instr, src))
+	{
+	    return false;
+	}
+	break;
+
+    case FADD:
+    case FSUB:
+    case FMUL:
+    case FDIV:
+    case FSQRT:
+    {
+	/* The old value of dest plays no part in sqrt */
+	double d = instr.value.op == FSQRT ? 0 : dest;
+	if (instr.value.size == Op32)
+	{
+	    dest = FPOp<float>(instr.value.op, d, src);
+	}
+	else
+	{
+	    dest = FPOp<double>(instr.value.op, d, src);
+	}
+	break;
+    }
+
+    case FCMP:
+	/* Same sense as CMP: flags from src - dest */
+	flags.z = src == dest;
+	flags.n = src < dest;
+	flags.v = std::isunordered(src, dest);
+	flags.c = false;
+	break;
+
+    case ITOF:
+    {
+	int32_t v = GetSourceValue(intInstr);
+	dest = RoundToSize(v, instr.value.size);
+	break;
+    }
+
+    case FTOI:
+    {
+	/* Out of range gives the most negative integer and invalid */
+	double r = std::rint(src);
+	uint32_t v = 0x80000000;
+	bool valid = r >= INT32_MIN && r <= INT32_MAX;
+	if (valid)
+	{
+	    v = static_cast<int32_t>(r);
+	}
+	else
+	{
+	    fpsr |= FPInvalid;
+	}
+	StoreDestValue(intInstr, GetDestAddr(intInstr), v);
+	UpdateFlags(v, 0, 0, Op32, 0);
+	flags.v = !valid;
+	break;
+    }
+
+    case LDFPS:
+	fpsr = GetSourceValue(intInstr);
+	break;
+
+    case STFPS:
+	StoreDestValue(intInstr, GetDestAddr(intInstr), fpsr);
+	break;
+
+    default:
+	assert(0 && "Not a FP instruction");
+	break;
+    }
+    UpdateFPExcept();
+    return true;
+}
+
+template<typename Access>
+void CPUCore<Access>::Jmp(Instruction instr)
+{
+    uint32_t v = GetSourceValue(instr);
+    registers[PC].Value(v);
+    Edge();
+}
+
+template<typename Access>
+void CPUCore<Access>::Jsr(Instruction instr)
+{
+    uint32_t v = GetSourceValue(instr);
+    /* SP moves once the push is done, so a fault leaves it */
+    WriteMem(registers[SP].Value() - 4, registers[PC].Value(), 4);
+    registers[SP] -= 4;
+    lastExit = JSR;
+    lastReturn = registers[PC].Value();
+    registers[PC].Value(v);
+    Edge();
+}
+
+template<typename Access>
+void CPUCore<Access>::Ret(Instruction instr)
+{
+    registers[PC].Value(ReadMem(registers[SP].Value(), 4));
+    registers[SP] += 4;
+    lastExit = RET;
+    Edge();
+}
+
+/* Pops the frame a trap pushed, see TrapVector */
+template<typename Access>
+void CPUCore<Access>::Rti(Instruction instr)
+{
+    uint32_t sp = registers[SP].Value();
+    uint32_t pc = ReadMem(sp + 4, 4);
+    flags.word = ReadMem(sp + 8, 4);
+    registers[SP].Value(sp + 12);
+    registers[PC].Value(pc);
+    CheckInterrupts();
+    Edge();
+}
+
+/*
+  When running (rather than single stepping), a flag setting instruction
+  followed by a branch, or MOV followed by RET, is done as a single
+  step of the dispatch loop. The second instruction is still fetched
+  and counted, so the state is the same as when executed one by one.
+  A breakpoint on the second instruction is a BPT, so it is not fused,
+  and neither is one the budget or an event has to stop before, or one
+  after an instruction that faulted or hit a watchpoint.
+*/
+template<typename Access>
+void CPUCore<Access>::FuseNext(bool allowRet)
+{
+    if (instrCount >= stopAt || (Access::Faults && memory.Faulted()) ||
+	(Access::Watching && memory.WatchHit()))
+    {
+	return;
+    }
+    instrPc = registers[PC].Value();
+    Instruction next = Peek();
+    InstrKind op = next.value.op;
+    if (op >= BEQ && op <= BR)
+    {
+	Consume(next);
+	BranchIfTrue(next, Condition(op));
+	fusedCount++;
+    }
+    else if (allowRet && op == RET)
+    {
+	Consume(next);
+	Ret(next);
+	fusedCount++;
+    }
+}
+
+void CPU::Profile(bool enable)
+{
+    pairCounts.clear();
+    if (enable)
+    {
+	pairCounts.resize((MAX_INST + 1) * (MAX_INST + 1));
+    }
+}
+
+template<typename Access>
+CPUCore<Access>::CPUCore(Memory& mem, uint32_t start)
+    : CPU(mem, start)
+{
+    if (Access::Covering)
+    {
+	coverage = new CoverageMap;
+	coverBits = coverage->Bits();
+    }
+}
+
+template<typename Access>
+ExecResult CPUCore<Access>::Run()
+{
+    ExecResult res = Continue;
+    runEnd = budget ? instrCount + budget : UINT64_MAX;
+    stopAt = NextStop();
+    /* Taking a trap goes round again, from the handler */
+    for(;;)
+    {
+	fusing = fuse;
+	try
+	{
+	    /* Watchpoints are checked after each instruction, so interpret all */
+	    if (tiering && !Access::Watching)
+	    {
+		res = RunTiered();
+	    }
+	    else
+	    {
+		/* StepInstr inlines into the loop, traps are caught below */
+		while((instrCount < stopAt || Deadline()) &&
+		      (res = StepInstr()) == Continue);
+	    }
+	    if (res == Continue || !trapTable || (res = TrapOrStop(res)) != Continue)
+	    {
+		break;
+	    }
+	}
+	catch(const GuestTrap& trap)
+	{
+	    if ((res = Trapped(trap)) != Continue)
+	    {
+		break;
+	    }
+	}
+    }
+    if (res == Continue)
+    {
+	res = Limit;
+    }
+    fusing = false;
+    return res;
+}
+
+void CPU::TrapTable(uint32_t addr)
+{
+    trapTable = addr;
+    memory.Trapping(addr != 0);
+}
+
+uint32_t CPU::TrapHandler(uint32_t vector)
+{
+    uint32_t handler;
+    if (!trapTable || vector >= NumVectors ||
+	!memory.Load(trapTable + vector * 4, &handler, 4))
+    {
+	return 0;
+    }
+    return handler;
+}
+
+uint32_t CPU::EmtTrapTable(void* ctx, uint32_t* regs, Memory& memory)
+{
+    CPU* cpu = static_cast<CPU*>(ctx);
+    uint32_t old = cpu->trapTable;
+    cpu->TrapTable(regs[R0]);
+    return old;
+}
+
+void CPU::DebugBreak(uint32_t addr, bool set)
+{
+    if (set)
+    {
+	debugBreaks.insert(addr);
+    }
+    else
+    {
+	debugBreaks.erase(addr);
+    }
+}
+
+void CPU::Interrupt(uint32_t line)
+{
+    if (line < NumInterrupts)
+    {
+	pending |= 1 << line;
+	CheckInterrupts();
+    }
+}
+
+/* If one can be taken, stop for it after this instruction */
+void CPU::CheckInterrupts()
+{
+    if (pending && flags.i)
+    {
+	stopAt = instrCount;
+    }
+}
+
+/* The lowest line first, dropped if there's no handler */
+void CPU::TakeInterrupt()
+{
+    uint32_t line = __builtin_ctz(pending);
+    pending &= pending - 1;
+    Trap(InterruptVector + line, line);
+}
+
+/*
+  The steps addressing modes made, and the PC, are all the instruction
+  changed when it stops part way: the rest is done after every operand
+  is read and written.
+*/
+void CPU::Unwind()
+{
+    /* Stopped fetching it */
+    if (registers[PC].Value() == instrPc)
+    {
+	return;
+    }
+    for(int i = 0; i < 2; i++)
+    {
+	Step& step = steps[--stepIndex & 1];
+	if (step.count == instrCount)
+	{
+	    registers[step.reg] -= step.delta;
+	    step.count = 0;
+	}
+    }
+    registers[PC].Value(instrPc);
+    instrCount--;
+}
+
+bool CPU::Trap(uint32_t vector, uint32_t info)
+{
+    uint32_t handler = TrapHandler(vector);
+    uint32_t sp = registers[SP].Value() - 12;
+    uint32_t frame[3] = { info, registers[PC].Value(), flags.word };
+    if (!handler || !memory.Store(sp, frame, sizeof(frame)))
+    {
+	return false;
+    }
+    registers[SP].Value(sp);
+    registers[PC].Value(handler);
+    flags.i = false;
+    trapsTaken++;
+    /* Not a block exit to link */
+    lastBlock = 0;
+    return true;
+}
+
+/* For an instruction that stopped Run, Continue if it trapped instead */
+ExecResult CPU::TrapOrStop(ExecResult res)
+{
+    TrapVector vector;
+    switch(res)
+    {
+    case Fault:
+	vector = MemoryTrap;
+	break;
+    case Unknown:
+	vector = IllegalTrap;
+	break;
+    case Breakpoint:
+	if (debugBreaks.count(instrPc))
+	{
+	    return res;
+	}
+	vector = BreakpointTrap;
+	break;
+    default:
+	return res;
+    }
+    if (!TrapHandler(vector))
+    {
+	return res;
+    }
+    Unwind();
+    if (!Trap(vector, 0))
+    {
+	std::cerr << "No stack for trap at " << std::hex << instrPc
+		  << std::endl;
+	return Fault;
+    }
+    return Continue;
+}
+
+/* For a GuestTrap, which always leaves the instruction undone */
+ExecResult CPU::Trapped(const GuestTrap& trap)
+{
+    Unwind();
+    if (Trap(trap.vector, trap.info))
+    {
+	return Continue;
+    }
+    switch(trap.vector)
+    {
+    case DivideTrap:
+	std::cerr << "Divide by zero at " << std::hex << instrPc << std::endl;
+	break;
+    case IllegalTrap:
+	std::cerr << "Bad register pair at " << std::hex << instrPc
+		  << std::endl;
+	return Unknown;
+    default:
+	std::cerr << "Memory fault at " << std::hex << trap.info
+		  << " from " << instrPc << std::endl;
+	break;
+    }
+    return Fault;
+}
+
+bool CPU::Deadline()
+{
+    events.RunDue(instrCount);
+    if (pending && flags.i)
+    {
+	TakeInterrupt();
+    }
+    stopAt = NextStop();
+    return instrCount < runEnd;
+}
+
+uint64_t CPU::NextStop()
+{
+    if (pending && flags.i)
+    {
+	return instrCount;
+    }
+    return std::min(runEnd, events.Next());
+}
+
+void CPU::Schedule(uint64_t when, EventFunc fn, void* ctx)
+{
+    events.Add(when, fn, ctx);
+    /* If running, stop for it */
+    stopAt = std::min(stopAt, when);
+}
+
+/*
+  Tiered execution. Blocks start out interpreted, with a count of how
+  often each block entry is reached. When an entry reaches the
+  threshold, that run through the block is recorded and handed to the
+  background compiler, and the interpreter carries on. Once compiled,
+  the block is checked against memory and installed, and from then on
+  runs from the decoded instructions, with handlers specialised for
+  the common forms, instead of fetching and decoding every time.
+
+  Memory holding compiled blocks is marked, and writing to it drops the
+  blocks there, so self modifying code and breakpoints work as before.
+
+  Going from one block to the next avoids the table lookup where it
+  can. Each block remembers the last two places it went to, and calls
+  are kept on a shadow stack so a RET can go straight back to the block
+  after its JSR. Either way the guess is only used if its address is
+  the PC. Dropping any block forgets all of these.
+*/
+static const uint32_t MaxBlockInstrs = 64;
+
+/* At most, translated blocks may run fewer */
+static uint64_t BlockInstrs(const CodeBlock& block)
+{
+    return block.native ? (block.end - block.start) / 4 : block.code.size();
+}
+
+static bool EndsBlock(InstrKind op)
+{
+    return (op >= JSR && op < EMT) || (op >= BCPY && op <= BSCN) ||
+	op == EMT;
+}
+
+/* Instruction stream words used by an operand, other than the instruction */
+static uint32_t OperandWords(AddrMode mode, RegName reg)
+{
+    return mode == Displacement || (mode == IndirAutoInc && reg == PC);
+}
+
+/*
+  Words an instruction takes in a block. Of those ending it, only JMP
+  and JSR have an operand, and the fields of branches are the offset.
+*/
+static uint32_t InstrWords(Instruction instr)
+{
+    InstrKind op = instr.value.op;
+    if (EndsBlock(op))
+    {
+	return 1 + (op == JMP || op == JSR ?
+		    OperandWords(instr.value.srcMode, instr.value.source) : 0);
+    }
+    return 1 + OperandWords(instr.value.srcMode, instr.value.source) +
+	OperandWords(instr.value.destMode, instr.value.dest);
+}
+
+/* Address of the instruction at index i of a block */
+static uint32_t InstrAddr(const CodeBlock& block, size_t i)
+{
+    uint32_t pc = block.start;
+    for(size_t j = 0; j < i; j++)
+    {
+	pc += 4 * InstrWords(block.code[j].instr);
+    }
+    return pc;
+}
+
+/*
+  Find a block's instructions in its words, as recording it did. False
+  if they don't make a block ending at its end, or one moves the PC,
+  when recording followed it rather than the words.
+*/
+static bool Decode(CodeBlock& block)
+{
+    block.code.clear();
+    size_t i = 0;
+    while(i < block.words.size() && block.code.size() < MaxBlockInstrs)
+    {
+	Instruction instr;
+	instr.value.word = block.words[i];
+	block.code.push_back(DecodedInstr{ instr, 0 });
+	i += InstrWords(instr);
+	if (EndsBlock(instr.value.op))
+	{
+	    break;
+	}
+	if (instr.value.destMode == Direct && instr.value.dest == PC)
+	{
+	    return false;
+	}
+    }
+    return !block.code.empty() && i == block.words.size();
+}
+
+template<typename Access>
+ExecResult CPUCore<Access>::RunTiered()
+{
+    ExecResult res = Continue;
+    /* Anything may have changed since the last run */
+    lastBlock = 0;
+    lastExit = NOP;
+    while(res == Continue && (instrCount < stopAt || Deadline()))
+    {
+	if (memory.CodeWritten())
+	{
+	    InvalidateCode();
+	}
+	if (compiler && compiler->Ready())
+	{
+	    InstallBlocks();
+	}
+
+	uint32_t pc = registers[PC].Value();
+	CodeBlock* block = NextBlock(pc);
+	/* A block that would run past stopAt is interpreted, to stop there */
+	if (block && instrCount + BlockInstrs(*block) > stopAt)
+	{
+	    block = 0;
+	}
+	lastBlock = block;
+	if (block)
+	{
+	    res = RunBlock(*block);
+	    continue;
+	}
+
+	tierStats.interpreted++;
+	if (++blockCounts[pc] != tierThreshold)
+	{
+	    res = Interpret();
+	    continue;
+	}
 
-    return ((v & sign) == (v2 & sign)) & ((v1 ^ v2) & sign);
+	block = new CodeBlock;
+	block->start = pc;
+	try
+	{
+	    res = Record(*block);
+	}
+	catch(const GuestTrap&)
+	{
+	    delete block;
+	    throw;
+	}
+	if (res != Continue || block->code.empty())
+	{
+	    delete block;
+	    continue;
+	}
+	if (!compiler)
+	{
+	    compiler = new BlockCompiler(Compile);
+	}
+	compiler->Submit(block);
+	tierStats.submitted++;
+    }
+    return res;
 }
 
-static bool SubOverflow(uint64_t v, uint32_t v1, uint32_t v2, uint64_t sign)
-{
-    /* sub:
-      V: set if there was arithmetic overflow as a result of the oper·
-      ation, that is if operands were of opposite signs and the sign
-      of the source was the same as the sign of the result; cleared
-      otherwise. */
-    return ((v & sign) == (v1 & sign)) & ((v1 ^ v2) & sign);
-}    
-    
-static bool AddOverflow(uint64_t v, uint32_t v1, uint32_t v2, uint64_t sign)
+/* Find the block at pc, through what the last block or call left */
+CodeBlock* CPU::NextBlock(uint32_t pc)
 {
-    /*  add:
-      V: set if there was arithmetic overflow as a result of the oper·
-      ation; that is both operands were of the same sign and the
-      result was of the opposite sign; cleared otherwise
-a    */
-    return ((v & sign) != (v1 & sign)) & ((v1 & sign) == (v2 & sign));
-}
+    InstrKind exit = lastExit;
+    lastExit = NOP;
+    if (exit == JSR)
+    {
+	shadowTop = (shadowTop + 1) % ShadowDepth;
+	shadow[shadowTop] = ReturnSite{ lastReturn, lastBlock };
+	shadowCount = std::min(shadowCount + 1, ShadowDepth);
+    }
+    else if (exit == RET && shadowCount)
+    {
+	ReturnSite site = shadow[shadowTop];
+	shadowTop = (shadowTop + ShadowDepth - 1) % ShadowDepth;
+	shadowCount--;
+	if (site.addr == pc && site.caller)
+	{
+	    if (site.caller->returnTo)
+	    {
+		tierStats.predicted++;
+		return site.caller->returnTo;
+	    }
+	    site.caller->returnTo = Lookup(pc);
+	    return site.caller->returnTo;
+	}
+    }
 
-void CPU::UpdateFlags(uint64_t v, uint32_t v1, uint32_t v2, OperandSize opsize,
-		      OverflowFunc oflow)
-{
-    uint64_t mask;
-    switch(opsize)
+    if (!lastBlock)
     {
-    case Op8:
-	mask = 0xff;
-	break;
-    case Op16:
-	mask = 0xffff;
-	break;
-    case Op32:
-	mask = 0xffffffff;
-	break;
+	return Lookup(pc);
     }
-    uint64_t sign = (mask + 1) >> 1;
-    flags.z = !(v & mask);
-    flags.n = v & sign;
-    flags.c = v & (mask + 1);
-    if (oflow)
+    BlockLink* links = lastBlock->links;
+    for(int i = 0; i < 2; i++)
     {
-	flags.v = oflow(v, v1, v2, sign);
+	if (links[i].pc == pc && links[i].block)
+	{
+	    tierStats.linked++;
+	    return links[i].block;
+	}
     }
-    else
+    CodeBlock* block = Lookup(pc);
+    if (block)
     {
-	flags.v = false;
+	links[1] = links[0];
+	links[0].pc = pc;
+	links[0].block = block;
     }
+    return block;
 }
 
-static uint32_t SizeFromOpSize(OperandSize opsize)
+CodeBlock* CPU::Lookup(uint32_t pc)
 {
-    switch(opsize)
+    tierStats.lookups++;
+    auto it = blocks.find(pc);
+    return it == blocks.end() ? 0 : it->second;
+}
+
+/* Called when blocks go, as links and the shadow stack may point at them */
+void CPU::ForgetLinks()
+{
+    for(auto& b : blocks)
     {
-    case Op8:
-	return 1;
-    case Op16:
-	return 2;
-    case Op32:
-	return 4;
+	b.second->links[0] = BlockLink();
+	b.second->links[1] = BlockLink();
+	b.second->returnTo = 0;
     }
+    shadowCount = 0;
+    lastBlock = 0;
+    lastExit = NOP;
 }
 
-uint32_t CPU::GetValue(AddrMode mode, RegName reg, OperandSize opsize)
+/* Interpret up to the end of the block */
+template<typename Access>
+ExecResult CPUCore<Access>::Interpret()
 {
-    size_t size = SizeFromOpSize(opsize);
-    size_t regsize = size;
-    if (reg == PC || reg == SP)
+    for(;;)
     {
-	regsize = 4;
+	uint64_t fused = fusedCount;
+	Instruction instr = Fetch();
+	ExecResult res = CheckStop(Execute(instr));
+	if (res != Continue || EndsBlock(instr.value.op) ||
+	    fused != fusedCount || instrCount >= stopAt)
+	{
+	    return res;
+	}
     }
-    switch(mode)
-    {
-    case Direct:
-	return registers[reg].Value();
-
-    case Indir:
-	return ReadMem(registers[reg].Value(), size);
+}
 
-    case IndirAutoInc:
+/* Interpret the block one instruction at a time, keeping what was run */
+template<typename Access>
+ExecResult CPUCore<Access>::Record(CodeBlock& block)
+{
+    bool wasFusing = fusing;
+    fusing = false;
+    ExecResult res = Continue;
+    uint32_t pc = block.start;
+    for(;;)
     {
-	uint32_t v = ReadMem(registers[reg].Value(), size);
-	registers[reg] += regsize;
-	return v;
+	Instruction instr = Fetch();
+	block.code.push_back(DecodedInstr{ instr, 0 });
+	res = CheckStop(Execute(instr));
+	if (res != Continue)
+	{
+	    break;
+	}
+	if (EndsBlock(instr.value.op))
+	{
+	    pc += 4 * InstrWords(instr);
+	    break;
+	}
+	pc = registers[PC].Value();
+	if (block.code.size() == MaxBlockInstrs || instrCount >= stopAt)
+	{
+	    break;
+	}
     }
-    case AutoDecIndir:
-	registers[reg] -= regsize;
-	return ReadMem(registers[reg].Value(), size);
+    fusing = wasFusing;
+
+    block.end = pc;
+    block.words.resize((block.end - block.start) / 4);
+    if (!memory.Load(block.start, block.words.data(), block.end - block.start))
+    {
+	block.code.clear();
     }
-    return 0xdeadbeef;
+    return res;
 }
 
-uint32_t CPU::GetSourceValue(Instruction instr)
+template<typename Access>
+ExecResult CPUCore<Access>::RunBlock(const CodeBlock& block)
 {
-    return GetValue(instr.value.srcMode, instr.value.source, instr.value.size);
+    if (block.native)
+    {
+	/* Only stops at the end of the block, or before an access that traps */
+	ExecResult res = CheckStop(RunNative(block));
+	instrPc = registers[PC].Value();
+	if (block.exit != NOP)
+	{
+	    Edge();
+	}
+	return res;
+    }
+    tierStats.compiled++;
+    /* Where an instruction started is only worked out if it stops */
+    const DecodedInstr* d = block.code.data();
+    const DecodedInstr* end = d + block.code.size();
+    try
+    {
+	for(; d != end; d++)
+	{
+	    Consume(d->instr);
+	    ExecResult res = CheckStop((this->*d->exec)(d->instr));
+	    if (res != Continue)
+	    {
+		instrPc = InstrAddr(block, d - block.code.data());
+		return res;
+	    }
+	    if (memory.CodeWritten())
+	    {
+		/* This block may be gone now, the PC is where to carry on */
+		InvalidateCode();
+		break;
+	    }
+	}
+    }
+    catch(const GuestTrap&)
+    {
+	instrPc = InstrAddr(block, d - block.code.data());
+	throw;
+    }
+    return Continue;
 }
 
-uint32_t CPU::GetDestValue(Instruction instr)
+ExecResult CPU::RunNative(const CodeBlock& block)
 {
-    return GetValue(instr.value.destMode, instr.value.dest, instr.value.size);
+    tierStats.native++;
+    aot.n = flags.n;
+    aot.z = flags.z;
+    aot.v = flags.v;
+    aot.c = flags.c;
+    aot.instrCount = 0;
+    aot.fetchCount = 0;
+    block.native(&aot);
+    flags.n = aot.n;
+    flags.z = aot.z;
+    flags.v = aot.v;
+    flags.c = aot.c;
+    instrCount += aot.instrCount;
+    fetchCount += aot.fetchCount;
+    if (aot.trapped)
+    {
+	/* The block left with the PC at the instruction, nothing to undo */
+	aot.trapped = false;
+	instrPc = registers[PC].Value();
+	throw GuestTrap{ MemoryTrap, aot.trapAddr };
+    }
+    /* Translated calls and returns don't go through Jsr and Ret */
+    lastExit = block.exit;
+    lastReturn = block.end;
+    return Continue;
 }
 
-static uint32_t SignExtend(uint32_t value, OperandSize opsize)
+void CPU::InstallBlocks()
 {
-    switch(opsize)
+    for(CodeBlock* block : compiler->TakeDone())
     {
-    case Op32:
-	break;
-    case Op16:
-	if (value & 0x8000)
+	tierStats.compileTime += block->compileTime;
+	if (Install(block))
 	{
-	    value |= 0xFFFF0000;
+	    tierStats.installed++;
 	}
-	break;
-    case Op8:
-	if (value & 0x80)
+	else
 	{
-	    value |= 0xFFFFFF00;
+	    tierStats.rejected++;
 	}
-	break;
     }
-    return value;
 }
 
-void CPU::StoreDestValue(Instruction instr, uint32_t value)
+/* Install the block if memory still matches, otherwise delete it */
+bool CPU::Install(CodeBlock* block)
 {
-    size_t size = SizeFromOpSize(instr.value.size);
-    size_t regsize = size;
-    RegName reg = instr.value.dest;
-    if (reg == PC || reg == SP)
+    uint32_t len = block->end - block->start;
+    std::vector<uint32_t> words(block->words.size());
+    /* Start counting again either way */
+    blockCounts.erase(block->start);
+    if (blocks.count(block->start) ||
+	!memory.Load(block->start, words.data(), len) ||
+	words != block->words)
     {
-	regsize = 4;
+	delete block;
+	return false;
     }
-    switch(instr.value.destMode)
-    {
-    case Direct:
-	value = SignExtend(value, instr.value.size);
-	registers[reg].Value(value);
-	break;
+    memory.MarkCode(block->start, len);
+    blocks[block->start] = block;
+    return true;
+}
 
-    case Indir:
-	WriteMem(registers[reg].Value(), value, size);
-	break;
+std::vector<const CodeBlock*> CPU::CompiledBlocks()
+{
+    std::vector<const CodeBlock*> list;
+    for(auto b : blocks)
+    {
+	if (!b.second->native)
+	{
+	    list.push_back(b.second);
+	}
+    }
+    return list;
+}
 
-    case IndirAutoInc:
-	WriteMem(registers[reg].Value(), value, size);
-	registers[reg] += regsize;
-	break;
-	
-    case AutoDecIndir:
-	registers[reg] -= regsize;
-	WriteMem(registers[reg].Value(), value, size);
-	break;
+/*
+  Install blocks saved from an earlier run, compiling them here rather
+  than in the background so they are ready straight away. Only their
+  memory is saved, the instructions are decoded from it again.
+*/
+template<typename Access>
+uint32_t CPUCore<Access>::Preload(const std::vector<CodeBlock*>& list)
+{
+    uint32_t count = 0;
+    for(CodeBlock* block : list)
+    {
+	if (!Decode(*block))
+	{
+	    delete block;
+	    continue;
+	}
+	Compile(*block);
+	if (Install(block))
+	{
+	    count++;
+	}
     }
+    tierStats.preloaded += count;
+    return count;
 }
 
-void CPU::Emt(uint32_t num)
+/* These replace any block compiled here for the same address */
+uint32_t CPU::LoadNative(const AotEntry* entries, uint32_t count)
 {
-    switch(num)
+    uint32_t installed = 0;
+    for(uint32_t i = 0; i < count; i++)
     {
-    case PrintChar:
-	std::cout << (char)registers[R0].Value() << std::flush;
-	break;
+	const AotEntry& e = entries[i];
+	CodeBlock* block = new CodeBlock;
+	block->start = e.start;
+	block->end = e.end;
+	block->words.assign(e.words, e.words + (e.end - e.start) / 4);
+	block->native = e.fn;
+	block->exit = static_cast<InstrKind>(e.exit);
+	auto it = blocks.find(e.start);
+	if (it != blocks.end())
+	{
+	    delete it->second;
+	    blocks.erase(it);
+	    ForgetLinks();
+	}
+	if (Install(block))
+	{
+	    installed++;
+	}
     }
+    return installed;
 }
 
-void CPU::BranchIfTrue(Instruction instr, bool cond)
+void CPU::InvalidateCode()
 {
-    if (cond)
+    ForgetLinks();
+    for(uint32_t line : memory.TakeCodeWrites())
     {
-	registers[PC] += instr.value.branch;
+	uint32_t first = line << Memory::LineShift;
+	uint32_t last = first + Memory::LineSize;
+	for(auto it = blocks.begin(); it != blocks.end();)
+	{
+	    CodeBlock* block = it->second;
+	    if (block->start < last && block->end > first)
+	    {
+		/* Other lines it covers stay marked, which is harmless */
+		delete block;
+		it = blocks.erase(it);
+		tierStats.invalidated++;
+	    }
+	    else
+	    {
+		++it;
+	    }
+	}
     }
 }
 
-void CPU::Move(Instruction instr)
+template<typename Access>
+template<void (CPUCore<Access>::*Fn)(Instruction)>
+ExecResult CPUCore<Access>::Exec(Instruction instr)
 {
-    uint32_t v = GetSourceValue(instr);
-    StoreDestValue(instr, v);
-    UpdateFlags(v, v, v, instr.value.size, 0 );
+    (this->*Fn)(instr);
+    return Continue;
 }
 
-void CPU::Add(Instruction instr)
+/* Specialised forms for a register or short immediate to a register */
+template<typename Access>
+template<AddrMode mode>
+uint32_t CPUCore<Access>::RegSource(Instruction instr)
 {
-    uint32_t v1 = GetSourceValue(instr);
-    uint32_t v2 = GetDestValue(instr);
-    uint64_t v = static_cast<uint64_t>(v1) + v2;
-    StoreDestValue(instr, v);
-    UpdateFlags(v, v1, v2, instr.value.size, AddOverflow);
+    if (mode == Immediate)
+    {
+	return instr.value.srcImm;
+    }
+    return registers[instr.value.source].Value();
 }
 
-void CPU::Sub(Instruction instr)
+template<typename Access>
+template<AddrMode mode>
+ExecResult CPUCore<Access>::MoveReg(Instruction instr)
 {
-    uint32_t src = GetSourceValue(instr);
-    uint32_t dest = GetDestValue(instr);
-    uint32_t v = static_cast<uint64_t>(dest) - src;
-    StoreDestValue(instr, v);
-    UpdateFlags(v, src, dest, instr.value.size, SubOverflow);
+    uint32_t v = RegSource<mode>(instr);
+    registers[instr.value.dest].Value(v);
+    UpdateFlags(v, v, v, Op32, 0);
+    return Continue;
 }
 
-void CPU::Cmp(Instruction instr)
+template<typename Access>
+template<AddrMode mode>
+ExecResult CPUCore<Access>::AddReg(Instruction instr)
 {
-    uint32_t src = GetSourceValue(instr);
-    uint32_t dest = GetDestValue(instr);
-    uint64_t v = static_cast<uint64_t>(src) - dest;
-    UpdateFlags(v, src, dest, instr.value.size, CmpOverflow);
+    uint32_t v1 = RegSource<mode>(instr);
+    uint32_t v2 = registers[instr.value.dest].Value();
+    uint64_t v = static_cast<uint64_t>(v1) + v2;
+    registers[instr.value.dest].Value(v);
+    UpdateFlags(v, v1, v2, Op32, AotAddOverflow);
+    return Continue;
 }
 
-void CPU::Div(Instruction instr)
+template<typename Access>
+template<AddrMode mode>
+ExecResult CPUCore<Access>::SubReg(Instruction instr)
 {
-    uint32_t v1 = GetSourceValue(instr);
-    uint32_t v2 = GetDestValue(instr);
-    uint32_t v_div = v2 / v1;
-    uint32_t v_mod = v2 % v1;
-    StoreDestValue(instr, v_div);
-    if (instr.value.destMode == Direct)
-    {
-	registers[instr.value.dest+1].Value(v_mod);
-    }
-    UpdateFlags(v_div, 0, 0, instr.value.size, 0); // TODO: Add ovflowe func.
+    uint32_t src = RegSource<mode>(instr);
+    uint32_t dest = registers[instr.value.dest].Value();
+    uint64_t v = static_cast<uint64_t>(dest) - src;
+    registers[instr.value.dest].Value(v);
+    UpdateFlags(v, src, dest, Op32, AotSubOverflow);
+    return Continue;
 }
 
-void CPU::Mul(Instruction instr)
+template<typename Access>
+template<AddrMode mode>
+ExecResult CPUCore<Access>::CmpReg(Instruction instr)
 {
-    uint32_t v1 = GetSourceValue(instr);
-    uint32_t v2 = GetDestValue(instr);
-    uint64_t v = static_cast<uint64_t>(v2) * v1;
-    StoreDestValue(instr, v);
-    UpdateFlags(v, 0, 0, instr.value.size, 0);  // TODO: Add overflow func.
+    uint32_t src = RegSource<mode>(instr);
+    uint32_t dest = registers[instr.value.dest].Value();
+    uint64_t v = static_cast<uint64_t>(src) - dest;
+    UpdateFlags(v, src, dest, Op32, AotCmpOverflow);
+    return Continue;
 }
 
-void CPU::Jmp(Instruction instr)
+/* Compiled blocks hold handlers as CPU members, see CPUCore */
+template<typename T>
+static ExecFunc Handler(ExecResult (T::*fn)(Instruction))
 {
-    uint32_t v = GetSourceValue(instr);
-    registers[PC].Value(v);
+    return static_cast<ExecFunc>(fn);
 }
 
-void CPU::Jsr(Instruction instr)
+/*
+  Pick the handler for each instruction. This runs on the compiler
+  thread, so it must only look at the block, not the CPU.
+*/
+template<typename Access>
+void CPUCore<Access>::Compile(CodeBlock& block)
 {
-    uint32_t v = GetSourceValue(instr);
-    registers[SP] -= 4;
-    WriteMem(registers[SP].Value(), registers[PC].Value(), 4);
-    registers[PC].Value(v);
+    block.exit = block.code.back().instr.value.op;
+    for(DecodedInstr& d : block.code)
+    {
+	Instruction instr = d.instr;
+	bool regForm = instr.value.size == Op32 &&
+	    instr.value.destMode == Direct &&
+	    (instr.value.srcMode == Direct || instr.value.srcMode == Immediate);
+	bool imm = instr.value.srcMode == Immediate;
+	switch(instr.value.op)
+	{
+	case MOV:
+	    if (regForm)
+	    {
+		d.exec = Handler(imm ? &CPUCore::MoveReg<Immediate> :
+				 &CPUCore::MoveReg<Direct>);
+	    }
+	    else
+	    {
+		d.exec = Handler(&CPUCore::Exec<&CPUCore::Move>);
+	    }
+	    break;
+	case ADD:
+	    if (regForm)
+	    {
+		d.exec = Handler(imm ? &CPUCore::AddReg<Immediate> :
+				 &CPUCore::AddReg<Direct>);
+	    }
+	    else
+	    {
+		d.exec = Handler(&CPUCore::Exec<&CPUCore::Add>);
+	    }
+	    break;
+	case SUB:
+	    if (regForm)
+	    {
+		d.exec = Handler(imm ? &CPUCore::SubReg<Immediate> :
+				 &CPUCore::SubReg<Direct>);
+	    }
+	    else
+	    {
+		d.exec = Handler(&CPUCore::Exec<&CPUCore::Sub>);
+	    }
+	    break;
+	case CMP:
+	    if (regForm)
+	    {
+		d.exec = Handler(imm ? &CPUCore::CmpReg<Immediate> :
+				 &CPUCore::CmpReg<Direct>);
+	    }
+	    else
+	    {
+		d.exec = Handler(&CPUCore::Exec<&CPUCore::Cmp>);
+	    }
+	    break;
+	case ADC:
+	    d.exec = Handler(&CPUCore::Exec<&CPUCore::Adc>);
+	    break;
+	case SBC:
+	    d.exec = Handler(&CPUCore::Exec<&CPUCore::Sbc>);
+	    break;
+	case AND:
+	case OR:
+	case XOR:
+	    d.exec = Handler(&CPUCore::Exec<&CPUCore::Logic>);
+	    break;
+	case ASR:
+	case ASL:
+	case LSR:
+	case LSL:
+	case ROR:
+	case ROL:
+	    d.exec = Handler(&CPUCore::Exec<&CPUCore::Shift>);
+	    break;
+	case MUL:
+	    d.exec = Handler(&CPUCore::Exec<&CPUCore::Mul>);
+	    break;
+	case JMP:
+	    d.exec = Handler(&CPUCore::Exec<&CPUCore::Jmp>);
+	    break;
+	case JSR:
+	    d.exec = Handler(&CPUCore::Exec<&CPUCore::Jsr>);
+	    break;
+	case RET:
+	    d.exec = Handler(&CPUCore::Exec<&CPUCore::Ret>);
+	    break;
+	case BEQ:
+	case BNE:
+	case BLT:
+	case BGT:
+	case BGE:
+	case BLE:
+	case BHI:
+	case BLOS:
+	case BCC:
+	case BCS:
+	case BMI:
+	case BPL:
+	case BVC:
+	case BVS:
+	case BR:
+	    d.exec = Handler(&CPUCore::Exec<&CPUCore::Branch>);
+	    break;
+	default:
+	    /* Everything else goes through the interpreter's switch */
+	    d.exec = Handler(&CPUCore::Execute);
+	    break;
+	}
+    }
 }
 
-void CPU::Ret(Instruction instr)
+/* Traps as Run does, so stepping goes into the handler */
+template<typename Access>
+ExecResult CPUCore<Access>::RunOneInstr()
 {
-    registers[PC].Value(ReadMem(registers[SP].Value(), 4));
-    registers[SP] += 4;
+    ExecResult res;
+    try
+    {
+	res = StepInstr();
+    }
+    catch(const GuestTrap& trap)
+    {
+	return Trapped(trap);
+    }
+    if (res != Continue && trapTable)
+    {
+	res = TrapOrStop(res);
+    }
+    return res;
 }
 
-/* Return true for "continue", false for "stop" */
-ExecResult CPU::RunOneInstr()
+/* Return Continue to carry on, anything else to stop */
+template<typename Access>
+ExecResult CPUCore<Access>::Execute(Instruction instr)
 {
-    Instruction instr = Fetch();
     switch(instr.value.op)
     {
     case HLT:
-	std::cout << "Hit halt at " << std::hex << registers[PC].Value()
-		  << std::endl;
 	return Halt;
 
     case BPT:
@@ -287,15 +2130,56 @@ ExecResult CPU::RunOneInstr()
 	
     case MOV:
 	Move(instr);
+	if (fusing)
+	{
+	    FuseNext(true);
+	}
 	break;
     case ADD:
 	Add(instr);
+	if (fusing)
+	{
+	    FuseNext(false);
+	}
 	break;
     case SUB:
 	Sub(instr);
+	if (fusing)
+	{
+	    FuseNext(false);
+	}
+	break;
+    case ADC:
+	Adc(instr);
+	break;
+    case SBC:
+	Sbc(instr);
+	break;
+    case NEG:
+	Neg(instr);
+	break;
+    case COM:
+	Com(instr);
+	break;
+    case AND:
+    case OR:
+    case XOR:
+	Logic(instr);
+	break;
+    case ASR:
+    case ASL:
+    case LSR:
+    case LSL:
+    case ROR:
+    case ROL:
+	Shift(instr);
 	break;
     case CMP:
 	Cmp(instr);
+	if (fusing)
+	{
+	    FuseNext(false);
+	}
 	break;
     case DIV:
 	Div(instr);
@@ -330,6 +2214,14 @@ ExecResult CPU::RunOneInstr()
 	flags.z = true;
 	break;
 
+    case CLI:
+	flags.i = false;
+	break;
+    case SEI:
+	flags.i = true;
+	CheckInterrupts();
+	break;
+
     case JMP:
 	Jmp(instr);
 	break;
@@ -339,67 +2231,26 @@ ExecResult CPU::RunOneInstr()
     case RET:
 	Ret(instr);
 	break;
-
-	/*
-		|0010xx || BNE || Branch if not equal (Z=0)
-		|0014xx || BEQ || Branch if equal (Z=1)
-		|0020xx || BGE || Branch if greater than or equal (N|V = 0)
-		|0024xx || BLT || Branch if less than (N|V = 1)
-		|0030xx || BGT || Branch if greater than (N^V = 1)
-		|0034xx || BLE || Branch if less than or equal (N^V = 0)
-		|1010xx || BHI || Branch if higher than (C|Z = 0)
-		|1014xx || BLOS|| Branch if lower or same (C|Z = 1)
-		|1020xx || BVC || Branch if overflow clear (V=0)
-		|1024xx || BVS || Branch if overflow set (V=1)
-		|1030xx || BCC || Branch if carry clear (C=0)
-		|       || BHIS|| Branch if higher or same (C=0)
-		|1034xx || BCS || Branch if carry set (C=1)
-		|       || BLO || Branch if lower than (C=1)
-	*/
-    case BNE:
-	BranchIfTrue(instr, !flags.z);
+    case RTI:
+	Rti(instr);
 	break;
+
     case BEQ:
-	BranchIfTrue(instr, flags.z);
-	break;
+    case BNE:
     case BLT:
-	BranchIfTrue(instr, flags.n | flags.v);
-	break;
     case BGT:
-	BranchIfTrue(instr, flags.n ^ flags.v);
-	break;
     case BGE:
-	BranchIfTrue(instr, !(flags.n | flags.v));
-	break;
     case BLE:
-	BranchIfTrue(instr, !(flags.n ^ flags.v));
-	break;
     case BHI:
-	BranchIfTrue(instr, !(flags.c | flags.z));
-	break;
     case BLOS:
-	BranchIfTrue(instr, flags.c | flags.z);
-	break;
-    case BVS:
-	BranchIfTrue(instr, flags.v);
-	break;
-    case BVC:
-	BranchIfTrue(instr, !flags.v);
-	break;
     case BCC:
-	BranchIfTrue(instr, !flags.c);
-	break;
     case BCS:
-	BranchIfTrue(instr, flags.c);
-	break;
-    case BPL:
-	BranchIfTrue(instr, !flags.n);
-	break;
     case BMI:
-	BranchIfTrue(instr, flags.n);
-	break;
+    case BPL:
+    case BVC:
+    case BVS:
     case BR:
-	BranchIfTrue(instr, true);
+	Branch(instr);
 	break;
 
     case NOP:
@@ -409,15 +2260,114 @@ ExecResult CPU::RunOneInstr()
     case EMT:
 	Emt(instr.value.branch);
 	break;
+
+    case VLD:
+	if (!VectorLoad(instr))
+	{
+	    if (!TrapHandler(MemoryTrap))
+	    {
+		std::cerr << "Vector load out of range at: "
+			  << std::hex << registers[PC].Value() - 4
+			  << std::endl;
+	    }
+	    return Fault;
+	}
+	break;
+    case VST:
+	if (!VectorStore(instr))
+	{
+	    if (!TrapHandler(MemoryTrap))
+	    {
+		std::cerr << "Vector store out of range at: "
+			  << std::hex << registers[PC].Value() - 4
+			  << std::endl;
+	    }
+	    return Fault;
+	}
+	break;
+    case VADD:
+    case VSUB:
+    case VMUL:
+    case VCMPEQ:
+    case VCMPGT:
+	Vector(instr);
+	break;
+
+    case FMOV:
+    case FADD:
+    case FSUB:
+    case FMUL:
+    case FDIV:
+    case FSQRT:
+    case FCMP:
+    case ITOF:
+    case FTOI:
+    case LDFPS:
+    case STFPS:
+	if (!FloatingPoint(instr))
+	{
+	    if (!TrapHandler(MemoryTrap))
+	    {
+		std::cerr << "FP access out of range at: "
+			  << std::hex << registers[PC].Value() - 4
+			  << std::endl;
+	    }
+	    return Fault;
+	}
+	break;
+
+    case BCPY:
+    case BFIL:
+    case BCMP:
+    case BSCN:
+	if (!Block(instr))
+	{
+	    if (!TrapHandler(MemoryTrap))
+	    {
+		std::cerr << "Block access out of range at: "
+			  << std::hex << registers[PC].Value() - 4
+			  << std::endl;
+	    }
+	    return Fault;
+	}
+	break;
 	
     default:
-	std::cerr << "Not yet impelemented function at: "
-		  << std::hex << registers[PC].Value()
-		  << std::endl;
-	std::cerr << "Instr = " << instr.value.word << std::endl;
+	if (!TrapHandler(IllegalTrap))
+	{
+	    std::cerr << "Not yet impelemented function at: "
+		      << std::hex << registers[PC].Value()
+		      << std::endl;
+	    std::cerr << "Instr = " << instr.value.word << std::endl;
+	}
 	return Unknown;
 	break;
     }
     return Continue;
 }
 
+template class CPUCore<FlatAccess>;
+template class CPUCore<CheckedAccess>;
+template class CPUCore<WatchAccess>;
+template class CPUCore<CoverAccess>;
+
+CPU* NewCPU(const std::string& access, Memory& mem, uint32_t start)
+{
+    if (access == FlatAccess::Name())
+    {
+	return new CPUCore<FlatAccess>(mem, start);
+    }
+    if (access == CheckedAccess::Name())
+    {
+	return new CPUCore<CheckedAccess>(mem, start);
+    }
+    if (access == WatchAccess::Name())
+    {
+	return new CPUCore<WatchAccess>(mem, start);
+    }
+    if (access == CoverAccess::Name())
+    {
+	return new CPUCore<CoverAccess>(mem, start);
+    }
+    return 0;
+}
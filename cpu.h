@@ -2,8 +2,18 @@
 #define CPU_H
 
 #include <cassert>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
 #include "instruction.h"
 #include "memory.h"
+#include "aot.h"
+#include "blockdev.h"
+#include "console.h"
+#include "emt.h"
+#include "events.h"
+#include "heap.h"
 
 enum ExecResult
 {
@@ -11,65 +21,539 @@ enum ExecResult
     Halt,
     Breakpoint,
     Unknown,
+    Fault,
+    Watchpoint,
+    Limit,
+    Returned,
 };
 
 typedef bool (*OverflowFunc)(uint64_t v, uint32_t v1, uint32_t v2,
 			     uint64_t sign);
 
+class CPU;
+class BlockCompiler;
+
+typedef ExecResult (CPU::*ExecFunc)(Instruction instr);
+typedef void (*OutputFunc)(void* ctx, char c);
+
+/* One instruction of a compiled block, with the handler picked for it */
+struct DecodedInstr
+{
+    Instruction instr;
+    ExecFunc exec;
+};
+
+/*
+  A straight run of instructions from a block entry up to and including
+  the first control transfer, recorded by the interpreter once the entry
+  is hot and then compiled in the background.
+*/
+struct CodeBlock;
+
+/* A block exit seen before, and the block it went to */
+struct BlockLink
+{
+    BlockLink() : pc(0), block(0) {}
+    uint32_t pc;
+    CodeBlock* block;
+};
+
+struct CodeBlock
+{
+    CodeBlock()
+	: start(0), end(0), native(0), compileTime(0), exit(NOP), returnTo(0)
+    {}
+    uint32_t start;
+    uint32_t end;
+    /* Memory [start, end) when recorded, checked again before use */
+    std::vector<uint32_t> words;
+    std::vector<DecodedInstr> code;
+    /* Translated ahead of time by stew-aot, used instead of code */
+    AotFunc native;
+    /* Nanoseconds spent compiling */
+    uint64_t compileTime;
+    /* The instruction ending the block */
+    InstrKind exit;
+    /* The last two places this block went to, and where its JSR returns */
+    BlockLink links[2];
+    CodeBlock* returnTo;
+};
+
+struct TierStats
+{
+    /* Block entries run by the interpreter, compiled and native code */
+    uint64_t interpreted;
+    uint64_t compiled;
+    uint64_t native;
+    /* Blocks sent for compiling, installed, found stale, and dropped */
+    uint64_t submitted;
+    uint64_t installed;
+    uint64_t rejected;
+    uint64_t invalidated;
+    uint64_t compileTime;
+    /* Blocks installed from a saved block cache */
+    uint64_t preloaded;
+    /* Blocks found through a link or a predicted return, or looked up */
+    uint64_t linked;
+    uint64_t predicted;
+    uint64_t lookups;
+};
+
+/* A call seen by the tiered loop, for predicting the matching RET */
+struct ReturnSite
+{
+    uint32_t addr;
+    CodeBlock* caller;
+};
+
+const uint32_t ShadowDepth = 64;
+/* Bytes in the edge coverage map, as for AFL */
+const uint32_t CoverageBits = 16;
+const uint32_t CoverageSize = 1 << CoverageBits;
+
+class CoverageMap;
+
+/*
+  The machine state, and what the commands use to drive it. The
+  execution engine is CPUCore, specialised for how it reaches memory;
+  NewCPU picks one.
+*/
 class CPU
 {
 public:
     CPU(Memory& mem, uint32_t start);
-    ExecResult RunOneInstr();
-    /* The read/write memory are usef for loading and dumping memrory */
+    virtual ~CPU();
+    virtual ExecResult RunOneInstr() = 0;
+    /* Run until something other than Continue */
+    virtual ExecResult Run() = 0;
+    /*
+      Call the function at addr, with the registers as they are, and run
+      until it returns (Returned) or stops for another reason.
+    */
+    ExecResult Call(uint32_t addr);
+    /*
+      Make EMT num call fn, with ctx. Returns false if num is too big.
+      The built in EMTs (see emt.h) can be replaced.
+    */
+    bool BindEmt(uint32_t num, EmtFunc fn, void* ctx);
+    /* Where the PrintChar EMT writes, stdout unless set */
+    void Output(OutputFunc fn, void* ctx)
+    {
+	output = fn;
+	outputCtx = ctx;
+    }
+    /*
+      The read/write memory are usef for loading and dumping memrory.
+      Faults are reported, but don't stop the next run. Devices' pages
+      are plain memory here.
+    */
     void WriteMem(uint32_t addr, uint32_t value, uint32_t size)
     {
-	memory.Write(addr, value, size);
+	memory.Poke(addr, value, size);
+	memory.TakeFault();
     }
     uint32_t ReadMem(uint32_t addr, uint32_t size)
     {
-	return memory.Read(addr, size);
+	uint32_t v = memory.Peek(addr, size);
+	memory.TakeFault();
+	return v;
+    }
+    bool MapImage(const std::string& file, uint32_t& len)
+    {
+	return memory.MapImage(file, len);
+    }
+    /* Give a device pages of memory, see Memory::MapDevice */
+    bool MapDevice(uint32_t addr, uint32_t len, Device* device);
+    /* Map a page for one of the devices in devices.h, owned by the CPU */
+    bool MapDevice(const std::string& name, uint32_t addr);
+    struct MappedDevice
+    {
+	std::string name;
+	uint32_t addr;
+	Device* device;
+    };
+    const std::vector<MappedDevice>& Devices() { return devices; }
+    /* Output as the PrintChar EMT does */
+    void PutChar(char c) { output(outputCtx, c); }
+    /* Stop with Fault at unaligned accesses */
+    bool AlignTrap() { return memory.AlignTrap(); }
+    void AlignTrap(bool enable) { memory.AlignTrap(enable); }
+    /* Name of the memory access policy */
+    virtual const char* AccessName() = 0;
+    /* Write watchpoints, only used by the watch policy */
+    void Watch(uint32_t addr, uint32_t len) { memory.Watch(addr, len); }
+    void ClearWatches() { memory.ClearWatches(); }
+    const std::vector<std::pair<uint32_t, uint32_t> >& Watches()
+    {
+	return memory.Watches();
     }
+    /* Address written when the last run stopped at a watchpoint */
+    uint32_t WatchAddr() { return watchAddr; }
 
     uint32_t RegValue(RegName r) { return registers[r].Value(); }
     void RegValue(RegName r, uint32_t v) { registers[r].Value(v); }
     uint32_t Flags() { return flags.word; }
+    bool InterruptsOn() { return flags.i; }
+    const VectorRegister& VRegValue(VRegName r) { return vregisters[r]; }
+    double FRegValue(FRegName r) { return fregisters[r]; }
+    uint32_t FPStatus() { return fpsr; }
+    uint64_t InstrCount() { return instrCount; }
+    uint64_t FetchCount() { return fetchCount; }
+    uint64_t FusedCount() { return fusedCount; }
+    /* Fuse instruction pairs in Run */
+    bool Fuse() { return fuse; }
+    void Fuse(bool enable) { fuse = enable; }
+    /* Count executed instruction pairs, indexed by first << 8 | second */
+    void Profile(bool enable);
+    const std::vector<uint64_t>& PairCounts() { return pairCounts; }
+    /* Max bytes handled by one execution of a block instruction */
+    uint32_t BlockChunk() { return blockChunk; }
+    void BlockChunk(uint32_t n) { blockChunk = n; }
+    /* Compile blocks entered more than the threshold number of times */
+    bool Tiering() { return tiering; }
+    void Tiering(bool enable) { tiering = enable; }
+    uint32_t TierThreshold() { return tierThreshold; }
+    void TierThreshold(uint32_t n) { tierThreshold = n; }
+    const TierStats& Tiers() { return tierStats; }
+    /*
+      For running one program many times, as in fuzzing. Snapshot keeps
+      the registers, memory, heap, trap table, and pending events and
+      interrupts, Reset goes back to them, restoring only the memory
+      pages written since. Compiled blocks are kept.
+    */
+    void Snapshot();
+    bool HasSnapshot() { return memory.HasSnapshot(); }
+    bool Reset(uint32_t& pages);
+    /* Stop Run with Limit after exactly n instructions, 0 for no limit */
+    uint64_t Budget() { return budget; }
+    void Budget(uint64_t n) { budget = n; }
+    /*
+      Call fn once the instruction count reaches when, at once if it
+      already has. Events only run in Run, which stops for them at
+      exactly that count, whether interpreting or running compiled
+      blocks, so the same program sees them at the same instruction.
+    */
+    void Schedule(uint64_t when, EventFunc fn, void* ctx);
+    void Cancel(EventFunc fn, void* ctx) { events.Cancel(fn, ctx); }
+    EventQueue& Events() { return events; }
+    /*
+      Trap to the guest, through the table at addr (see TrapVector), 0
+      for none. Without a table, or a handler in it, Run stops as ever:
+      Fault for a divide by zero or a bad access, Unknown or Breakpoint.
+      The state a handler sees is as it was before the instruction, with
+      the PC at it, in translated code too. Memory faults are only found
+      by the checking policies, and by translated code's loads and
+      stores that go back to stew.
+    */
+    uint32_t TrapTable() { return trapTable; }
+    void TrapTable(uint32_t addr);
+    /* Read a handler from the table, 0 if there's none */
+    uint32_t TrapHandler(uint32_t vector);
+    uint64_t TrapsTaken() { return trapsTaken; }
+    /*
+      Raise an interrupt line, from the CPU's thread. It's taken between
+      instructions, in Run, once interrupts are on, and dropped if the
+      table has no handler for it.
+    */
+    void Interrupt(uint32_t line);
+    uint32_t PendingInterrupts() { return pending; }
+    /* The debugger's breakpoints stop Run rather than trapping */
+    void DebugBreak(uint32_t addr, bool set);
+    /* What the ReadInput EMT gives the program */
+    const std::vector<uint8_t>& Input() { return input; }
+    void Input(const std::vector<uint8_t>& data) { input = data; }
+    /* The heap run by the heap EMTs */
+    Heap& GuestHeap() { return heap; }
+    /* The disk for the disk EMTs */
+    BlockDevice& Disk() { return disk; }
+    /* Input for the console EMTs, not opened unless given a file */
+    ConsoleInput& Console() { return console; }
+    /* Edge counts, only kept by the cover policy, else 0 */
+    CoverageMap* Coverage() { return coverage; }
+    /* For saving compiled blocks, and installing them in a later run */
+    std::vector<const CodeBlock*> CompiledBlocks();
+    virtual uint32_t Preload(const std::vector<CodeBlock*>& list) = 0;
+    /* Install blocks from stew-aot, returns how many matched memory */
+    uint32_t LoadNative(const AotEntry* entries, uint32_t count);
+
+protected:
+    void Consume(Instruction instr)
+    {
+	registers[PC] += 4;
+	instrCount++;
+	fetchCount++;
+	if (!pairCounts.empty())
+	{
+	    pairCounts[lastOp << 8 | instr.value.op]++;
+	    lastOp = instr.value.op;
+	}
+    }
+
+    ExecResult RunNative(const CodeBlock& block);
+    void InstallBlocks();
+    bool Install(CodeBlock* block);
+    void InvalidateCode();
+    CodeBlock* NextBlock(uint32_t pc);
+    CodeBlock* Lookup(uint32_t pc);
+    void ForgetLinks();
+    /*
+      At stopAt, run the events due and take a pending interrupt, false
+      if the budget is used up
+    */
+    bool Deadline();
+    uint64_t NextStop();
+    /* Note a register stepped by an addressing mode, for Unwind */
+    void Stepped(RegName reg, int32_t delta)
+    {
+	if (trapTable)
+	{
+	    steps[stepIndex++ & 1] = Step{ instrCount, reg, delta };
+	}
+    }
+    /* Undo the instruction at instrPc, which stopped part way */
+    void Unwind();
+    /* Take a trap, true if the table has a handler for it */
+    bool Trap(uint32_t vector, uint32_t info);
+    ExecResult TrapOrStop(ExecResult res);
+    ExecResult Trapped(const GuestTrap& trap);
+    void CheckInterrupts();
+    void TakeInterrupt();
+    static uint32_t EmtTrapTable(void* ctx, uint32_t* regs, Memory& memory);
+    void UpdateFlags(uint64_t value, uint32_t v1, uint32_t v2,
+		     OperandSize opsize, OverflowFunc oflow);
+    void Emt(uint32_t num)
+    {
+	if (num < EmtTableSize && emts[num].fn)
+	{
+	    uint32_t* regs = &registers[0].Value();
+	    regs[R0] = emts[num].fn(emts[num].ctx, regs, memory);
+	}
+    }
+    static uint32_t EmtPrintChar(void* ctx, uint32_t* regs, Memory& memory);
+    static uint32_t EmtReadInput(void* ctx, uint32_t* regs, Memory& memory);
+    bool Condition(InstrKind op);
+    void UpdateFPExcept();
+
+    Memory& memory;
+    Register registers[MaxReg];
+    VectorRegister vregisters[MaxVReg];
+    double fregisters[MaxFReg];
+    uint32_t fpsr;
+    FlagRegister flags;
+    /* Executed instructions, and instruction stream words read */
+    uint64_t instrCount;
+    uint64_t fetchCount;
+    uint64_t fusedCount;
+    uint32_t blockChunk;
+    bool fuse;
+    bool fusing;
+    InstrKind lastOp;
+    std::vector<uint64_t> pairCounts;
+    bool tiering;
+    uint32_t tierThreshold;
+    TierStats tierStats;
+    BlockCompiler* compiler;
+    /* Entry counts for blocks not yet compiled, and compiled blocks */
+    std::unordered_map<uint32_t, uint32_t> blockCounts;
+    std::unordered_map<uint32_t, CodeBlock*> blocks;
+    /* The last block run, and the JSR or RET it or the interpreter ran */
+    CodeBlock* lastBlock;
+    InstrKind lastExit;
+    uint32_t lastReturn;
+    /* Return addresses of calls not yet returned from, the oldest lost */
+    ReturnSite shadow[ShadowDepth];
+    uint32_t shadowTop;
+    uint32_t shadowCount;
+    uint32_t watchAddr;
+    AotState aot;
+    uint64_t budget;
+    /* Where the budget ends, and the instruction count to stop at next */
+    uint64_t runEnd;
+    uint64_t stopAt;
+    /*
+      Where the current instruction started, set as it's fetched, or
+      worked out by compiled blocks when one stops
+    */
+    uint32_t instrPc;
+    /* The last two registers stepped, with the instruction count */
+    struct Step
+    {
+	uint64_t count;
+	RegName reg;
+	int32_t delta;
+    } steps[2];
+    uint32_t stepIndex;
+    uint32_t trapTable;
+    uint64_t trapsTaken;
+    /* Interrupt lines raised and not yet taken */
+    uint32_t pending;
+    std::unordered_set<uint32_t> debugBreaks;
+    EventQueue events;
+    std::vector<uint8_t> input;
+    OutputFunc output;
+    void* outputCtx;
+    struct EmtEntry
+    {
+	EmtFunc fn;
+	void* ctx;
+    } emts[EmtTableSize];
+    Heap heap;
+    BlockDevice disk;
+    ConsoleInput console;
+    std::vector<MappedDevice> devices;
+    CoverageMap* coverage;
+    uint8_t* coverBits;
+    /* Where the last control transfer went, shifted as in AFL */
+    uint32_t prevLoc;
+    /* The registers at Snapshot */
+    struct SavedState
+    {
+	Register registers[MaxReg];
+	VectorRegister vregisters[MaxVReg];
+	double fregisters[MaxFReg];
+	uint32_t fpsr;
+	FlagRegister flags;
+	Heap heap;
+	EventQueue events;
+	uint64_t instrCount;
+	uint32_t trapTable;
+	uint32_t pending;
+    } saved;
+};
+
+/*
+  The execution engine. Every fetch and operand goes through Access
+  (see access.h), so each policy gets its own copy of the handlers with
+  the accesses inlined. Compiled blocks hold handlers from the CPUCore
+  that compiled them, and are only run by it.
+*/
+template<typename Access>
+class CPUCore : public CPU
+{
+public:
+    CPUCore(Memory& mem, uint32_t start);
+    ExecResult RunOneInstr() override;
+    ExecResult Run() override;
+    const char* AccessName() override { return Access::Name(); }
+    uint32_t Preload(const std::vector<CodeBlock*>& list) override;
 
 private:
-    Instruction Fetch()
+    /* Guest accesses, unlike the public ones used by the commands */
+    void WriteMem(uint32_t addr, uint32_t value, uint32_t size)
+    {
+	Access::Write(memory, addr, value, size);
+    }
+    uint32_t ReadMem(uint32_t addr, uint32_t size)
+    {
+	return Access::Read(memory, addr, size);
+    }
+
+    Instruction Peek()
     {
 	Instruction instr;
 	assert(!(registers[PC].Value() & 3) &&
 	       "Expect even instruction address");
 	instr.value.word = ReadMem(registers[PC].Value(), 4);
-	registers[PC] += 4;
 	return instr;
     }
 
+    Instruction Fetch()
+    {
+	instrPc = registers[PC].Value();
+	Instruction instr = Peek();
+	Consume(instr);
+	return instr;
+    }
+
+    /*
+      Count the edge from the last control transfer to the PC, taken or
+      not. The same few instructions as AFL's instrumentation, with the
+      location hashed from the PC where AFL picks it at random.
+    */
+    void Edge()
+    {
+	if (Access::Covering)
+	{
+	    uint32_t loc = (registers[PC].Value() * 0x9e3779b1) >>
+		(32 - CoverageBits);
+	    coverBits[loc ^ prevLoc]++;
+	    prevLoc = loc >> 1;
+	}
+    }
+
+    /* Stop if the instruction faulted on memory or hit a watchpoint */
+    ExecResult CheckStop(ExecResult res)
+    {
+	if (Access::Faults && memory.TakeFault())
+	{
+	    return Fault;
+	}
+	if (Access::Watching && res == Continue &&
+	    memory.TakeWatchHit(watchAddr))
+	{
+	    return Watchpoint;
+	}
+	return res;
+    }
+
+    /* One instruction, leaving traps to the caller */
+    ExecResult StepInstr()
+    {
+	return CheckStop(Execute(Fetch()));
+    }
+
+    ExecResult Execute(Instruction instr);
+    ExecResult RunTiered();
+    ExecResult Interpret();
+    ExecResult Record(CodeBlock& block);
+    ExecResult RunBlock(const CodeBlock& block);
+    static void Compile(CodeBlock& block);
+    template<void (CPUCore::*Fn)(Instruction)>
+    ExecResult Exec(Instruction instr);
+    template<AddrMode mode> uint32_t RegSource(Instruction instr);
+    template<AddrMode mode> ExecResult MoveReg(Instruction instr);
+    template<AddrMode mode> ExecResult AddReg(Instruction instr);
+    template<AddrMode mode> ExecResult SubReg(Instruction instr);
+    template<AddrMode mode> ExecResult CmpReg(Instruction instr);
+
+    uint32_t GetAddr(AddrMode mode, RegName reg, uint32_t size);
     uint32_t GetValue(AddrMode mode, RegName reg, OperandSize opsize);
     uint32_t GetSourceValue(Instruction instr);
-    uint32_t GetDestValue(Instruction instr);
-    void StoreDestValue(Instruction instr, uint32_t value);
-    void UpdateFlags(uint64_t value, uint32_t v1, uint32_t v2,
-		     OperandSize opsize, OverflowFunc oflow);
-    void Emt(uint32_t num);
+    uint32_t GetDestAddr(Instruction instr);
+    uint32_t GetDestValue(Instruction instr, uint32_t addr);
+    void StoreDestValue(Instruction instr, uint32_t addr, uint32_t value);
     void BranchIfTrue(Instruction instr, bool cond);
+    void Branch(Instruction instr);
+    void FuseNext(bool allowRet);
     void Move(Instruction instr);
     void Add(Instruction instr);
     void Sub(Instruction instr);
+    void Adc(Instruction instr);
+    void Sbc(Instruction instr);
+    void Neg(Instruction instr);
+    void Com(Instruction instr);
+    void Logic(Instruction instr);
+    void Shift(Instruction instr);
+    bool Block(Instruction instr);
+    bool VectorLoad(Instruction instr);
+    bool VectorStore(Instruction instr);
+    void Vector(Instruction instr);
+    bool GetFPValue(AddrMode mode, RegName reg, OperandSize opsize,
+		    double& v);
+    bool StoreFPValue(Instruction instr, double v);
+    bool FloatingPoint(Instruction instr);
     void Div(Instruction instr);
     void Mul(Instruction instr);
     void Jmp(Instruction instr);
     void Jsr(Instruction instr);
     void Ret(Instruction instr);
+    void Rti(Instruction instr);
     void Cmp(Instruction instr);
-
-private:
-    Memory& memory;
-    Register registers[MaxReg];
-    FlagRegister flags;
 };
 
+/* Returns 0 if there is no access policy of that name */
+CPU* NewCPU(const std::string& access, Memory& mem, uint32_t start);
+
 #endif
 
 
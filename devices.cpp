@@ -0,0 +1,209 @@
+#include <chrono>
+#include <thread>
+#include "devices.h"
+#include "cpu.h"
+
+class ConsoleDevice : public Device
+{
+public:
+    ConsoleDevice(CPU& cpu) : cpu(cpu) {}
+    uint32_t Read(uint32_t offset, uint32_t size) override;
+    void Write(uint32_t offset, uint32_t value, uint32_t size) override;
+
+private:
+    CPU& cpu;
+};
+
+uint32_t ConsoleDevice::Read(uint32_t offset, uint32_t size)
+{
+    ConsoleInput& input = cpu.Console();
+    switch(offset)
+    {
+    case 0:
+	return input.GetChar();
+    case 4:
+	return input.Available();
+    case 8:
+	return input.AtEnd();
+    }
+    return 0;
+}
+
+void ConsoleDevice::Write(uint32_t offset, uint32_t value, uint32_t size)
+{
+    if (offset == 0)
+    {
+	cpu.PutChar(value);
+    }
+}
+
+class TimerDevice : public Device
+{
+public:
+    TimerDevice(CPU& cpu)
+	: cpu(cpu), start(std::chrono::steady_clock::now()), high(0),
+	  period(0), next(0), ticks(0), interrupt(0) {}
+    ~TimerDevice() { cpu.Cancel(Tick, this); }
+    uint32_t Read(uint32_t offset, uint32_t size) override;
+    void Write(uint32_t offset, uint32_t value, uint32_t size) override;
+
+private:
+    static void Tick(void* ctx, uint64_t now);
+
+    CPU& cpu;
+    std::chrono::steady_clock::time_point start;
+    uint32_t high;
+    uint32_t period;
+    uint64_t next;
+    uint32_t ticks;
+    uint32_t interrupt;
+};
+
+uint32_t TimerDevice::Read(uint32_t offset, uint32_t size)
+{
+    switch(offset)
+    {
+    case 0:
+    {
+	uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+	    std::chrono::steady_clock::now() - start).count();
+	high = us >> 32;
+	return us;
+    }
+    case 4:
+	return high;
+    case 12:
+	high = cpu.InstrCount() >> 32;
+	return cpu.InstrCount();
+    case 16:
+	return high;
+    case 20:
+	return period;
+    case 24:
+    {
+	uint32_t n = ticks;
+	ticks = 0;
+	return n;
+    }
+    case 28:
+	return interrupt;
+    }
+    return 0;
+}
+
+void TimerDevice::Write(uint32_t offset, uint32_t value, uint32_t size)
+{
+    switch(offset)
+    {
+    case 8:
+	std::this_thread::sleep_for(std::chrono::microseconds(value));
+	break;
+    case 20:
+	cpu.Cancel(Tick, this);
+	period = value;
+	if (period)
+	{
+	    next = cpu.InstrCount() + period;
+	    cpu.Schedule(next, Tick, this);
+	}
+	break;
+    case 28:
+	interrupt = value;
+	break;
+    }
+}
+
+/* From the count it was due at, so ticks don't drift */
+void TimerDevice::Tick(void* ctx, uint64_t now)
+{
+    TimerDevice* timer = static_cast<TimerDevice*>(ctx);
+    timer->ticks++;
+    if (timer->interrupt)
+    {
+	timer->cpu.Interrupt(timer->interrupt - 1);
+    }
+    timer->next += timer->period;
+    timer->cpu.Schedule(timer->next, Tick, timer);
+}
+
+class DiskDevice : public Device
+{
+public:
+    DiskDevice(BlockDevice& disk)
+	: disk(disk), addr(0), len(0), block(0), rejected(false) {}
+    uint32_t Read(uint32_t offset, uint32_t size) override;
+    void Write(uint32_t offset, uint32_t value, uint32_t size) override;
+
+private:
+    BlockDevice& disk;
+    uint32_t addr;
+    uint32_t len;
+    uint32_t block;
+    bool rejected;
+};
+
+uint32_t DiskDevice::Read(uint32_t offset, uint32_t size)
+{
+    uint32_t moved;
+    switch(offset)
+    {
+    case 0:
+	return addr;
+    case 4:
+	return len;
+    case 8:
+	return block;
+    case 12:
+	return rejected ? BlockDevice::DiskError : disk.Poll(moved);
+    case 16:
+	disk.Poll(moved);
+	return moved;
+    }
+    return 0;
+}
+
+void DiskDevice::Write(uint32_t offset, uint32_t value, uint32_t size)
+{
+    uint32_t moved;
+    switch(offset)
+    {
+    case 0:
+	addr = value;
+	break;
+    case 4:
+	len = value;
+	break;
+    case 8:
+	block = value;
+	break;
+    case 12:
+	if (value == 3)
+	{
+	    disk.Wait(moved);
+	    rejected = false;
+	}
+	else
+	{
+	    rejected = (value != 1 && value != 2) ||
+		!disk.Start(value == 2, addr, len, block);
+	}
+	break;
+    }
+}
+
+Device* NewDevice(const std::string& name, CPU& cpu)
+{
+    if (name == "console")
+    {
+	return new ConsoleDevice(cpu);
+    }
+    if (name == "timer")
+    {
+	return new TimerDevice(cpu);
+    }
+    if (name == "disk")
+    {
+	return new DiskDevice(cpu.Disk());
+    }
+    return 0;
+}
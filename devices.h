@@ -0,0 +1,40 @@
+#ifndef DEVICES_H
+#define DEVICES_H
+
+#include <string>
+#include "memory.h"
+
+class CPU;
+
+/*
+  Devices on top of Memory::MapDevice, one page each, with 32 bit
+  registers. Accesses to other offsets read 0 and do nothing.
+
+  console, the CPU's console input and output:
+    0  data, reads the next byte, waiting for it, or 0xffffffff at the
+       end of input, writes a byte out
+    4  bytes that can be read without waiting
+    8  1 at the end of input
+
+  timer, host time and instruction counts:
+    0  microseconds since the device was mapped, low word, reading it
+       latches the high word
+    4  the latched high word
+    8  writing waits that many microseconds
+    12 instructions run, low word, reading it latches the high word
+    16 the latched high word
+    20 tick every this many instructions, 0 to stop, writing it
+       starts counting from now
+    24 ticks since last read
+    28 interrupt line + 1 to raise on each tick, 0 for none
+
+  disk, the CPU's block device (see blockdev.h):
+    0  memory address, 4 length in bytes, 8 block
+    12 writing 1 starts a read, 2 a write, 3 waits for the transfer,
+       reading gives the status as the DiskStatus EMT, 3 (error) if
+       the last command couldn't start
+    16 bytes moved
+*/
+Device* NewDevice(const std::string& name, CPU& cpu);
+
+#endif
@@ -0,0 +1,61 @@
+#include <cmath>
+#include "emt.h"
+#include "instruction.h"
+#include "memory.h"
+
+uint32_t EmtMemCopy(void* ctx, uint32_t* regs, Memory& memory)
+{
+    return memory.Copy(regs[R0], regs[R1], regs[R2]) ? regs[R0] : 0;
+}
+
+uint32_t EmtMemSet(void* ctx, uint32_t* regs, Memory& memory)
+{
+    return memory.Fill(regs[R0], regs[R1], regs[R2]) ? regs[R0] : 0;
+}
+
+/* Without a terminator, the string runs to the end of memory */
+uint32_t EmtStrLen(void* ctx, uint32_t* regs, Memory& memory)
+{
+    uint32_t addr = regs[R0];
+    uint32_t len;
+    if (addr >= memory.Size() ||
+	!memory.Scan(addr, 0, memory.Size() - addr, len))
+    {
+	return 0;
+    }
+    return len;
+}
+
+uint32_t EmtSqrt(void* ctx, uint32_t* regs, Memory& memory)
+{
+    uint32_t v = regs[R0];
+    /* The double may be one out either way */
+    uint64_t r = std::sqrt(static_cast<double>(v));
+    while(r * r > v)
+    {
+	r--;
+    }
+    while((r + 1) * (r + 1) <= v)
+    {
+	r++;
+    }
+    return r;
+}
+
+uint32_t EmtHash(void* ctx, uint32_t* regs, Memory& memory)
+{
+    uint32_t addr = regs[R0];
+    uint32_t len = regs[R1];
+    uint32_t size = memory.Size();
+    if (addr > size || len > size - addr)
+    {
+	return 0;
+    }
+    const uint8_t* p = memory.Data() + addr;
+    uint32_t h = 0x811c9dc5;
+    for(uint32_t i = 0; i < len; i++)
+    {
+	h = (h ^ p[i]) * 0x01000193;
+    }
+    return h;
+}
@@ -1,9 +1,88 @@
 #ifndef EMT_H
 #define EMT_H
 
+#include <cstdint>
+
+class Memory;
+
+/*
+  EMT n calls the host function bound to n, with the registers and
+  memory. What it returns goes in r0. Unbound numbers do nothing.
+*/
 enum EmtValue
 {
     PrintChar = 1,
+    /* Copy the input, at most r1 bytes, to r0, r0 = bytes copied */
+    ReadInput = 2,
+    /* Copy r2 bytes from r1 to r0, the ranges may overlap */
+    MemCopy = 3,
+    /* Set r2 bytes at r0 to r1 */
+    MemSet = 4,
+    /* r0 = length of the string at r0 */
+    StrLen = 5,
+    /* r0 = square root of r0, rounded down */
+    Sqrt = 6,
+    /* r0 = 32 bit FNV-1a hash of r1 bytes at r0 */
+    Hash = 7,
+    /*
+      Run a heap in r1 bytes at r0, r2 = 1 to check frees and keep
+      blocks for listing leaks, r0 = 0 if the range is bad. See heap.h.
+    */
+    HeapInit = 8,
+    /* r0 = block of at least r0 bytes, 16 byte aligned, or 0 */
+    HeapAlloc = 9,
+    /* Free the block at r0, if not 0 */
+    HeapFree = 10,
+    /* r0 = block at r0 resized to r1 bytes, as realloc */
+    HeapRealloc = 11,
+    /*
+      Start reading r1 bytes of the disk, from block r2 (of 512 bytes),
+      to r0. r0 = 0 if there's no disk, a transfer is going or the
+      range is bad. See blockdev.h.
+    */
+    DiskRead = 12,
+    /* Start writing r1 bytes from r0 to the disk at block r2 */
+    DiskWrite = 13,
+    /*
+      r0 = status of the last transfer, 0 idle, 1 busy, 2 done or
+      3 error, r1 = bytes moved
+    */
+    DiskStatus = 14,
+    /* Wait for the transfer to finish, then as DiskStatus */
+    DiskWait = 15,
+    /*
+      Console input, see console.h. r0 = next byte, waiting for it, or
+      0xffffffff at the end
+    */
+    ConsoleGetChar = 16,
+    /*
+      Read a line, with its newline, to r0, at most r1 bytes, r0 = bytes
+      read, 0 at the end
+    */
+    ConsoleReadLine = 17,
+    /*
+      Read what is there, at most r1 bytes, to r0, waiting only if
+      nothing is, r0 = bytes read, 0 at the end
+    */
+    ConsoleRead = 18,
+    /* r0 = bytes that can be read without waiting, r1 = 1 at the end */
+    ConsolePoll = 19,
+    /* Trap through the table at r0, 0 for none, r0 = the old table */
+    SetTraps = 20,
 };
 
+const uint32_t EmtTableSize = 256;
+
+typedef uint32_t (*EmtFunc)(void* ctx, uint32_t* regs, Memory& memory);
+
+/*
+  The built in functions with no state. They return 0 for ranges
+  outside memory (MemCopy and MemSet otherwise return r0).
+*/
+uint32_t EmtMemCopy(void* ctx, uint32_t* regs, Memory& memory);
+uint32_t EmtMemSet(void* ctx, uint32_t* regs, Memory& memory);
+uint32_t EmtStrLen(void* ctx, uint32_t* regs, Memory& memory);
+uint32_t EmtSqrt(void* ctx, uint32_t* regs, Memory& memory);
+uint32_t EmtHash(void* ctx, uint32_t* regs, Memory& memory);
+
 #endif
@@ -0,0 +1,38 @@
+#include <algorithm>
+#include "events.h"
+
+void EventQueue::Add(uint64_t when, EventFunc fn, void* ctx)
+{
+    heap.push_back(Event{ when, seq++, fn, ctx });
+    std::push_heap(heap.begin(), heap.end(), Later);
+}
+
+void EventQueue::Cancel(EventFunc fn, void* ctx)
+{
+    heap.erase(std::remove_if(heap.begin(), heap.end(),
+			      [fn, ctx](const Event& e)
+			      { return e.fn == fn && e.ctx == ctx; }),
+	       heap.end());
+    std::make_heap(heap.begin(), heap.end(), Later);
+}
+
+void EventQueue::RunDue(uint64_t now)
+{
+    while(!heap.empty() && heap.front().when <= now)
+    {
+	std::pop_heap(heap.begin(), heap.end(), Later);
+	Event e = heap.back();
+	heap.pop_back();
+	run++;
+	e.fn(e.ctx, now);
+    }
+}
+
+void EventQueue::Shift(int64_t delta)
+{
+    /* The same for every event, so the order holds */
+    for(auto& e : heap)
+    {
+	e.when += delta;
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <cstdint>
+#include <vector>
+
+/*
+  Events due at an instruction count, for devices to schedule things
+  like timer ticks. The CPU runs until the earliest, so when nothing
+  is due it costs no more than the instruction budget check, and runs
+  those due when the count reaches it. Events due at the same count
+  run in the order they were scheduled, so runs are repeatable.
+*/
+typedef void (*EventFunc)(void* ctx, uint64_t now);
+
+class EventQueue
+{
+public:
+    EventQueue() : seq(0), run(0) {}
+    void Add(uint64_t when, EventFunc fn, void* ctx);
+    /* Drop all events for fn with ctx */
+    void Cancel(EventFunc fn, void* ctx);
+    /* The earliest event's count, or UINT64_MAX if there are none */
+    uint64_t Next() { return heap.empty() ? UINT64_MAX : heap.front().when; }
+    /* Run the events due by now, and any they add that are due too */
+    void RunDue(uint64_t now);
+    /* Move every event by delta, for counts restarting from a snapshot */
+    void Shift(int64_t delta);
+    uint64_t Runs() { return run; }
+    uint32_t Pending() { return heap.size(); }
+
+private:
+    struct Event
+    {
+	uint64_t when;
+	uint64_t seq;
+	EventFunc fn;
+	void* ctx;
+    };
+    /* For a min-heap on the standard max-heap functions */
+    static bool Later(const Event& a, const Event& b)
+    {
+	return a.when != b.when ? a.when > b.when : a.seq > b.seq;
+    }
+
+    std::vector<Event> heap;
+    uint64_t seq;
+    uint64_t run;
+};
+
+#endif
@@ -0,0 +1,88 @@
+	;; Memory fault traps, which need memory access to be checked, so
+	;; not -m flat. The handler sees the PC of the instruction, undone.
+	;; The table is on a page of its own, so that setting it up leaves
+	;; any translated code (AOT from stew-aot) in place, and each fault
+	;; is in a block entered by a branch, which that code runs
+	mov	stack,sp
+	mov	ttab,r2
+	mov	trapskip,8(r2)
+	mov	ttab,r0
+	emt	20
+
+	;; Memory faults undo the steps of auto-increment/decrement
+	mov	#1,r0
+	mov	#0xfffffff0,r1
+	br	tblk
+tblk:
+	mov	#5,r2
+tmem:
+	mov	(r1)+,r2
+	mov	tmem,r3
+	cmp	r3,r11
+	bne	fail
+	cmp	#0xfffffff0,r10
+	bne	fail
+	cmp	#0xfffffff0,r1
+	bne	fail
+	cmp	#5,r2
+	bne	fail
+	mov	#2,r0
+	br	tblk2
+tblk2:
+	mov	data,r3
+tmem2:
+	mov	(r3)+,-(r1)
+	mov	tmem2,r2
+	cmp	r2,r11
+	bne	fail
+	cmp	#0xffffffec,r10
+	bne	fail
+	cmp	#0xfffffff0,r1
+	bne	fail
+	mov	data,r2
+	cmp	r2,r3
+	bne	fail
+
+	mov	success,r0
+	jsr	print
+	hlt
+
+fail:
+	add	#48,r0
+	mov	r0,-(sp)
+	mov	failmsg,r0
+	jsr	print
+	mov	(sp)+,r0
+	emt	1
+	mov	#10,r0
+	emt	1
+	hlt
+
+print:
+	mov	r0,r1
+loop:
+	mov.b	(r1)+,r0
+	beq	done
+	emt	1
+	jmp	loop
+done:
+	ret
+
+trapskip:
+	mov	(sp),r10
+	mov	4(sp),r11
+	add	#4,4(sp)
+	rti
+
+failmsg:
+	.db	"Failed at testpoint number ",0
+success:
+	.db	"All fault tests passed",10,0
+
+	.align	4096
+data:
+	.long	0
+ttab:
+	.zero	32
+	.zero	64
+stack:
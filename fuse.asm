@@ -0,0 +1,78 @@
+	;; Stops that land inside a fused pair, a MOV and the branch after
+	;; it. With BUDGET 3, 6 or 9, RUN stops after exactly that many
+	;; instructions, between the MOV and the BNE. With no budget, and
+	;; the timer mapped (DEVICE timer 10000), its tick interrupts
+	;; between them too, and the program ends saying so. Last, a write
+	;; that hits a watchpoint (-m watch, WATCH wdata 4) and then one
+	;; outside memory (-m checked or watch, never flat) each stop RUN
+	;; at the branch after them, wbr and fbr, rather than after it.
+	mov	#3,r3
+bloop:
+	sub	#1,r3
+	mov	r3,r2
+	bne	bloop
+
+	mov	stack,sp
+	mov	ttab,r2
+	mov	tick,16(r2)
+	mov	ttab,r0
+	emt	20
+	mov	#0x10000,r5
+	mov	#1,28(r5)
+	mov	#0,r11
+	mov	#3,r3
+	sei
+	;; Ticks after the MOV
+	mov	#2,20(r5)
+tloop:
+	sub	#1,r3
+	mov	r3,r2
+tbne:
+	bne	tloop
+	mov	tbne,r2
+	mov	passmsg,r0
+	cmp	r2,r11
+	beq	report
+	mov	failmsg,r0
+report:
+	mov	r0,r1
+ploop:
+	mov.b	(r1)+,r0
+	beq	pdone
+	emt	1
+	jmp	ploop
+pdone:
+	mov	#1,r3
+	mov	wdata,r4
+	mov	r3,(r4)
+wbr:
+	br	wdone
+	hlt
+wdone:
+	mov	#0,r0
+	emt	20
+	mov	#-16,r4
+	mov	r3,(r4)
+fbr:
+	br	fdone
+	hlt
+fdone:
+	hlt
+
+tick:
+	mov	4(sp),r11
+	mov	#0,20(r5)
+	rti
+
+passmsg:
+	.db	"Stopped inside the pair",10,0
+failmsg:
+	.db	"Did not stop inside the pair",10,0
+
+	.align	4
+wdata:
+	.long	0
+ttab:
+	.zero	32
+	.zero	64
+stack:
@@ -0,0 +1,215 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <sys/shm.h>
+#include "fuzz.h"
+
+/* Inputs don't grow past this */
+static const uint32_t MaxInput = 4096;
+
+CoverageMap::CoverageMap()
+    : bits(0), shared(false)
+{
+    const char* id = getenv("__AFL_SHM_ID");
+    if (id)
+    {
+	void* p = shmat(atoi(id), 0, 0);
+	if (p != reinterpret_cast<void*>(-1))
+	{
+	    bits = static_cast<uint8_t*>(p);
+	    shared = true;
+	    return;
+	}
+    }
+    bits = new uint8_t[CoverageSize];
+    Clear();
+}
+
+CoverageMap::~CoverageMap()
+{
+    if (shared)
+    {
+	shmdt(bits);
+    }
+    else
+    {
+	delete [] bits;
+    }
+}
+
+void CoverageMap::Clear()
+{
+    memset(bits, 0, CoverageSize);
+}
+
+Fuzzer::Fuzzer(CPU& cpu, uint32_t seed)
+    : cpu(cpu), map(*cpu.Coverage()), seen(CoverageSize), rng(seed), runs(0),
+      edges(0)
+{
+}
+
+void Fuzzer::Add(const Input& input)
+{
+    RunOne(input);
+    if (NewCoverage() || corpus.empty())
+    {
+	corpus.push_back(input);
+    }
+}
+
+void Fuzzer::Run(uint64_t count)
+{
+    if (corpus.empty())
+    {
+	Add(Input());
+    }
+    for(uint64_t i = 0; i < count; i++)
+    {
+	Input input = Mutate(corpus[Random(corpus.size())]);
+	ExecResult res = RunOne(input);
+	if (NewCoverage())
+	{
+	    if (res == Halt || res == Limit)
+	    {
+		corpus.push_back(input);
+	    }
+	    else
+	    {
+		crashes.push_back(input);
+	    }
+	}
+    }
+}
+
+ExecResult Fuzzer::RunOne(const Input& input)
+{
+    uint32_t pages;
+    cpu.Reset(pages);
+    map.Clear();
+    cpu.Input(input);
+    runs++;
+    return cpu.Run();
+}
+
+/* Hit counts in AFL's buckets: 1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+ */
+static uint8_t Bucket(uint8_t count)
+{
+    if (count <= 2)
+    {
+	return count;
+    }
+    if (count == 3)
+    {
+	return 4;
+    }
+    if (count < 8)
+    {
+	return 8;
+    }
+    if (count < 16)
+    {
+	return 16;
+    }
+    if (count < 32)
+    {
+	return 32;
+    }
+    return count < 128 ? 64 : 128;
+}
+
+bool Fuzzer::NewCoverage()
+{
+    const uint8_t* bits = map.Bits();
+    bool found = false;
+    /* Most of the map is untouched, so skip it a word at a time */
+    for(uint32_t i = 0; i < CoverageSize; i += 8)
+    {
+	uint64_t word;
+	memcpy(&word, bits + i, sizeof(word));
+	if (!word)
+	{
+	    continue;
+	}
+	for(uint32_t j = i; j < i + 8; j++)
+	{
+	    uint8_t b = Bucket(bits[j]);
+	    if (b & ~seen[j])
+	    {
+		if (!seen[j])
+		{
+		    edges++;
+		}
+		seen[j] |= b;
+		found = true;
+	    }
+	}
+    }
+    return found;
+}
+
+Fuzzer::Input Fuzzer::Mutate(const Input& input)
+{
+    static const uint8_t interesting[] =
+	{ 0, 1, 0x7f, 0x80, 0xff, '0', ' ', '\n' };
+    Input out = input;
+    for(uint32_t n = 1 << Random(4); n; n--)
+    {
+	if (out.empty())
+	{
+	    out.push_back(rng());
+	    continue;
+	}
+	uint32_t op = Random(7);
+	/* Don't grow a full input */
+	if (out.size() >= MaxInput && (op == 4 || op == 6))
+	{
+	    op = 0;
+	}
+	uint32_t pos = Random(out.size());
+	switch(op)
+	{
+	case 0:
+	    out[pos] ^= 1 << Random(8);
+	    break;
+
+	case 1:
+	    out[pos] = rng();
+	    break;
+
+	case 2:
+	    out[pos] = interesting[Random(sizeof(interesting))];
+	    break;
+
+	case 3:
+	    out[pos] += Random(2) ? Random(35) + 1 : -(Random(35) + 1);
+	    break;
+
+	case 4:
+	    /* Anywhere, including the end */
+	    out.insert(out.begin() + Random(out.size() + 1), rng());
+	    break;
+
+	case 5:
+	    out.erase(out.begin() + pos);
+	    break;
+
+	case 6:
+	{
+	    /* Put in part of another input */
+	    const Input& other = corpus[Random(corpus.size())];
+	    if (other.empty())
+	    {
+		break;
+	    }
+	    uint32_t from = Random(other.size());
+	    uint32_t len = std::min<uint32_t>(Random(other.size() - from) + 1,
+					      MaxInput - out.size());
+	    out.insert(out.begin() + Random(out.size() + 1),
+		       other.begin() + from,
+		       other.begin() + from + len);
+	    break;
+	}
+	}
+    }
+    return out;
+}
@@ -0,0 +1,67 @@
+#ifndef FUZZ_H
+#define FUZZ_H
+
+#include <cstdint>
+#include <random>
+#include <vector>
+#include "cpu.h"
+
+/*
+  Edge hit counts, kept by the cover policy. When stew is started by
+  afl-fuzz (__AFL_SHM_ID is set) the map is AFL's shared memory, so AFL
+  sees the guest's edges, otherwise it is private.
+*/
+class CoverageMap
+{
+public:
+    CoverageMap();
+    ~CoverageMap();
+    uint8_t* Bits() { return bits; }
+    void Clear();
+    bool Shared() { return shared; }
+
+private:
+    uint8_t* bits;
+    bool shared;
+};
+
+/*
+  A simple coverage guided fuzzer. Each run goes back to the CPU's
+  snapshot, gives the program a mutated input from the corpus, and
+  keeps the input if it reached an edge, or a new count of hits of an
+  edge, not seen before. Runs that stop with anything other than a
+  halt or the budget running out are kept as crashes, if new.
+*/
+class Fuzzer
+{
+public:
+    typedef std::vector<uint8_t> Input;
+
+    /* The CPU must have a snapshot and a coverage map */
+    Fuzzer(CPU& cpu, uint32_t seed);
+    /* Run an input as given, adding it to the corpus if new */
+    void Add(const Input& input);
+    void Run(uint64_t count);
+    const std::vector<Input>& Corpus() { return corpus; }
+    const std::vector<Input>& Crashes() { return crashes; }
+    uint64_t Runs() { return runs; }
+    uint32_t Edges() { return edges; }
+
+private:
+    ExecResult RunOne(const Input& input);
+    bool NewCoverage();
+    Input Mutate(const Input& input);
+    uint32_t Random(uint32_t n) { return rng() % n; }
+
+    CPU& cpu;
+    CoverageMap& map;
+    /* Bucketed counts seen so far for each edge */
+    std::vector<uint8_t> seen;
+    std::vector<Input> corpus;
+    std::vector<Input> crashes;
+    std::mt19937 rng;
+    uint64_t runs;
+    uint32_t edges;
+};
+
+#endif
@@ -0,0 +1,287 @@
+#include <algorithm>
+#include <iostream>
+#include "heap.h"
+#include "instruction.h"
+#include "memory.h"
+
+Heap::Heap()
+    : generation(0), marked(false)
+{
+    Init(0, 0, false);
+}
+
+void Heap::Init(uint32_t base, uint32_t size, bool check)
+{
+    uint32_t start = (uint64_t(base) + Grain - 1) & ~(Grain - 1);
+    uint32_t last = (uint64_t(base) + size) & ~(Grain - 1);
+    if (start >= last)
+    {
+	start = last = 0;
+    }
+    this->base = start;
+    end = last;
+    top = start;
+    this->check = check;
+    info.assign((last - start) >> GrainShift, 0);
+    for(auto& list : freeLists)
+    {
+	list.clear();
+    }
+    liveBlocks = 0;
+    liveBytes = 0;
+    peakBytes = 0;
+    blocks.clear();
+    generation++;
+    marked = false;
+}
+
+void Heap::Mark()
+{
+    marked = true;
+    changed.clear();
+}
+
+void Heap::Restore(const Heap& saved)
+{
+    if (!marked)
+    {
+	*this = saved;
+    }
+    else
+    {
+	for(uint32_t grain : changed)
+	{
+	    info[grain] = saved.info[grain];
+	}
+	top = saved.top;
+	/* In place, so the lists keep their storage */
+	for(uint32_t c = 0; c < NumClasses; c++)
+	{
+	    freeLists[c] = saved.freeLists[c];
+	}
+	liveBlocks = saved.liveBlocks;
+	liveBytes = saved.liveBytes;
+	peakBytes = saved.peakBytes;
+	if (check)
+	{
+	    blocks = saved.blocks;
+	}
+	generation = saved.generation;
+    }
+    Mark();
+}
+
+uint8_t& Heap::Touch(uint32_t addr)
+{
+    uint32_t grain = (addr - base) >> GrainShift;
+    if (marked)
+    {
+	if (changed.size() < info.size() / 8)
+	{
+	    changed.push_back(grain);
+	}
+	else
+	{
+	    marked = false;
+	}
+    }
+    return info[grain];
+}
+
+/*
+  Up to 256 bytes, class c holds 16 * (c + 1). Above that, sizes
+  between 2^b and 2^(b+1) are split into four classes.
+*/
+uint32_t Heap::ClassOf(uint32_t size)
+{
+    if (size <= 256)
+    {
+	return size ? (size - 1) >> 4 : 0;
+    }
+    uint32_t n = size - 1;
+    uint32_t b = 31 - __builtin_clz(n);
+    return 16 + (b - 8) * 4 + ((n >> (b - 2)) & 3);
+}
+
+uint64_t Heap::ClassSize(uint32_t c)
+{
+    if (c < 16)
+    {
+	return (c + 1) << 4;
+    }
+    uint32_t b = (c - 16) / 4 + 8;
+    return uint64_t((c - 16) % 4 + 5) << (b - 2);
+}
+
+uint32_t Heap::Alloc(uint32_t size, uint32_t pc)
+{
+    if (size > end - base)
+    {
+	return 0;
+    }
+    uint32_t c = ClassOf(size);
+    uint32_t addr;
+    if (!freeLists[c].empty())
+    {
+	addr = freeLists[c].back();
+	freeLists[c].pop_back();
+    }
+    else if (ClassSize(c) <= end - top)
+    {
+	addr = top;
+	top += ClassSize(c);
+	Touch(addr) = c + 1;
+    }
+    else
+    {
+	/* Use up a bigger free block, which keeps its class */
+	uint32_t big = c + 1;
+	while(big < NumClasses && freeLists[big].empty())
+	{
+	    big++;
+	}
+	if (big == NumClasses)
+	{
+	    return 0;
+	}
+	addr = freeLists[big].back();
+	freeLists[big].pop_back();
+    }
+    uint8_t& i = Touch(addr);
+    i |= LiveFlag;
+    liveBlocks++;
+    liveBytes += ClassSize((i & ~LiveFlag) - 1);
+    peakBytes = std::max(peakBytes, liveBytes);
+    if (check)
+    {
+	blocks[addr] = Block{ size, pc };
+    }
+    generation++;
+    return addr;
+}
+
+Heap::State Heap::At(uint32_t addr)
+{
+    if (addr < base || addr >= end || (addr & (Grain - 1)))
+    {
+	return NoBlock;
+    }
+    uint8_t i = Info(addr);
+    if (!i)
+    {
+	return NoBlock;
+    }
+    return (i & LiveFlag) ? LiveBlock : FreedBlock;
+}
+
+bool Heap::Free(uint32_t addr)
+{
+    if (At(addr) != LiveBlock)
+    {
+	return false;
+    }
+    uint8_t& i = Touch(addr);
+    i &= ~LiveFlag;
+    freeLists[i - 1].push_back(addr);
+    liveBlocks--;
+    liveBytes -= ClassSize(i - 1);
+    if (check)
+    {
+	blocks.erase(addr);
+    }
+    generation++;
+    return true;
+}
+
+uint32_t Heap::Realloc(Memory& memory, uint32_t addr, uint32_t size,
+		       uint32_t pc)
+{
+    if (At(addr) != LiveBlock)
+    {
+	return 0;
+    }
+    uint64_t have = ClassSize((Info(addr) & ~LiveFlag) - 1);
+    if (size <= have)
+    {
+	if (check)
+	{
+	    blocks[addr].size = size;
+	    generation++;
+	}
+	return addr;
+    }
+    uint32_t to = Alloc(size, pc);
+    if (to)
+    {
+	memory.Copy(to, addr, have);
+	Free(addr);
+    }
+    return to;
+}
+
+/* A bad free or realloc faults, when checking */
+static void BadFree(Heap& heap, Memory& memory, const char* what,
+		    uint32_t addr, uint32_t* regs)
+{
+    if (!heap.Checking())
+    {
+	return;
+    }
+    std::cerr << what << (heap.At(addr) == Heap::FreedBlock ?
+			  " of freed block " : " of non-block ")
+	      << std::hex << addr << " at " << regs[PC] - 4 << std::endl;
+    memory.Fault();
+}
+
+uint32_t EmtHeapInit(void* ctx, uint32_t* regs, Memory& memory)
+{
+    Heap* heap = static_cast<Heap*>(ctx);
+    uint32_t base = regs[R0];
+    uint32_t size = regs[R1];
+    if (base > memory.Size() || size > memory.Size() - base)
+    {
+	return 0;
+    }
+    heap->Init(base, size, regs[R2] & 1);
+    return heap->Active();
+}
+
+uint32_t EmtHeapAlloc(void* ctx, uint32_t* regs, Memory& memory)
+{
+    Heap* heap = static_cast<Heap*>(ctx);
+    return heap->Alloc(regs[R0], regs[PC] - 4);
+}
+
+uint32_t EmtHeapFree(void* ctx, uint32_t* regs, Memory& memory)
+{
+    Heap* heap = static_cast<Heap*>(ctx);
+    uint32_t addr = regs[R0];
+    /* Like free(NULL) */
+    if (addr && !heap->Free(addr))
+    {
+	BadFree(*heap, memory, "Free", addr, regs);
+    }
+    return 0;
+}
+
+uint32_t EmtHeapRealloc(void* ctx, uint32_t* regs, Memory& memory)
+{
+    Heap* heap = static_cast<Heap*>(ctx);
+    uint32_t addr = regs[R0];
+    uint32_t size = regs[R1];
+    if (!addr)
+    {
+	return heap->Alloc(size, regs[PC] - 4);
+    }
+    if (heap->At(addr) != Heap::LiveBlock)
+    {
+	BadFree(*heap, memory, "Realloc", addr, regs);
+	return 0;
+    }
+    if (!size)
+    {
+	heap->Free(addr);
+	return 0;
+    }
+    return heap->Realloc(memory, addr, size, regs[PC] - 4);
+}
@@ -0,0 +1,112 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+class Memory;
+
+/*
+  A guest heap run by the host, for the heap EMTs. Blocks come from
+  size classes, multiples of 16 bytes up to 256 and then four per power
+  of two, each with a free list. Freed blocks keep
+  their class, and are only reused for it or, when the heap is used up,
+  for a smaller class. Everything about the blocks is kept here, none
+  of it in guest memory, so guest writes can't corrupt it. Frees of
+  addresses that aren't live blocks are ignored, or with checking on
+  reported as faults. Checking also records each live block's size and
+  where it was allocated, to list leaks.
+*/
+class Heap
+{
+public:
+    /* Blocks are aligned to this */
+    static const uint32_t GrainShift = 4;
+    static const uint32_t Grain = 1 << GrainShift;
+
+    struct Block
+    {
+	uint32_t size;
+	uint32_t pc;
+    };
+
+    enum State
+    {
+	NoBlock,
+	FreedBlock,
+	LiveBlock,
+    };
+
+    Heap();
+    /* Manage [base, base + size), forgetting any blocks */
+    void Init(uint32_t base, uint32_t size, bool check);
+    bool Active() { return end != 0; }
+    bool Checking() { return check; }
+    /* Return 0 when no block is big enough */
+    uint32_t Alloc(uint32_t size, uint32_t pc);
+    /* What addr is the start of */
+    State At(uint32_t addr);
+    /* Return false if addr isn't a live block */
+    bool Free(uint32_t addr);
+    /*
+      A block that still fits stays put, others move to a new block.
+      Returns 0, keeping the block, if there's no room or addr isn't a
+      live block.
+    */
+    uint32_t Realloc(Memory& memory, uint32_t addr, uint32_t size, uint32_t pc);
+    uint32_t Base() { return base; }
+    uint32_t End() { return end; }
+    /* The part of the heap never used */
+    uint32_t Untouched() { return end - top; }
+    uint32_t LiveBlocks() { return liveBlocks; }
+    uint32_t LiveBytes() { return liveBytes; }
+    uint32_t PeakBytes() { return peakBytes; }
+    /* Live blocks, only kept when checking */
+    const std::unordered_map<uint32_t, Block>& Blocks() { return blocks; }
+    /* Changes with every allocation and free, and recorded resize */
+    uint64_t Generation() { return generation; }
+    /*
+      Note what changes from here, so that Restore to a copy taken now
+      only puts that back, not the whole heap
+    */
+    void Mark();
+    /* Back to saved, which was copied from this after the last Mark */
+    void Restore(const Heap& saved);
+
+private:
+    static const uint32_t NumClasses = 112;
+    /* In info, with the class + 1, for a live block */
+    static const uint8_t LiveFlag = 0x80;
+
+    static uint32_t ClassOf(uint32_t size);
+    static uint64_t ClassSize(uint32_t c);
+    uint8_t& Info(uint32_t addr) { return info[(addr - base) >> GrainShift]; }
+    /* Info to change */
+    uint8_t& Touch(uint32_t addr);
+
+    uint32_t base;
+    uint32_t end;
+    /* Start of the part never used */
+    uint32_t top;
+    bool check;
+    /* For each grain, 0 if no block starts there */
+    std::vector<uint8_t> info;
+    std::vector<uint32_t> freeLists[NumClasses];
+    uint32_t liveBlocks;
+    uint32_t liveBytes;
+    uint32_t peakBytes;
+    std::unordered_map<uint32_t, Block> blocks;
+    uint64_t generation;
+    /* Info changed since Mark, until there are too many to be worth it */
+    bool marked;
+    std::vector<uint32_t> changed;
+};
+
+/* The EMTs, ctx is the Heap */
+uint32_t EmtHeapInit(void* ctx, uint32_t* regs, Memory& memory);
+uint32_t EmtHeapAlloc(void* ctx, uint32_t* regs, Memory& memory);
+uint32_t EmtHeapFree(void* ctx, uint32_t* regs, Memory& memory);
+uint32_t EmtHeapRealloc(void* ctx, uint32_t* regs, Memory& memory);
+
+#endif
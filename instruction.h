@@ -2,6 +2,7 @@
 #define INSTRUCTION_H
 
 #include <cstdint>
+#include <cstring>
 
 enum RegName
 {
@@ -16,6 +17,7 @@ enum OperandSize
     Op8,
     Op16,
     Op32,
+    Op64,			/* Only for floating point */
 };
 
 class Register
@@ -30,6 +32,41 @@ private:
     uint32_t value;
 };
 
+enum VRegName
+{
+    V0, V1, V2, V3, V4, V5, V6, V7,
+    MaxVReg,
+};
+
+/* 128-bit vector register, lanes are in little endian order */
+class VectorRegister
+{
+public:
+    VectorRegister() { memset(bytes, 0, sizeof(bytes)); }
+    uint8_t bytes[16];
+};
+
+enum FRegName
+{
+    F0, F1, F2, F3, F4, F5, F6, F7,
+    MaxFReg,
+};
+
+/* Floating point status, rounding mode and sticky exception flags */
+enum FPStatus
+{
+    FPRoundNearest = 0,
+    FPRoundZero    = 1,
+    FPRoundUp      = 2,
+    FPRoundDown    = 3,
+    FPRoundMask    = 3,
+    FPInvalid      = 1 << 2,
+    FPDivZero      = 1 << 3,
+    FPOverflow     = 1 << 4,
+    FPUnderflow    = 1 << 5,
+    FPInexact      = 1 << 6,
+};
+
 class FlagRegister
 {
 public:
@@ -41,6 +78,7 @@ public:
 	    bool z:1;
 	    bool v:1;
 	    bool c:1;
+	    bool i:1;		/* Interrupts enabled */
 	};
 	uint8_t word;
     };
@@ -52,8 +90,17 @@ enum AddrMode
     Indir,			/* [Rn] */
     IndirAutoInc,		/* [Rn]+ */
     AutoDecIndir,		/* -[Rn] */
+    Immediate,			/* #n, small signed value in register field */
+    Displacement,		/* disp(Rn), disp in the following word */
 };
 
+/*
+  Bump with any change to the encoding, or to what an instruction does,
+  so that instructions kept in files (see tier.h) from an earlier one
+  aren't used.
+*/
+const uint32_t InstrSetVersion = 1;
+
 enum InstrKind
 {
     /* Regular two operand instructions */
@@ -65,7 +112,7 @@ enum InstrKind
     SUB,
     SBC,
     MUL,
-    DIV,
+    DIV,			/* To a register pair, remainder in the odd one */
     AND,
     OR,
     XOR,
@@ -85,6 +132,8 @@ enum InstrKind
     SEV,
     SEN,
     SEZ,
+    CLI,			/* Interrupts off */
+    SEI,			/* Interrupts on */
 
     /* Flow control unconditional  - ignores dest operands and operand size */
     JSR = 32,
@@ -92,6 +141,7 @@ enum InstrKind
     JMP,
     HLT,			/* Stop execution */
     BPT,			/* Breakpoint */
+    RTI,			/* Return from trap or interrupt */
     
     /* Branch instructions */
     BEQ = 48,
@@ -115,9 +165,63 @@ enum InstrKind
     /* Special type instructions */
     EMT = 64,  			/* Emulation trap - call OS */
 
+    /* Block instructions: src, dest and count registers, count in bytes */
+    BCPY = 72,			/* Copy, memmove semantics */
+    BFIL,			/* Fill with low byte of src */
+    BCMP,			/* Compare until first difference */
+    BSCN,			/* Scan for low byte of src */
+
+    /* Vector instructions, operand size gives the lane size */
+    VLD = 80,			/* Load from memory, or broadcast value */
+    VST,			/* Store to memory, or lane 0 to register */
+    VADD,
+    VSUB,
+    VMUL,
+    VCMPEQ,			/* Lanes set to all ones if equal */
+    VCMPGT,			/* Lanes set to all ones if greater, signed */
+
+    /* Floating point, .s = single, .d = double precision */
+    FMOV = 96,			/* Between FP registers and memory */
+    FADD,
+    FSUB,
+    FMUL,
+    FDIV,
+    FSQRT,
+    FCMP,			/* Sets N, Z and V = unordered */
+    ITOF,			/* Integer to FP */
+    FTOI,			/* FP to integer, using rounding mode */
+    LDFPS,			/* Load FP status */
+    STFPS,			/* Store FP status */
+
     MAX_INST = 255
 };
 
+/*
+  Entries in the guest's trap table, each the address of a handler, or
+  0 for none. A trap pushes the flags, the PC of the instruction it
+  stopped (or the next one, for an interrupt) and a word saying more:
+  the address for MemoryTrap, the line for an interrupt, else 0. Then
+  it turns interrupts off and jumps to the handler, which RTI returns
+  from, popping all three.
+*/
+enum TrapVector
+{
+    DivideTrap,			/* DIV by zero */
+    IllegalTrap,		/* Not an instruction, or a bad DIV pair */
+    MemoryTrap,			/* Outside memory, or unaligned with AlignTrap */
+    BreakpointTrap,		/* BPT */
+    InterruptVector,		/* Line 0, the rest follow */
+    NumInterrupts = 4,
+    NumVectors = InterruptVector + NumInterrupts,
+};
+
+/* Thrown to stop an instruction part way, see CPU::TrapTable */
+struct GuestTrap
+{
+    TrapVector vector;
+    uint32_t info;
+};
+
 class Instruction
 {
 public:
@@ -132,12 +236,23 @@ public:
 		{		
 		    RegName      source:8;
 		    RegName      dest:8;
-		    AddrMode     srcMode:2;
-		    AddrMode     destMode:2;
-		    uint32_t     unused:2;
+		    AddrMode     srcMode:3;
+		    AddrMode     destMode:3;
 		    OperandSize  size:2;
 		    InstrKind    op:8;
 		};
+		struct		/* Immediate operands */
+		{
+		    int32_t      srcImm:8;
+		    int32_t      destImm:8;
+		    uint32_t     :16;
+		};
+		struct		/* Block instructions */
+		{
+		    uint32_t     :16;
+		    uint32_t     count:4;
+		    uint32_t     :12;
+		};
 		struct		/* Branch instructions */
 		{
 		    int32_t      branch:24;
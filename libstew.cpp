@@ -0,0 +1,207 @@
+#include <fstream>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include "libstew.h"
+#include "cpu.h"
+#include "memory.h"
+
+struct StewMachine
+{
+    StewMachine(uint32_t size) : memory(0, size), cpu(0) {}
+    ~StewMachine() { delete cpu; }
+
+    Memory memory;
+    CPU* cpu;
+    std::unordered_map<std::string, uint32_t> symbols;
+    /* Host functions bound with StewBindEmt */
+    struct Binding
+    {
+	StewEmtFunc fn;
+	void* ctx;
+	StewMachine* m;
+    } emts[EmtTableSize];
+};
+
+static uint32_t CallBinding(void* ctx, uint32_t* regs, Memory& memory)
+{
+    StewMachine::Binding* b = static_cast<StewMachine::Binding*>(ctx);
+    return b->fn(b->ctx, regs, b->m);
+}
+
+StewMachine* StewCreate(uint32_t size, const char* access)
+{
+    if (size < 8 || size & 3)
+    {
+	return 0;
+    }
+    StewMachine* m;
+    try
+    {
+	m = new StewMachine(size);
+    }
+    catch(std::bad_alloc&)
+    {
+	return 0;
+    }
+    m->cpu = NewCPU(access ? access : "checked", m->memory, 0);
+    if (!m->cpu)
+    {
+	delete m;
+	return 0;
+    }
+    m->cpu->RegValue(SP, size - 4);
+    return m;
+}
+
+void StewDestroy(StewMachine* m)
+{
+    delete m;
+}
+
+int StewLoadHex(StewMachine* m, const char* file)
+{
+    std::ifstream f(file);
+    if (!f)
+    {
+	return 0;
+    }
+    uint32_t v;
+    uint32_t addr = 0;
+    while(f >> std::hex >> v)
+    {
+	uint8_t b = v;
+	if (!m->memory.Store(addr, &b, 1))
+	{
+	    return 0;
+	}
+	addr++;
+    }
+    return 1;
+}
+
+int StewMapImage(StewMachine* m, const char* file)
+{
+    uint32_t len;
+    return m->memory.MapImage(file, len);
+}
+
+/* The map file has a "name: address" line for each label */
+int StewLoadSymbols(StewMachine* m, const char* file)
+{
+    std::ifstream f(file);
+    if (!f)
+    {
+	return 0;
+    }
+    std::string name;
+    uint32_t v;
+    while(f >> name >> std::hex >> v)
+    {
+	if (name.empty() || name[name.length()-1] != ':')
+	{
+	    return 0;
+	}
+	m->symbols[name.substr(0, name.length()-1)] = v;
+    }
+    return 1;
+}
+
+int StewLookup(StewMachine* m, const char* name, uint32_t* addr)
+{
+    auto it = m->symbols.find(name);
+    if (it == m->symbols.end())
+    {
+	return 0;
+    }
+    *addr = it->second;
+    return 1;
+}
+
+uint32_t StewGetReg(StewMachine* m, int reg)
+{
+    if (reg < 0 || reg >= MaxReg)
+    {
+	return 0;
+    }
+    return m->cpu->RegValue(static_cast<RegName>(reg));
+}
+
+void StewSetReg(StewMachine* m, int reg, uint32_t value)
+{
+    if (reg >= 0 && reg < MaxReg)
+    {
+	m->cpu->RegValue(static_cast<RegName>(reg), value);
+    }
+}
+
+int StewRead(StewMachine* m, uint32_t addr, void* buf, uint32_t len)
+{
+    return m->memory.Load(addr, buf, len);
+}
+
+int StewWrite(StewMachine* m, uint32_t addr, const void* buf, uint32_t len)
+{
+    return m->memory.Store(addr, buf, len);
+}
+
+void StewSetBudget(StewMachine* m, uint64_t instrs)
+{
+    m->cpu->Budget(instrs);
+}
+
+void StewSetOutput(StewMachine* m, void (*fn)(void* ctx, char c), void* ctx)
+{
+    m->cpu->Output(fn, ctx);
+}
+
+int StewBindEmt(StewMachine* m, uint32_t num, StewEmtFunc fn, void* ctx)
+{
+    if (num >= EmtTableSize)
+    {
+	return 0;
+    }
+    m->emts[num] = StewMachine::Binding{ fn, ctx, m };
+    return m->cpu->BindEmt(num, CallBinding, &m->emts[num]);
+}
+
+int StewAttachDisk(StewMachine* m, const char* file)
+{
+    return m->cpu->Disk().Open(file);
+}
+
+void StewAttachConsole(StewMachine* m, int fd)
+{
+    m->cpu->Console().Open(fd);
+}
+
+int StewMapDevice(StewMachine* m, const char* name, uint32_t addr)
+{
+    return m->cpu->MapDevice(name, addr);
+}
+
+void StewInterrupt(StewMachine* m, uint32_t line)
+{
+    m->cpu->Interrupt(line);
+}
+
+StewResult StewCall(StewMachine* m, uint32_t addr)
+{
+    switch(m->cpu->Call(addr))
+    {
+    case Returned:
+	return StewReturned;
+    case Halt:
+	return StewHalted;
+    case Breakpoint:
+	return StewBreakpoint;
+    case Fault:
+	return StewFault;
+    case Watchpoint:
+	return StewWatchpoint;
+    case Limit:
+	return StewLimit;
+    default:
+	return StewUnknown;
+    }
+}
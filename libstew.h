@@ -0,0 +1,90 @@
+#ifndef LIBSTEW_H
+#define LIBSTEW_H
+
+#include <stdint.h>
+
+/*
+  Stew as a library, for running guest code from a host program. Each
+  machine has its own memory and CPU, so machines can be used from
+  different threads, one thread per machine at a time. Once loaded,
+  calls don't allocate or print, except diagnostics when the guest
+  faults. Functions returning int give non-zero on success.
+*/
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct StewMachine StewMachine;
+
+/* What StewCall stopped with */
+enum StewResult
+{
+    StewReturned,
+    StewHalted,
+    StewBreakpoint,
+    StewUnknown,
+    StewFault,
+    StewWatchpoint,
+    StewLimit,
+};
+
+/*
+  Memory is size bytes from address 0, a multiple of 4. access is
+  "flat", "checked" or "watch" as for stew -m, or 0 for checked. The
+  stack starts just below the last word of memory, which StewCall uses.
+*/
+StewMachine* StewCreate(uint32_t size, const char* access);
+void StewDestroy(StewMachine* m);
+
+/* Images as written by asm, hex or binary (asm -b), and its map file */
+int StewLoadHex(StewMachine* m, const char* file);
+int StewMapImage(StewMachine* m, const char* file);
+int StewLoadSymbols(StewMachine* m, const char* file);
+int StewLookup(StewMachine* m, const char* name, uint32_t* addr);
+
+/* Registers 0-15, r14 is the stack pointer and r15 the PC */
+uint32_t StewGetReg(StewMachine* m, int reg);
+void StewSetReg(StewMachine* m, int reg, uint32_t value);
+int StewRead(StewMachine* m, uint32_t addr, void* buf, uint32_t len);
+int StewWrite(StewMachine* m, uint32_t addr, const void* buf, uint32_t len);
+
+/* Instructions each call may run, 0 for no limit */
+void StewSetBudget(StewMachine* m, uint64_t instrs);
+/* Where the guest's PrintChar EMT goes, stdout by default */
+void StewSetOutput(StewMachine* m, void (*fn)(void* ctx, char c), void* ctx);
+/*
+  Make EMT num (below 256) call fn, which can change the registers and
+  use StewRead and StewWrite. What it returns goes in r0. EMTs 1-19 are
+  built in, see emt.h, and can be replaced.
+*/
+typedef uint32_t (*StewEmtFunc)(void* ctx, uint32_t* regs, StewMachine* m);
+int StewBindEmt(StewMachine* m, uint32_t num, StewEmtFunc fn, void* ctx);
+
+/* The file for the disk EMTs (12-15) */
+int StewAttachDisk(StewMachine* m, const char* file);
+/* Where the console EMTs (16-19) read from, none by default */
+void StewAttachConsole(StewMachine* m, int fd);
+/*
+  Map a page at addr for the "console", "timer" or "disk" device, see
+  devices.h. Needs a checking access policy.
+*/
+int StewMapDevice(StewMachine* m, const char* name, uint32_t addr);
+/*
+  Raise interrupt line 0-3, taken by the guest's handler once it has
+  set a trap table (EMT 20) and turned interrupts on, see TrapVector in
+  instruction.h
+*/
+void StewInterrupt(StewMachine* m, uint32_t line);
+
+/*
+  Call the function at addr with the registers as set, running until
+  it returns. Arguments and results are in registers, by whatever
+  convention the guest code uses.
+*/
+enum StewResult StewCall(StewMachine* m, uint32_t addr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
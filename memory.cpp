@@ -1,6 +1,13 @@
+#include <cassert>
 #include <cstdint>
 #include <iostream>
 #include <cstring>
+#include <algorithm>
+#include <new>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "memory.h"
 
 static void Unaligned(uint32_t addr)
@@ -8,83 +15,357 @@ static void Unaligned(uint32_t addr)
     std::cerr << "Unaligned access at " << std::hex << addr << std::endl;
 }
 
+static void OutOfRange(uint32_t addr)
+{
+    std::cerr << "Access outside memory at " << std::hex << addr << std::endl;
+}
 
-Memory::Memory(uint32_t base, uint32_t size) : base(base)
+
+Memory::Memory(uint32_t base, uint32_t size)
+    : base(base), size(size), plain(size), alignTrap(false), faulted(false),
+      trapping(false),
+      pageFlags((size + PageSize - 1) >> PageShift),
+      codeLines((size + LineSize - 1) >> LineShift), watchHit(false),
+      watchAddr(0)
 {
-    mem = new uint32_t[size / sizeof(uint32_t)];
-    memset(mem, 0, size);
+    /* Anonymous pages read as zero and cost nothing until written */
+    void* p = mmap(0, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+    {
+	throw std::bad_alloc();
+    }
+    mem = static_cast<uint8_t*>(p);
 }
 
 Memory::~Memory()
 {
-    delete mem;
+    munmap(mem, size);
 }
 
-void Memory::Write(uint32_t addr, uint32_t value, uint32_t opsize)
+bool Memory::MapImage(const std::string& file, uint32_t& len)
+{
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+	return false;
+    }
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0 && st.st_size <= size;
+    if (ok && st.st_size)
+    {
+	/* Replaces the pages the image covers, the rest are kept */
+	ok = mmap(mem, st.st_size, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED;
+    }
+    close(fd);
+    if (!ok)
+    {
+	return false;
+    }
+    len = st.st_size;
+    Flagged(0, len);
+    return true;
+}
+
+/* Returns true if the access can go ahead */
+bool Memory::Check(uint32_t addr, uint32_t opsize)
 {
-    uint32_t mask = 0;
-    uint32_t amask = 0;
-    uint32_t shift = 0;
-    switch(opsize)
-    {
-    case 1:
-	amask = 0;
-	shift = (addr & 3) << 3;
-	mask = 0xFF << shift;
-	break;
-    case 2:
-	amask = 1;
-	shift = (addr & 2) << 3;
-	mask = 0xFFFF << shift;
-	break;
-    case 4:
-	mask = 0xFFFFFFFF;
-	amask = 3;
-	shift = 0;
-	break;
-    default:
+    if (opsize != 1 && opsize != 2 && opsize != 4)
+    {
 	std::cerr << "Invalid size" << std::endl;
-	break;
+	return false;
     }
-    uint32_t old = mem[addr / sizeof(uint32_t)];
-    value = (old & ~mask) | ((value << shift) & mask);
-    if (addr & amask)
+    if (!InRange(addr, opsize))
     {
-	Unaligned(addr);
+	if (!trapping)
+	{
+	    OutOfRange(addr);
+	}
+	faulted = true;
+	return false;
     }
-    mem[addr / sizeof(uint32_t)] = value;
+    if (alignTrap && (addr & (opsize - 1)))
+    {
+	if (!trapping)
+	{
+	    Unaligned(addr);
+	}
+	faulted = true;
+	return false;
+    }
+    return true;
+}
+
+void Memory::Write(uint32_t addr, uint32_t value, uint32_t opsize)
+{
+    if (!Check(addr, opsize))
+    {
+	return;
+    }
+    if (OnDevice(addr))
+    {
+	DeviceRange& d = FindDevice(addr);
+	d.device->Write(addr - d.start, value, opsize);
+	return;
+    }
+    WriteFast(addr, value, opsize);
 }
 
 uint32_t Memory::Read(uint32_t addr, uint32_t opsize)
 {
-    uint32_t mask = 0;
-    uint32_t shift = 0;
-    uint32_t amask = 0;
-    switch(opsize)
-    {
-    case 1:
-	amask = 0;
-	mask = 0xFF;
-	shift =  (addr & 3) << 3;
-	break;
-    case 2:
-	mask = 0xFFFF;
-	amask = 1;
-	shift =  (addr & 2) << 3;
-	break;
-    case 4:
-	mask = 0xFFFFFFFF;
-	amask = 3;
-	shift = 0;
-	break;
-    default:
-	std::cerr << "Invalid size" << std::endl;
-	break;
+    if (!Check(addr, opsize))
+    {
+	return 0;
+    }
+    if (OnDevice(addr))
+    {
+	DeviceRange& d = FindDevice(addr);
+	return d.device->Read(addr - d.start, opsize);
+    }
+    return ReadFast(addr, opsize);
+}
+
+void Memory::Poke(uint32_t addr, uint32_t value, uint32_t opsize)
+{
+    if (Check(addr, opsize))
+    {
+	WriteFast(addr, value, opsize);
+    }
+}
+
+uint32_t Memory::Peek(uint32_t addr, uint32_t opsize)
+{
+    if (!Check(addr, opsize))
+    {
+	return 0;
+    }
+    return ReadFast(addr, opsize);
+}
+
+bool Memory::MapDevice(uint32_t addr, uint32_t len, Device* device)
+{
+    if ((addr | len) & (PageSize - 1) || !addr || !len || !InRange(addr, len))
+    {
+	return false;
+    }
+    for(uint32_t p = addr >> PageShift; p < (addr + len) >> PageShift; p++)
+    {
+	if (pageFlags[p] & DevicePage)
+	{
+	    return false;
+	}
+    }
+    for(uint32_t p = addr >> PageShift; p < (addr + len) >> PageShift; p++)
+    {
+	pageFlags[p] |= DevicePage;
+    }
+    devices.push_back(DeviceRange{ addr, addr + len, device });
+    plain = std::min(plain, addr);
+    return true;
+}
+
+/* Only called for addresses on a device's pages */
+Memory::DeviceRange& Memory::FindDevice(uint32_t addr)
+{
+    for(auto& d : devices)
+    {
+	if (addr >= d.start && addr < d.end)
+	{
+	    return d;
+	}
+    }
+    assert(false);
+    return devices[0];
+}
+
+/*
+  The block operations work directly on the host copy of memory, which
+  relies on a little endian host, as Read and Write do.
+*/
+bool Memory::Copy(uint32_t dest, uint32_t src, uint32_t len)
+{
+    if (!InRange(dest, len) || !InRange(src, len))
+    {
+	return false;
+    }
+    memmove(Bytes(dest), Bytes(src), len);
+    Written(dest, len);
+    return true;
+}
+
+bool Memory::Fill(uint32_t addr, uint8_t value, uint32_t len)
+{
+    if (!InRange(addr, len))
+    {
+	return false;
     }
-    if (addr & amask)
+    memset(Bytes(addr), value, len);
+    Written(addr, len);
+    return true;
+}
+
+bool Memory::Compare(uint32_t addr1, uint32_t addr2, uint32_t len,
+		     uint32_t& pos)
+{
+    if (!InRange(addr1, len) || !InRange(addr2, len))
+    {
+	return false;
+    }
+    const uint8_t* p1 = Bytes(addr1);
+    const uint8_t* p2 = Bytes(addr2);
+    pos = len;
+    if (memcmp(p1, p2, len) != 0)
+    {
+	pos = std::mismatch(p1, p1 + len, p2).first - p1;
+    }
+    return true;
+}
+
+bool Memory::Scan(uint32_t addr, uint8_t value, uint32_t len, uint32_t& pos)
+{
+    if (!InRange(addr, len))
+    {
+	return false;
+    }
+    const uint8_t* p = Bytes(addr);
+    const void* found = memchr(p, value, len);
+    pos = found ? static_cast<const uint8_t*>(found) - p : len;
+    return true;
+}
+
+bool Memory::Load(uint32_t addr, void* dest, uint32_t len)
+{
+    if (!InRange(addr, len))
+    {
+	return false;
+    }
+    memcpy(dest, Bytes(addr), len);
+    return true;
+}
+
+bool Memory::Store(uint32_t addr, const void* src, uint32_t len)
+{
+    if (!InRange(addr, len))
+    {
+	return false;
+    }
+    memcpy(Bytes(addr), src, len);
+    Written(addr, len);
+    return true;
+}
+
+/* Pages stay marked once they have had code, that only costs a check */
+void Memory::MarkCode(uint32_t addr, uint32_t len)
+{
+    uint32_t last = std::min<uint64_t>(codeLines.size(),
+				       (uint64_t(addr) + len + LineSize - 1)
+				       >> LineShift);
+    for(uint32_t l = addr >> LineShift; l < last; l++)
+    {
+	codeLines[l] = true;
+	pageFlags[l >> (PageShift - LineShift)] |= CodePage;
+    }
+}
+
+void Memory::FlaggedWrite(uint32_t addr, uint32_t len)
+{
+    uint32_t last = std::min<uint64_t>(pageFlags.size(),
+				       (uint64_t(addr) + len + PageSize - 1)
+				       >> PageShift);
+    bool code = false;
+    for(uint32_t p = addr >> PageShift; p < last; p++)
+    {
+	if (pageFlags[p] & CleanPage)
+	{
+	    pageFlags[p] &= ~CleanPage;
+	    dirtyPages.push_back(p);
+	}
+	code |= pageFlags[p] & CodePage;
+    }
+    if (code)
+    {
+	CodeLinesWritten(addr, len);
+    }
+}
+
+void Memory::Snapshot()
+{
+    snapshot.assign(mem, mem + size);
+    for(auto& f : pageFlags)
+    {
+	f |= CleanPage;
+    }
+    dirtyPages.clear();
+}
+
+uint32_t Memory::Restore()
+{
+    uint32_t count = dirtyPages.size();
+    for(auto p : dirtyPages)
+    {
+	uint32_t addr = p << PageShift;
+	uint32_t len = size - addr < PageSize ? size - addr : PageSize;
+	memcpy(mem + addr, &snapshot[addr], len);
+	pageFlags[p] |= CleanPage;
+	/* Code compiled from what the run wrote is now wrong */
+	if (pageFlags[p] & CodePage)
+	{
+	    CodeLinesWritten(addr, len);
+	}
+    }
+    dirtyPages.clear();
+    faulted = false;
+    watchHit = false;
+    return count;
+}
+
+void Memory::CodeLinesWritten(uint32_t addr, uint32_t len)
+{
+    uint32_t last = std::min<uint64_t>(codeLines.size(),
+				       (uint64_t(addr) + len + LineSize - 1)
+				       >> LineShift);
+    for(uint32_t l = addr >> LineShift; l < last; l++)
+    {
+	if (codeLines[l])
+	{
+	    codeLines[l] = false;
+	    codeWrites.push_back(l);
+	}
+    }
+}
+
+std::vector<uint32_t> Memory::TakeCodeWrites()
+{
+    std::vector<uint32_t> pages;
+    pages.swap(codeWrites);
+    return pages;
+}
+
+void Memory::Watch(uint32_t addr, uint32_t len)
+{
+    watches.push_back(std::make_pair(addr, addr + len));
+}
+
+void Memory::CheckWatches(uint32_t addr, uint32_t len)
+{
+    for(auto& w : watches)
+    {
+	if (addr < w.second && addr + len > w.first && !watchHit)
+	{
+	    watchHit = true;
+	    watchAddr = std::max(addr, w.first);
+	}
+    }
+}
+
+bool Memory::TakeWatchHit(uint32_t& addr)
+{
+    if (!watchHit)
     {
-	Unaligned(addr);
+	return false;
     }
-    uint32_t value = mem[addr / sizeof(uint32_t)];
-    return (value >> shift) & mask;
+    watchHit = false;
+    addr = watchAddr;
+    return true;
 }
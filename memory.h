@@ -1,16 +1,249 @@
 #ifndef MEMORY_H
 #define MEMORY_H
 
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+/*
+  Something that claims guest addresses, see Memory::MapDevice. The
+  offset is from the start of its range, the size 1, 2 or 4.
+*/
+class Device
+{
+public:
+    virtual ~Device() {}
+    virtual uint32_t Read(uint32_t offset, uint32_t size) = 0;
+    virtual void Write(uint32_t offset, uint32_t value, uint32_t size) = 0;
+};
+
 class Memory
 {
 public:
+    static const uint32_t PageShift = 12;
+    static const uint32_t PageSize = 1 << PageShift;
+    /* Code is tracked in lines, so data next to it can be written */
+    static const uint32_t LineShift = 6;
+    static const uint32_t LineSize = 1 << LineShift;
+
     Memory(uint32_t base, uint32_t size);
     ~Memory();
+    /*
+      Map a binary image at address 0, copy on write. Pages of it that
+      are never written stay shared with every other mapping of the
+      file, in this process or another. Returns false, leaving memory
+      as it was, if the file can't be mapped or doesn't fit.
+    */
+    bool MapImage(const std::string& file, uint32_t& len);
+    /*
+      Guest memory is little endian, as is the host copy, so an access
+      is a single load or store at any alignment. Accesses outside
+      memory, and unaligned ones when AlignTrap is on, are reported and
+      not done, and recorded for TakeFault.
+    */
     void Write(uint32_t addr, uint32_t value, uint32_t size);
     uint32_t Read(uint32_t addr, uint32_t size);
+    /* As Write and Read, but devices' pages are plain memory */
+    void Poke(uint32_t addr, uint32_t value, uint32_t size);
+    uint32_t Peek(uint32_t addr, uint32_t size);
+    /*
+      Give a device whole pages, from addr up, not page 0. Write and
+      Read, and so the checking access policies, pass accesses there to
+      the device. Everything else, the block operations, flat access and
+      the debugger's Peek and Poke, sees the pages as plain memory. The
+      device isn't owned. Returns false if the range is bad or taken.
+    */
+    bool MapDevice(uint32_t addr, uint32_t len, Device* device);
+    /* Start of the lowest device's pages, or the size without devices */
+    uint32_t PlainSize() { return plain; }
+    /* No checks, the size is 1, 2 or 4 and the range in memory */
+    uint32_t ReadFast(uint32_t addr, uint32_t opsize)
+    {
+	switch(opsize)
+	{
+	case 1:
+	    return mem[addr];
+	case 2:
+	{
+	    uint16_t v;
+	    memcpy(&v, mem + addr, sizeof(v));
+	    return v;
+	}
+	default:
+	{
+	    uint32_t v;
+	    memcpy(&v, mem + addr, sizeof(v));
+	    return v;
+	}
+	}
+    }
+    void WriteFast(uint32_t addr, uint32_t value, uint32_t opsize)
+    {
+	switch(opsize)
+	{
+	case 1:
+	    mem[addr] = value;
+	    break;
+	case 2:
+	{
+	    uint16_t v = value;
+	    memcpy(mem + addr, &v, sizeof(v));
+	    break;
+	}
+	default:
+	    memcpy(mem + addr, &value, sizeof(value));
+	    break;
+	}
+	Flagged(addr, opsize);
+    }
+    /*
+      True if an access is aligned and in memory below any device. Put
+      devices high, as the checking policies take anything above the
+      lowest one through Read and Write, which look at the page flags.
+    */
+    bool Fits(uint32_t addr, uint32_t opsize)
+    {
+	return !(addr & (opsize - 1)) && addr <= plain - opsize;
+    }
+    bool AlignTrap() { return alignTrap; }
+    void AlignTrap(bool enable) { alignTrap = enable; }
+    bool TakeFault()
+    {
+	if (!faulted)
+	{
+	    return false;
+	}
+	faulted = false;
+	return true;
+    }
+    /* For host code, as EMTs, to stop the CPU as a bad access does */
+    void Fault() { faulted = true; }
+    /* Whether there is one to take, leaving it there */
+    bool Faulted() { return faulted; }
+    /*
+      The CPU's checked accesses throw GuestTrap for faults, which the
+      guest handles and reports, so they aren't reported here
+    */
+    bool Trapping() { return trapping; }
+    void Trapping(bool enable) { trapping = enable; }
+    /* Block operations, return false if the range is outside memory */
+    bool Copy(uint32_t dest, uint32_t src, uint32_t len);
+    bool Fill(uint32_t addr, uint8_t value, uint32_t len);
+    bool Compare(uint32_t addr1, uint32_t addr2, uint32_t len, uint32_t& pos);
+    bool Scan(uint32_t addr, uint8_t value, uint32_t len, uint32_t& pos);
+    bool Load(uint32_t addr, void* dest, uint32_t len);
+    bool Store(uint32_t addr, const void* src, uint32_t len);
+    /* Direct access for translated code, little endian host */
+    uint8_t* Data() { return mem; }
+    uint32_t Size() { return size; }
+    /*
+      Lines holding compiled code are marked, and the first write to
+      one is recorded (and the mark cleared) so the code can be dropped.
+      Writes to pages with no code only pay for checking the page flag.
+    */
+    void MarkCode(uint32_t addr, uint32_t len);
+    bool CodeWritten() { return !codeWrites.empty(); }
+    std::vector<uint32_t> TakeCodeWrites();
+    /*
+      Note a write made directly to the host copy, as the block
+      operations and EMTs make, including for the watchpoints.
+    */
+    void Written(uint32_t addr, uint32_t len)
+    {
+	Flagged(addr, len);
+	if (!watches.empty() && len)
+	{
+	    CheckWatches(addr, len);
+	}
+    }
+    /*
+      Keep a copy of memory to go back to. Restore copies back only the
+      pages written since, so its cost depends on what the run wrote,
+      not on the size of memory. Returns the number of pages restored.
+    */
+    void Snapshot();
+    bool HasSnapshot() { return !snapshot.empty(); }
+    uint32_t Restore();
+    /*
+      Write watchpoints, as [start, end) ranges. WatchAccess looks at
+      them for its writes, and Written for the rest, recording the first
+      write to one until it is taken. Only WatchAccess takes them.
+    */
+    void Watch(uint32_t addr, uint32_t len);
+    void ClearWatches() { watches.clear(); }
+    const std::vector<std::pair<uint32_t, uint32_t> >& Watches()
+    {
+	return watches;
+    }
+    void CheckWatches(uint32_t addr, uint32_t len);
+    bool TakeWatchHit(uint32_t& addr);
+    bool WatchHit() { return watchHit; }
 private:
+    enum PageFlags
+    {
+	CodePage = 1,
+	CleanPage = 2,
+	DevicePage = 4,
+    };
+    struct DeviceRange
+    {
+	uint32_t start;
+	uint32_t end;
+	Device* device;
+    };
+    bool Check(uint32_t addr, uint32_t opsize);
+    /*
+      Only pages with code, or not yet written since the snapshot, have
+      flags, so other writes cost one test.
+    */
+    void Flagged(uint32_t addr, uint32_t len)
+    {
+	uint32_t last = std::min<uint64_t>(pageFlags.size(),
+					   (uint64_t(addr) + len +
+					    PageSize - 1) >> PageShift);
+	for(uint32_t p = addr >> PageShift; p < last; p++)
+	{
+	    if (pageFlags[p])
+	    {
+		FlaggedWrite(addr, len);
+		return;
+	    }
+	}
+    }
+    bool OnDevice(uint32_t addr)
+    {
+	return pageFlags[addr >> PageShift] & DevicePage;
+    }
+    DeviceRange& FindDevice(uint32_t addr);
+    void FlaggedWrite(uint32_t addr, uint32_t len);
+    void CodeLinesWritten(uint32_t addr, uint32_t len);
+    bool InRange(uint32_t addr, uint32_t len)
+    {
+	return addr <= size && len <= size - addr;
+    }
+    uint8_t* Bytes(uint32_t addr)
+    {
+	return mem + addr;
+    }
     uint32_t base;
-    uint32_t *mem;
+    uint32_t size;
+    uint32_t plain;
+    uint8_t *mem;
+    bool alignTrap;
+    bool faulted;
+    bool trapping;
+    std::vector<uint8_t> pageFlags;
+    std::vector<bool> codeLines;
+    std::vector<uint32_t> codeWrites;
+    std::vector<uint8_t> snapshot;
+    std::vector<uint32_t> dirtyPages;
+    std::vector<std::pair<uint32_t, uint32_t> > watches;
+    std::vector<DeviceRange> devices;
+    bool watchHit;
+    uint32_t watchAddr;
 };
 
 #endif
@@ -0,0 +1,139 @@
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include "simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_HOST_SIMD 1
+#endif
+
+/* Portable implementation, one lane at a time */
+
+template<typename T> static T Add(T a, T b) { return a + b; }
+template<typename T> static T Sub(T a, T b) { return a - b; }
+template<typename T> static T Mul(T a, T b)
+{
+    return static_cast<uint32_t>(a) * b;
+}
+template<typename T> static T CmpEq(T a, T b) { return a == b ? ~T(0) : 0; }
+template<typename T> static T CmpGt(T a, T b)
+{
+    typedef typename std::make_signed<T>::type S;
+    return static_cast<S>(a) > static_cast<S>(b) ? ~T(0) : 0;
+}
+
+template<typename T, T (*Op)(T, T)>
+static void Scalar(VectorRegister& dest, const VectorRegister& src)
+{
+    const size_t lanes = sizeof(dest.bytes) / sizeof(T);
+    T d[lanes];
+    T s[lanes];
+    memcpy(d, dest.bytes, sizeof(d));
+    memcpy(s, src.bytes, sizeof(s));
+    for(size_t i = 0; i < lanes; i++)
+    {
+	d[i] = Op(d[i], s[i]);
+    }
+    memcpy(dest.bytes, d, sizeof(d));
+}
+
+#define SCALAR(op)					\
+    { Scalar<uint8_t, op<uint8_t> >,			\
+      Scalar<uint16_t, op<uint16_t> >,			\
+      Scalar<uint32_t, op<uint32_t> > }
+
+static const VectorFunc scalarFuncs[MaxVecOp][3] =
+{
+    SCALAR(Add),
+    SCALAR(Sub),
+    SCALAR(Mul),
+    SCALAR(CmpEq),
+    SCALAR(CmpGt),
+};
+
+#ifdef HAVE_HOST_SIMD
+/* SSE4.1 implementation, built for that target whatever the compiler
+   defaults are, and only selected if the host supports it */
+
+#define SSE_TARGET __attribute__((target("sse4.1")))
+
+#define SSE_OP(name, expr)						\
+    SSE_TARGET static void name(VectorRegister& dest,			\
+				const VectorRegister& src)		\
+    {									\
+	__m128i a = _mm_loadu_si128(reinterpret_cast<__m128i*>(dest.bytes)); \
+	__m128i b = _mm_loadu_si128(					\
+	    reinterpret_cast<const __m128i*>(src.bytes));		\
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(dest.bytes), expr); \
+    }
+
+SSE_TARGET static __m128i MulLo8(__m128i a, __m128i b)
+{
+    /* No 8-bit multiply, so do even and odd bytes as 16-bit lanes */
+    __m128i even = _mm_mullo_epi16(a, b);
+    __m128i odd = _mm_mullo_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+    return _mm_or_si128(_mm_slli_epi16(odd, 8),
+			_mm_and_si128(even, _mm_set1_epi16(0xff)));
+}
+
+SSE_OP(SseAdd8,    _mm_add_epi8(a, b))
+SSE_OP(SseAdd16,   _mm_add_epi16(a, b))
+SSE_OP(SseAdd32,   _mm_add_epi32(a, b))
+SSE_OP(SseSub8,    _mm_sub_epi8(a, b))
+SSE_OP(SseSub16,   _mm_sub_epi16(a, b))
+SSE_OP(SseSub32,   _mm_sub_epi32(a, b))
+SSE_OP(SseMul8,    MulLo8(a, b))
+SSE_OP(SseMul16,   _mm_mullo_epi16(a, b))
+SSE_OP(SseMul32,   _mm_mullo_epi32(a, b))
+SSE_OP(SseCmpEq8,  _mm_cmpeq_epi8(a, b))
+SSE_OP(SseCmpEq16, _mm_cmpeq_epi16(a, b))
+SSE_OP(SseCmpEq32, _mm_cmpeq_epi32(a, b))
+SSE_OP(SseCmpGt8,  _mm_cmpgt_epi8(a, b))
+SSE_OP(SseCmpGt16, _mm_cmpgt_epi16(a, b))
+SSE_OP(SseCmpGt32, _mm_cmpgt_epi32(a, b))
+
+static const VectorFunc hostFuncs[MaxVecOp][3] =
+{
+    { SseAdd8,   SseAdd16,   SseAdd32 },
+    { SseSub8,   SseSub16,   SseSub32 },
+    { SseMul8,   SseMul16,   SseMul32 },
+    { SseCmpEq8, SseCmpEq16, SseCmpEq32 },
+    { SseCmpGt8, SseCmpGt16, SseCmpGt32 },
+};
+
+static bool HostSupported()
+{
+    return __builtin_cpu_supports("sse4.1");
+}
+#else
+static const VectorFunc (*hostFuncs)[3] = scalarFuncs;
+
+static bool HostSupported()
+{
+    return false;
+}
+#endif
+
+static const VectorFunc (*vectorFuncs)[3] =
+    HostSupported() ? hostFuncs : scalarFuncs;
+
+VectorFunc GetVectorFunc(VectorOp op, OperandSize lanes)
+{
+    return vectorFuncs[op][lanes];
+}
+
+bool UseHostSimd(bool enable)
+{
+    if (enable && !HostSupported())
+    {
+	return false;
+    }
+    vectorFuncs = enable ? hostFuncs : scalarFuncs;
+    return true;
+}
+
+const char* VectorImplName()
+{
+    return vectorFuncs == scalarFuncs ? "scalar" : "sse4.1";
+}
@@ -0,0 +1,28 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include "instruction.h"
+
+enum VectorOp
+{
+    VecAdd,
+    VecSub,
+    VecMul,
+    VecCmpEq,
+    VecCmpGt,
+    MaxVecOp,
+};
+
+typedef void (*VectorFunc)(VectorRegister& dest, const VectorRegister& src);
+
+VectorFunc GetVectorFunc(VectorOp op, OperandSize lanes);
+
+/*
+  Select host SIMD or the portable scalar code. Host SIMD is used by
+  default if the CPU we run on supports it. Returns false if asking for
+  host SIMD when it is not available.
+*/
+bool UseHostSimd(bool enable);
+const char* VectorImplName();
+
+#endif
@@ -35,17 +35,38 @@ bool StewLineParser::IsSeparator(char c)
     return false;
 }
 
-int main()
+int main(int argc, char **argv)
 {
+    /* -m flat|checked|watch|cover picks how the CPU accesses memory */
+    std::string access = "checked";
+    if (argc == 3 && std::string(argv[1]) == "-m")
+    {
+	access = argv[2];
+    }
+    else if (argc != 1)
+    {
+	std::cerr << "Usage: " << argv[0] << " [-m flat|checked|watch|cover]"
+		  << std::endl;
+	return 1;
+    }
+
     Memory mem(0, 1 * 1024 * 1024);
-    cpu = new CPU(mem, 0);
+    cpu = NewCPU(access, mem, 0);
+    if (!cpu)
+    {
+	std::cerr << "Unknown memory access: " << access << std::endl;
+	return 1;
+    }
 
+    /* The commands and the program's console EMTs share stdin */
+    ConsoleInput& input = cpu->Console();
+    input.Open(0);
     InitCommands();
     for(;;)
     {
 	std::cout << ". " << std::flush;
 	std::string line;
-	if (!std::getline(std::cin, line))
+	if (!input.ReadLine(line))
 	{
 	    std::cout << "<EOF>" << std::endl;
 	    break;
@@ -5,6 +5,9 @@ label:
 	mov	(r2)+,r5
 	mov	r4,-(sp)
 	mov	(pc)+,r8
+	mov	8(r1),r9
+	mov	r9,-4(sp)
+	mov	label(pc),r10
 	mov 	#42, r1
 	mov 	#4711, r2
 	mov.l	r10,r11
@@ -0,0 +1,172 @@
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <unistd.h>
+#include "tier.h"
+
+BlockCompiler::BlockCompiler(CompileFunc fn)
+    : compile(fn), ready(false), stop(false)
+{
+    thread = std::thread(&BlockCompiler::Worker, this);
+}
+
+BlockCompiler::~BlockCompiler()
+{
+    {
+	std::lock_guard<std::mutex> guard(lock);
+	stop = true;
+    }
+    wake.notify_one();
+    thread.join();
+    for(auto b : queue)
+    {
+	delete b;
+    }
+    for(auto b : done)
+    {
+	delete b;
+    }
+}
+
+void BlockCompiler::Submit(CodeBlock* block)
+{
+    {
+	std::lock_guard<std::mutex> guard(lock);
+	queue.push_back(block);
+    }
+    wake.notify_one();
+}
+
+std::vector<CodeBlock*> BlockCompiler::TakeDone()
+{
+    std::vector<CodeBlock*> blocks;
+    std::lock_guard<std::mutex> guard(lock);
+    blocks.swap(done);
+    ready.store(false, std::memory_order_release);
+    return blocks;
+}
+
+void BlockCompiler::Worker()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    for(;;)
+    {
+	wake.wait(guard, [this] { return stop || !queue.empty(); });
+	if (stop)
+	{
+	    break;
+	}
+	CodeBlock* block = queue.front();
+	queue.pop_front();
+
+	guard.unlock();
+	auto t0 = std::chrono::steady_clock::now();
+	compile(*block);
+	auto t1 = std::chrono::steady_clock::now();
+	block->compileTime =
+	    std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)
+	    .count();
+	guard.lock();
+
+	done.push_back(block);
+	ready.store(true, std::memory_order_release);
+    }
+}
+
+static const uint32_t BlockCacheMagic = 0x4b4c4253;	/* "SBLK" */
+/* No block gets near this, so anything bigger is a corrupt file */
+static const uint32_t MaxCachedWords = 0x10000;
+
+template<typename T>
+static void Put(std::ostream& os, const T& v)
+{
+    os.write(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+template<typename T>
+static bool Get(std::istream& is, T& v)
+{
+    return !!is.read(reinterpret_cast<char*>(&v), sizeof(v));
+}
+
+bool SaveBlockCache(const std::string& file, uint64_t key,
+		    const std::vector<const CodeBlock*>& blocks)
+{
+    /* Write a private copy and rename it, so readers never see half */
+    std::string tmp = file + "." + std::to_string(getpid());
+    {
+	std::ofstream os(tmp, std::ios::binary);
+	Put(os, BlockCacheMagic);
+	Put(os, BlockCacheVersion);
+	Put(os, InstrSetVersion);
+	Put(os, key);
+	Put(os, static_cast<uint32_t>(blocks.size()));
+	for(auto b : blocks)
+	{
+	    Put(os, b->start);
+	    Put(os, b->end);
+	    for(auto w : b->words)
+	    {
+		Put(os, w);
+	    }
+	}
+	if (!os.flush())
+	{
+	    std::remove(tmp.c_str());
+	    return false;
+	}
+    }
+    return std::rename(tmp.c_str(), file.c_str()) == 0;
+}
+
+static bool LoadBlock(std::istream& is, CodeBlock& block)
+{
+    if (!Get(is, block.start) || !Get(is, block.end) ||
+	block.end <= block.start || (block.start | block.end) & 3 ||
+	(block.end - block.start) / 4 > MaxCachedWords)
+    {
+	return false;
+    }
+    block.words.resize((block.end - block.start) / 4);
+    for(auto& w : block.words)
+    {
+	if (!Get(is, w))
+	{
+	    return false;
+	}
+    }
+    return true;
+}
+
+bool LoadBlockCache(const std::string& file, uint64_t key,
+		    std::vector<CodeBlock*>& blocks)
+{
+    std::ifstream is(file, std::ios::binary);
+    uint32_t magic;
+    uint32_t version;
+    uint32_t instrSet;
+    uint64_t fileKey;
+    uint32_t count;
+    if (!Get(is, magic) || magic != BlockCacheMagic ||
+	!Get(is, version) || version != BlockCacheVersion ||
+	!Get(is, instrSet) || instrSet != InstrSetVersion ||
+	!Get(is, fileKey) || fileKey != key || !Get(is, count))
+    {
+	return false;
+    }
+    for(uint32_t i = 0; i < count; i++)
+    {
+	CodeBlock* block = new CodeBlock;
+	blocks.push_back(block);
+	if (!LoadBlock(is, *block))
+	{
+	    for(auto b : blocks)
+	    {
+		delete b;
+	    }
+	    blocks.clear();
+	    return false;
+	}
+    }
+    return true;
+}
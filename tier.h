@@ -0,0 +1,60 @@
+#ifndef TIER_H
+#define TIER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "cpu.h"
+
+/*
+  Compiles recorded blocks on a background thread, so the interpreter
+  carries on while it happens. Finished blocks are collected with
+  TakeDone, which the CPU calls between blocks when Ready says there
+  is something to pick up.
+*/
+class BlockCompiler
+{
+public:
+    typedef void (*CompileFunc)(CodeBlock& block);
+
+    BlockCompiler(CompileFunc fn);
+    ~BlockCompiler();
+    void Submit(CodeBlock* block);
+    bool Ready() { return ready.load(std::memory_order_acquire); }
+    std::vector<CodeBlock*> TakeDone();
+
+private:
+    void Worker();
+
+    CompileFunc compile;
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<CodeBlock*> queue;
+    std::vector<CodeBlock*> done;
+    std::atomic<bool> ready;
+    bool stop;
+};
+
+/*
+  Compiled blocks can be saved and preloaded by a later run of the same
+  image. The file holds the format version, InstrSetVersion and a key
+  identifying the image, then for each block its range and the memory
+  it was compiled from. Bump the format version for changes to how
+  blocks are recorded, as well as to the file. The instructions are
+  decoded from that again on loading, and checked against memory before
+  use, so the file can't make a block run anything memory doesn't hold.
+*/
+const uint32_t BlockCacheVersion = 3;
+
+bool SaveBlockCache(const std::string& file, uint64_t key,
+		    const std::vector<const CodeBlock*>& blocks);
+/* Returns false, with no blocks, if the file is missing or doesn't match */
+bool LoadBlockCache(const std::string& file, uint64_t key,
+		    std::vector<CodeBlock*>& blocks);
+
+#endif
@@ -0,0 +1,24 @@
+	;; Single step this through to the halt: the divide by zero and the
+	;; illegal instruction go to the handler, so it ends with r0 = 2
+	mov	stack,sp
+	mov	ttab,r1
+	mov	handler,(r1)
+	mov	handler,4(r1)
+	mov	ttab,r0
+	emt	20
+	mov	#0,r0
+	mov	#0,r6
+	div	r6,r2
+	.long	0xfe000000
+	hlt
+
+handler:
+	add	#1,r0
+	add	#4,4(sp)
+	rti
+
+	.align	4
+ttab:
+	.zero	32
+	.zero	64
+stack: